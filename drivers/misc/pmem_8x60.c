@@ -33,6 +33,11 @@
 #include <asm/cacheflush.h>
 #include <asm/sizes.h>
 #include <linux/pm_runtime.h>
+#include <linux/workqueue.h>
+#ifdef CONFIG_ANDROID_PMEM_BITMAP_SELFTEST
+#include <linux/random.h>
+#include <linux/ktime.h>
+#endif
 
 #define PMEM_MAX_USER_SPACE_DEVICES (10)
 #define PMEM_MAX_KERNEL_SPACE_DEVICES (2)
@@ -45,6 +50,7 @@
 #define PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS (64)
 
 #define PMEM_32BIT_WORD_ORDER (5)
+#define PMEM_BITS_PER_WORD (1 << PMEM_32BIT_WORD_ORDER)
 #define PMEM_BITS_PER_WORD_MASK (BITS_PER_LONG - 1)
 
 #ifdef CONFIG_ANDROID_PMEM_DEBUG
@@ -55,6 +61,9 @@
 
 #define SYSTEM_ALLOC_RETRY 10
 
+/* pages mapped by one fault on a lazily mapped allocation */
+#define PMEM_FAULT_AROUND 16
+
 /* indicates that a refernce to this file has been taken via get_pmem_file,
  * the file should not be released until put_pmem_file is called */
 #define PMEM_FLAGS_BUSY 0x1
@@ -70,6 +79,9 @@
  */
 #define PMEM_FLAGS_SUBMAP 0x1 << 3
 #define PMEM_FLAGS_UNSUBMAP 0x1 << 4
+/* the physical address was handed to user space by PMEM_GET_PHYS, which
+ * pinned the allocation for as long as the file is open */
+#define PMEM_FLAGS_PHYS 0x1 << 5
 
 struct pmem_data {
 	/* in alloc mode: an index into the bitmap
@@ -95,6 +107,15 @@ struct pmem_data {
 	struct list_head region_list;
 	/* a linked list of data so we can access them for debugging */
 	struct list_head list;
+	/* non-zero while the physical address of the allocation is known
+	 * outside this file (get_pmem_file, connected files, copied vmas);
+	 * a pinned allocation is never migrated */
+	atomic_t pinned;
+	/* the open file holds one reference, compaction one while the data
+	 * is on its candidate list; freed when the last one goes */
+	atomic_t users;
+	/* entry in the candidate list of a running compaction */
+	struct list_head compact_list;
 #if PMEM_DEBUG
 	int ref;
 #endif
@@ -105,6 +126,22 @@ struct pmem_bits {
 	unsigned order:7;		/* size of the region in pmem space */
 };
 
+/* free quanta in the span of bitmap words under a summary tree node */
+struct pmem_bits_summary {
+	uint32_t pre;			/* free run at the start of the span */
+	uint32_t suf;			/* free run at the end of the span */
+	uint32_t best;			/* longest free run in the span */
+};
+
+/* a complete binary tree over the allocation bitmap words, in heap order
+ * with the root at node[1] and word w at node[leaves + w], so a free run
+ * of a given length is found in O(log n) instead of a linear scan */
+struct pmem_bitmap_tree {
+	int leaves;			/* power of two >= bitmap words */
+	int total_bits;			/* bits past this count as used */
+	struct pmem_bits_summary *node;
+};
+
 struct pmem_region_node {
 	struct pmem_region region;
 	struct list_head list;
@@ -211,7 +248,10 @@ struct pmem_info {
 			struct {
 				short bit;
 				unsigned short quanta;
+				/* alignment of the allocation in quanta */
+				unsigned short spacing;
 			} *bitm_alloc;
+			struct pmem_bitmap_tree tree;
 		} bitmap;
 
 		struct {
@@ -235,6 +275,25 @@ struct pmem_info {
 	 */
 	struct mutex arena_mutex;
 
+	/* movable allocator: deferred compaction and its counters, the
+	 * counters are protected by arena_mutex. compact_mutex lets one
+	 * compaction run at a time */
+	struct mutex compact_mutex;
+	struct work_struct compact_work;
+	unsigned long compactions;
+	unsigned long migrations;
+	unsigned long migrated_bytes;
+	unsigned long migrate_pinned;
+
+	/* user mappings set up by mmap, torn down when that vma closes, and
+	 * of those set up how many mapped an allocation again; faults and
+	 * the pages they inserted for lazily mapped allocations */
+	atomic_t map_setups;
+	atomic_t map_teardowns;
+	atomic_t map_reuses;
+	atomic_t map_faults;
+	atomic_t map_fault_pages;
+
 	long (*ioctl)(struct file *, unsigned int, unsigned long);
 	int (*release)(struct inode *, struct file *);
 };
@@ -368,6 +427,8 @@ static ssize_t show_pmem_allocator_type(int id, char *buf)
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "Buddy Bestfit");
 	case  PMEM_ALLOCATORTYPE_BITMAP:
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "Bitmap");
+	case  PMEM_ALLOCATORTYPE_MOVABLE:
+		return scnprintf(buf, PAGE_SIZE, "%s\n", "Movable bitmap");
 	case PMEM_ALLOCATORTYPE_SYSTEM:
 		return scnprintf(buf, PAGE_SIZE, "%s\n", "System heap");
 	default:
@@ -413,11 +474,25 @@ static ssize_t show_pmem_mapped_regions(int id, char *buf)
 }
 RO_PMEM_ATTR(mapped_regions);
 
+static ssize_t show_pmem_map_stats(int id, char *buf)
+{
+	return scnprintf(buf, PAGE_SIZE,
+		"setups: %d\nteardowns: %d\nreuses: %d\nfaults: %d\n"
+		"fault_pages: %d\n",
+		atomic_read(&pmem[id].map_setups),
+		atomic_read(&pmem[id].map_teardowns),
+		atomic_read(&pmem[id].map_reuses),
+		atomic_read(&pmem[id].map_faults),
+		atomic_read(&pmem[id].map_fault_pages));
+}
+RO_PMEM_ATTR(map_stats);
+
 #define PMEM_COMMON_SYSFS_ATTRS \
 	&pmem_attr_base.attr, \
 	&pmem_attr_size.attr, \
 	&pmem_attr_allocator_type.attr, \
-	&pmem_attr_mapped_regions.attr
+	&pmem_attr_mapped_regions.attr, \
+	&pmem_attr_map_stats.attr
 
 
 static ssize_t show_pmem_allocated(int id, char *buf)
@@ -509,6 +584,88 @@ static ssize_t show_pmem_free_quanta(int id, char *buf)
 }
 RO_PMEM_ATTR(free_quanta);
 
+/* walk the allocation bitmap and measure its free runs, caller should hold
+ * the lock on arena_mutex! */
+static void pmem_bitmap_free_extents(int id, unsigned int *extents,
+		unsigned int *largest)
+{
+	uint32_t *bitp = pmem[id].allocator.bitmap.bitmap;
+	unsigned int run = 0;
+	int bit = 0;
+
+	*extents = 0;
+	*largest = 0;
+	while (bit < pmem[id].num_entries) {
+		uint32_t word = bitp[bit >> PMEM_32BIT_WORD_ORDER];
+
+		/* whole words are common in a large region, step over them */
+		if (!(bit & PMEM_BITS_PER_WORD_MASK) &&
+				bit + BITS_PER_LONG <= pmem[id].num_entries &&
+				(word == 0 || word == ~0U)) {
+			if (word) {
+				run = 0;
+			} else {
+				if (!run)
+					(*extents)++;
+				run += BITS_PER_LONG;
+				if (run > *largest)
+					*largest = run;
+			}
+			bit += BITS_PER_LONG;
+			continue;
+		}
+
+		if (word & (1U << (bit & PMEM_BITS_PER_WORD_MASK))) {
+			run = 0;
+		} else {
+			if (!run)
+				(*extents)++;
+			if (++run > *largest)
+				*largest = run;
+		}
+		bit++;
+	}
+}
+
+static ssize_t show_pmem_free_extents(int id, char *buf)
+{
+	unsigned int extents, largest;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	pmem_bitmap_free_extents(id, &extents, &largest);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", extents);
+}
+RO_PMEM_ATTR(free_extents);
+
+static ssize_t show_pmem_largest_free_quanta(int id, char *buf)
+{
+	unsigned int largest;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	largest = pmem[id].allocator.bitmap.tree.node[1].best;
+	mutex_unlock(&pmem[id].arena_mutex);
+	return scnprintf(buf, PAGE_SIZE, "%u\n", largest);
+}
+RO_PMEM_ATTR(largest_free_quanta);
+
+/* percentage of the free quanta that lie outside the largest free run,
+ * 0 when all free space is contiguous */
+static ssize_t show_pmem_fragmentation(int id, char *buf)
+{
+	unsigned int extents, largest, free, frag = 0;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	pmem_bitmap_free_extents(id, &extents, &largest);
+	free = pmem[id].allocator.bitmap.bitmap_free;
+	mutex_unlock(&pmem[id].arena_mutex);
+
+	if (free)
+		frag = (free - largest) * 100 / free;
+	return scnprintf(buf, PAGE_SIZE, "%u\n", frag);
+}
+RO_PMEM_ATTR(fragmentation);
+
 static ssize_t show_pmem_bits_allocated(int id, char *buf)
 {
 	ssize_t ret;
@@ -539,11 +696,54 @@ static struct attribute *pmem_bitmap_attrs[] = {
 	PMEM_BITMAP_BUDDY_BESTFIT_COMMON_SYSFS_ATTRS,
 
 	&pmem_attr_free_quanta.attr,
+	&pmem_attr_free_extents.attr,
+	&pmem_attr_largest_free_quanta.attr,
+	&pmem_attr_fragmentation.attr,
 	&pmem_attr_bits_allocated.attr,
 
 	NULL
 };
 
+static void pmem_compact(int id);
+
+static ssize_t show_pmem_compaction_stats(int id, char *buf)
+{
+	ssize_t ret;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	ret = scnprintf(buf, PAGE_SIZE,
+		"compactions: %lu\nmigrations: %lu\nmigrated_bytes: %lu\n"
+		"pinned_skips: %lu\n",
+		pmem[id].compactions, pmem[id].migrations,
+		pmem[id].migrated_bytes, pmem[id].migrate_pinned);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return ret;
+}
+RO_PMEM_ATTR(compaction_stats);
+
+static ssize_t store_pmem_compact(int id, const char *buf, size_t count)
+{
+	pmem_compact(id);
+	return count;
+}
+WO_PMEM_ATTR(compact);
+
+static struct attribute *pmem_movable_attrs[] = {
+	PMEM_COMMON_SYSFS_ATTRS,
+
+	PMEM_BITMAP_BUDDY_BESTFIT_COMMON_SYSFS_ATTRS,
+
+	&pmem_attr_free_quanta.attr,
+	&pmem_attr_free_extents.attr,
+	&pmem_attr_largest_free_quanta.attr,
+	&pmem_attr_fragmentation.attr,
+	&pmem_attr_bits_allocated.attr,
+	&pmem_attr_compaction_stats.attr,
+	&pmem_attr_compact.attr,
+
+	NULL
+};
+
 static struct attribute *pmem_system_attrs[] = {
 	PMEM_COMMON_SYSFS_ATTRS,
 
@@ -555,6 +755,11 @@ static struct kobj_type pmem_bitmap_ktype = {
 	.default_attrs = pmem_bitmap_attrs,
 };
 
+static struct kobj_type pmem_movable_ktype = {
+	.sysfs_ops = &pmem_ops,
+	.default_attrs = pmem_movable_attrs,
+};
+
 static struct kobj_type pmem_system_ktype = {
 	.sysfs_ops = &pmem_ops,
 	.default_attrs = pmem_system_attrs,
@@ -729,6 +934,162 @@ static void bitmap_bits_clear_all(uint32_t *bitp, int bit_start, int bit_end)
 	}
 }
 
+/* the used bits of bitmap word w, with the bits past the end of the
+ * region reported as used */
+static uint32_t bitmap_tree_word(struct pmem_bitmap_tree *t, uint32_t *bitp,
+		int w)
+{
+	int valid = t->total_bits - (w << PMEM_32BIT_WORD_ORDER);
+
+	if (valid <= 0)
+		return ~0U;
+	if (valid < PMEM_BITS_PER_WORD)
+		return bitp[w] | (~0U << valid);
+	return bitp[w];
+}
+
+static void bitmap_tree_leaf(struct pmem_bits_summary *n, uint32_t used)
+{
+	uint32_t free = ~used;
+	int run = 0;
+
+	if (!used) {
+		n->pre = n->suf = n->best = PMEM_BITS_PER_WORD;
+		return;
+	}
+	n->pre = __ffs(used);
+	n->suf = PMEM_BITS_PER_WORD - fls(used);
+	/* each step shortens every run of ones by one */
+	while (free) {
+		free &= free << 1;
+		run++;
+	}
+	n->best = run;
+}
+
+static void bitmap_tree_join(struct pmem_bits_summary *n,
+		const struct pmem_bits_summary *l,
+		const struct pmem_bits_summary *r, uint32_t half)
+{
+	n->pre = l->pre == half ? half + r->pre : l->pre;
+	n->suf = r->suf == half ? half + l->suf : r->suf;
+	n->best = max(max(l->best, r->best), l->suf + r->pre);
+}
+
+/* refresh the summaries over bits [bit_start, bit_end) after the bitmap
+ * changed there, O(words touched + log n) */
+static void bitmap_tree_update(struct pmem_bitmap_tree *t, uint32_t *bitp,
+		int bit_start, int bit_end)
+{
+	int first, last, i;
+	uint32_t half = PMEM_BITS_PER_WORD;
+
+	if (bit_end <= bit_start)
+		return;
+	first = bit_start >> PMEM_32BIT_WORD_ORDER;
+	last = (bit_end - 1) >> PMEM_32BIT_WORD_ORDER;
+	for (i = first; i <= last; i++)
+		bitmap_tree_leaf(&t->node[t->leaves + i],
+			bitmap_tree_word(t, bitp, i));
+
+	for (first = (t->leaves + first) >> 1, last = (t->leaves + last) >> 1;
+			first; first >>= 1, last >>= 1, half <<= 1)
+		for (i = first; i <= last; i++)
+			bitmap_tree_join(&t->node[i], &t->node[2 * i],
+				&t->node[2 * i + 1], half);
+}
+
+static int bitmap_tree_init(struct pmem_bitmap_tree *t, uint32_t *bitp,
+		int total_bits)
+{
+	int words = (total_bits + PMEM_BITS_PER_WORD - 1) >>
+		PMEM_32BIT_WORD_ORDER;
+
+	t->total_bits = total_bits;
+	t->leaves = roundup_pow_of_two(max(words, 1));
+	t->node = kcalloc(2 * t->leaves, sizeof(*t->node), GFP_KERNEL);
+	if (!t->node)
+		return -ENOMEM;
+	/* padding leaves past the bitmap are fully used */
+	bitmap_tree_update(t, bitp, 0, t->leaves << PMEM_32BIT_WORD_ORDER);
+	return 0;
+}
+
+static void bitmap_tree_free(struct pmem_bitmap_tree *t)
+{
+	kfree(t->node);
+	t->node = NULL;
+}
+
+/* leftmost start >= from of num_bits free bits in the span [lo, lo + size)
+ * of node n. *carry is the free run ending just before lo and is updated to
+ * the free run ending at lo + size when nothing is found. Only the nodes on
+ * the path to from and a single path down to the answer are visited. */
+static int bitmap_tree_search(struct pmem_bitmap_tree *t, uint32_t *bitp,
+		int n, int lo, int size, int from, int num_bits, int *carry)
+{
+	const struct pmem_bits_summary *s = &t->node[n];
+	int half, ret;
+
+	if (lo + size <= from) {
+		*carry = 0;
+		return -1;
+	}
+	if (lo >= from) {
+		if (*carry + s->pre >= num_bits)
+			return lo - *carry;
+		if (s->best < num_bits) {
+			*carry = s->pre == size ? *carry + size : s->suf;
+			return -1;
+		}
+	}
+	if (size == PMEM_BITS_PER_WORD) {
+		uint32_t used = bitmap_tree_word(t, bitp,
+			lo >> PMEM_32BIT_WORD_ORDER);
+		int bit;
+
+		for (bit = max(from, lo) - lo; bit < size; bit++) {
+			if (used & (1U << bit))
+				*carry = 0;
+			else if (++*carry >= num_bits)
+				return lo + bit + 1 - num_bits;
+		}
+		return -1;
+	}
+
+	half = size >> 1;
+	ret = bitmap_tree_search(t, bitp, 2 * n, lo, half, from, num_bits,
+		carry);
+	if (ret >= 0)
+		return ret;
+	return bitmap_tree_search(t, bitp, 2 * n + 1, lo + half, half, from,
+		num_bits, carry);
+}
+
+/* lowest start that is a multiple of spacing with num_bits free bits
+ * ending at or before total_bits, the same answer the linear scan in
+ * bitmap_allocate_contiguous gives */
+static int bitmap_tree_find(struct pmem_bitmap_tree *t, uint32_t *bitp,
+		int num_bits, int total_bits, int spacing)
+{
+	int from = 0, bit, carry;
+
+	if (num_bits <= 0)
+		return -1;
+	for (;;) {
+		carry = 0;
+		bit = bitmap_tree_search(t, bitp, 1, 0,
+			t->leaves << PMEM_32BIT_WORD_ORDER, from, num_bits,
+			&carry);
+		if (bit < 0 || bit + num_bits > total_bits)
+			return -1;
+		if (!(bit & (spacing - 1)))
+			return bit;
+		/* nothing starts free between here and the next aligned bit */
+		from = ALIGN(bit, spacing);
+	}
+}
+
 static int pmem_free_bitmap(int id, int bitnum)
 {
 	/* caller should hold the lock on arena_mutex! */
@@ -747,6 +1108,9 @@ static int pmem_free_bitmap(int id, int bitnum)
 
 			bitmap_bits_clear_all(pmem[id].allocator.bitmap.bitmap,
 				curr_bit, curr_bit + curr_quanta);
+			bitmap_tree_update(&pmem[id].allocator.bitmap.tree,
+				pmem[id].allocator.bitmap.bitmap,
+				curr_bit, curr_bit + curr_quanta);
 			pmem[id].allocator.bitmap.bitmap_free += curr_quanta;
 			pmem[id].allocator.bitmap.bitm_alloc[i].bit = -1;
 			pmem[id].allocator.bitmap.bitm_alloc[i].quanta = 0;
@@ -839,6 +1203,12 @@ static int pmem_free_space_system(int id, struct pmem_freespace *fs)
 
 static void pmem_revoke(struct file *file, struct pmem_data *data);
 
+static void pmem_data_put(struct pmem_data *data)
+{
+	if (atomic_dec_and_test(&data->users))
+		kfree(data);
+}
+
 static int pmem_release(struct inode *inode, struct file *file)
 {
 	struct pmem_data *data = file->private_data;
@@ -880,6 +1250,12 @@ static int pmem_release(struct inode *inode, struct file *file)
 		mutex_lock(&pmem[id].arena_mutex);
 		ret = pmem[id].free(id, data->index);
 		mutex_unlock(&pmem[id].arena_mutex);
+		/* a compaction may still hold the data; nothing to move */
+		data->index = -1;
+	}
+	if (data->flags & PMEM_FLAGS_PHYS) {
+		data->flags &= ~PMEM_FLAGS_PHYS;
+		atomic_dec(&data->pinned);
 	}
 
 	/* if this file is a submap (mapped, connected file), downref the
@@ -900,7 +1276,7 @@ static int pmem_release(struct inode *inode, struct file *file)
 	BUG_ON(!list_empty(&data->region_list));
 
 	up_write(&data->sem);
-	kfree(data);
+	pmem_data_put(data);
 	if (pmem[id].release)
 		ret = pmem[id].release(inode, file);
 
@@ -933,6 +1309,9 @@ static int pmem_open(struct inode *inode, struct file *file)
 	data->vma = NULL;
 	data->pid = 0;
 	data->master_file = NULL;
+	atomic_set(&data->pinned, 0);
+	atomic_set(&data->users, 1);
+	INIT_LIST_HEAD(&data->compact_list);
 #if PMEM_DEBUG
 	data->ref = 0;
 #endif
@@ -1072,6 +1451,8 @@ static void bitmap_bits_set_all(uint32_t *bitp, int bit_start, int bit_end)
 	}
 }
 
+#ifdef CONFIG_ANDROID_PMEM_BITMAP_SELFTEST
+/* the original linear scan, kept as the reference for the selftest */
 static int
 bitmap_allocate_contiguous(uint32_t *bitp, int num_bits_to_alloc,
 		int total_bits, int spacing)
@@ -1128,6 +1509,22 @@ bitmap_allocate_contiguous(uint32_t *bitp, int num_bits_to_alloc,
 	}
 	return -1;
 }
+#endif
+
+static int bitmap_tree_allocate(struct pmem_bitmap_tree *t, uint32_t *bitp,
+		int num_bits_to_alloc, int total_bits, int spacing)
+{
+	int bit_start = bitmap_tree_find(t, bitp, num_bits_to_alloc,
+		total_bits, spacing);
+
+	if (bit_start >= 0) {
+		bitmap_bits_set_all(bitp, bit_start,
+			bit_start + num_bits_to_alloc);
+		bitmap_tree_update(t, bitp, bit_start,
+			bit_start + num_bits_to_alloc);
+	}
+	return bit_start;
+}
 
 static int reserve_quanta(const unsigned int quanta_needed,
 		const int id,
@@ -1159,7 +1556,8 @@ static int reserve_quanta(const unsigned int quanta_needed,
 	spacing = align / pmem[id].quantum;
 	spacing = spacing > 1 ? spacing : 1;
 
-	ret = bitmap_allocate_contiguous(pmem[id].allocator.bitmap.bitmap,
+	ret = bitmap_tree_allocate(&pmem[id].allocator.bitmap.tree,
+		pmem[id].allocator.bitmap.bitmap,
 		quanta_needed,
 		(pmem[id].size + pmem[id].quantum - 1) / pmem[id].quantum,
 		spacing);
@@ -1270,6 +1668,8 @@ static int pmem_allocator_bitmap(const int id,
 	pmem[id].allocator.bitmap.bitmap_free -= quanta_needed;
 	pmem[id].allocator.bitmap.bitm_alloc[i].bit = bitnum;
 	pmem[id].allocator.bitmap.bitm_alloc[i].quanta = quanta_needed;
+	pmem[id].allocator.bitmap.bitm_alloc[i].spacing =
+		max(align / pmem[id].quantum, 1U);
 leave:
 	return bitnum;
 }
@@ -1505,8 +1905,15 @@ static void pmem_vma_open(struct vm_area_struct *vma)
 	 * ranges via fork */
 	down_read(&data->sem);
 	BUG_ON(!has_allocation(file));
-	/* remap the garbage pages, forkers don't get access to the data */
-	pmem_unmap_pfn_range(id, vma, data, 0, vma->vm_start - vma->vm_end);
+	/* data->vma no longer describes every mapping of the allocation */
+	atomic_inc(&data->pinned);
+	/* remap the garbage pages, forkers don't get access to the data;
+	 * copy_page_range has already handed a lazily mapped vma whatever
+	 * the parent had faulted in, so it needs this as well. split_vma
+	 * opens the pieces of the owner's own mapping, which keep theirs */
+	if (!data->vma || data->vma->vm_mm != vma->vm_mm)
+		pmem_unmap_pfn_range(id, vma, data, 0,
+				     vma->vm_end - vma->vm_start);
 	up_read(&data->sem);
 }
 
@@ -1543,22 +1950,68 @@ static void pmem_vma_close(struct vm_area_struct *vma)
 		if ((data->flags & PMEM_FLAGS_CONNECTED) &&
 		    (data->flags & PMEM_FLAGS_SUBMAP))
 			data->flags |= PMEM_FLAGS_UNSUBMAP;
+		atomic_inc(&pmem[get_id(file)].map_teardowns);
 	}
 	/* the kernel is going to free this vma now anyway */
 	up_write(&data->sem);
 }
 
+/* populate a lazily mapped master: the faulting page and the few after it
+ * go in together. The page frame comes from vm_pgoff, which mmap and
+ * migration point at the start of the allocation. A copy of the vma in
+ * another mm (fork) only ever sees the garbage page. */
+static int pmem_vma_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct file *file = vma->vm_file;
+	struct pmem_data *data = file->private_data;
+	int id = get_id(file);
+	unsigned long addr = (unsigned long)vmf->virtual_address & PAGE_MASK;
+	unsigned long end = min(addr + (PMEM_FAULT_AROUND << PAGE_SHIFT),
+				vma->vm_end);
+	unsigned long pfn = vmf->pgoff;
+	int foreign, err, pages = 0, ret = VM_FAULT_NOPAGE;
+
+	down_read(&data->sem);
+	foreign = !data->vma || data->vma->vm_mm != vma->vm_mm;
+	for (; addr < end; addr += PAGE_SIZE, pfn++) {
+		err = vm_insert_pfn(vma, addr,
+			foreign ? pmem[id].garbage_pfn : pfn);
+		/* already there, another thread got to it first */
+		if (err == -EBUSY)
+			continue;
+		if (err) {
+			if (!pages)
+				ret = err == -ENOMEM ? VM_FAULT_OOM :
+					VM_FAULT_SIGBUS;
+			break;
+		}
+		pages++;
+	}
+	up_read(&data->sem);
+
+	atomic_inc(&pmem[id].map_faults);
+	atomic_add(pages, &pmem[id].map_fault_pages);
+	return ret;
+}
+
 static struct vm_operations_struct vm_ops = {
 	.open = pmem_vma_open,
 	.close = pmem_vma_close,
 };
 
+static struct vm_operations_struct lazy_vm_ops = {
+	.open = pmem_vma_open,
+	.close = pmem_vma_close,
+	.fault = pmem_vma_fault,
+};
+
 static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct pmem_data *data = file->private_data;
-	int index;
+	int index, reuse = 0;
 	unsigned long vma_size =  vma->vm_end - vma->vm_start;
 	int ret = 0, id = get_id(file);
+	struct vm_operations_struct *ops = &vm_ops;
 
 	if (!data) {
 		pr_err("pmem: Invalid file descriptor, no private data\n");
@@ -1580,8 +2033,11 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 
 	down_write(&data->sem);
 	/* check this file isn't already mmaped, for submaps check this file
-	 * has never been mmaped */
-	if ((data->flags & PMEM_FLAGS_MASTERMAP) ||
+	 * has never been mmaped. A master whose mapping has gone may be
+	 * mapped again, keeping its allocation */
+	if ((data->flags & PMEM_FLAGS_MASTERMAP) && !data->vma) {
+		reuse = 1;
+	} else if ((data->flags & PMEM_FLAGS_MASTERMAP) ||
 	    (data->flags & PMEM_FLAGS_SUBMAP) ||
 	    (data->flags & PMEM_FLAGS_UNSUBMAP)) {
 #if PMEM_DEBUG
@@ -1602,6 +2058,11 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		if (index == -1) {
 			pr_err("pmem: mmap unable to allocate memory"
 				"on %s\n", get_name(file));
+			/* the mmap_sem is held here, so compacting now would
+			 * invert the lock order; let a retry find the space */
+			if (pmem[id].allocator_type ==
+					PMEM_ALLOCATORTYPE_MOVABLE)
+				schedule_work(&pmem[id].compact_work);
 			ret = -ENOMEM;
 			goto error;
 		}
@@ -1654,15 +2115,27 @@ static int pmem_mmap(struct file *file, struct vm_area_struct *vma)
 		DLOG("submmapped file %p vma %p pid %u\n", file, vma,
 		     current->pid);
 	} else {
-		if (pmem_map_pfn_range(id, vma, data, 0, vma_size)) {
+		if (vma->vm_flags & VM_SHARED) {
+			/* nothing is mapped until it is touched, so mapping
+			 * a buffer each frame costs only the pages used */
+			vma->vm_flags |= VM_IO | VM_RESERVED | VM_PFNMAP |
+				VM_DONTEXPAND;
+			ops = &lazy_vm_ops;
+		} else if (pmem_map_pfn_range(id, vma, data, 0, vma_size)) {
+			/* private mappings need the pages up front, faults
+			 * can't insert pfns into a cow mapping */
 			pr_err("pmem: mmap failed in kernel!\n");
 			ret = -EAGAIN;
 			goto error;
 		}
 		data->flags |= PMEM_FLAGS_MASTERMAP;
+		data->vma = vma;
 		data->pid = current->pid;
 	}
-	vma->vm_ops = &vm_ops;
+	vma->vm_ops = ops;
+	atomic_inc(&pmem[id].map_setups);
+	if (reuse)
+		atomic_inc(&pmem[id].map_reuses);
 error:
 	up_write(&data->sem);
 	return ret;
@@ -1719,6 +2192,8 @@ int get_pmem_addr(struct file *file, unsigned long *start,
 			*len = pmem[id].len(id, data);
 			*vstart = (unsigned long)
 				pmem_start_vaddr(id, data);
+			/* the caller now holds the physical address */
+			atomic_inc(&data->pinned);
 			up_read(&data->sem);
 #if PMEM_DEBUG
 			down_write(&data->sem);
@@ -1784,9 +2259,10 @@ void put_pmem_file(struct file *file)
 		get_task_comm(currtask_name, current), file,
 		file_count(file), get_name(file), get_id(file));
 	if (is_pmem_file(file)) {
-#if PMEM_DEBUG
 		struct pmem_data *data = file->private_data;
 
+		atomic_dec(&data->pinned);
+#if PMEM_DEBUG
 		down_write(&data->sem);
 		if (!data->ref--) {
 			data->ref++;
@@ -2151,6 +2627,9 @@ static int pmem_connect(unsigned long connect, struct file *file)
 			struct pmem_data *data;
 			int src_index = src_data->index;
 
+			/* the connected file keeps src_index, so the master
+			 * allocation may never move again */
+			atomic_inc(&src_data->pinned);
 			up_read(&src_data->sem);
 
 			data = file->private_data;
@@ -2402,6 +2881,227 @@ static void pmem_revoke(struct file *file, struct pmem_data *data)
 	pmem_unlock_data_and_mm(data, mm);
 }
 
+/* take the candidate with the lowest index at or above cursor off the
+ * list, NULL if there is none. Allocations freed since the list was built
+ * are dropped from it on the way */
+static struct pmem_data *pmem_next_movable(struct list_head *candidates,
+		int cursor)
+{
+	struct pmem_data *data, *tmp, *next = NULL;
+	int index, next_index = INT_MAX;
+
+	list_for_each_entry_safe(data, tmp, candidates, compact_list) {
+		down_read(&data->sem);
+		index = data->index;
+		up_read(&data->sem);
+		if (index == -1) {
+			list_del_init(&data->compact_list);
+			pmem_data_put(data);
+		} else if (index >= cursor && index < next_index) {
+			next = data;
+			next_index = index;
+		}
+	}
+	if (next)
+		list_del_init(&next->compact_list);
+	return next;
+}
+
+/* move one allocation to the lowest free run below it that keeps its
+ * alignment. The user mapping, if any, is zapped for the copy and mapped
+ * again at the new address; faults in between wait on the mmap_sem. Returns
+ * the bit just past the allocation, where the next search starts. */
+static int pmem_migrate(int id, struct pmem_data *data)
+{
+	struct mm_struct *mm = NULL;
+	int i, from, to, quanta, next;
+	unsigned long len;
+	unsigned char __iomem *vto;
+
+	/* same dance as pmem_lock_data_and_mm, but masters have no task */
+	down_read(&data->sem);
+	next = data->index + 1;
+	if (data->vma) {
+		mm = data->vma->vm_mm;
+		/* the mm is being torn down and the vma with it */
+		if (!atomic_inc_not_zero(&mm->mm_users)) {
+			up_read(&data->sem);
+			return next;
+		}
+	}
+	up_read(&data->sem);
+
+	if (mm)
+		down_write(&mm->mmap_sem);
+	down_write(&data->sem);
+
+	from = data->index;
+	if (from == -1)
+		goto out;
+	next = from + 1;
+	/* mmaped after we looked, or the vma went away and came back */
+	if (data->vma && data->vma->vm_mm != mm)
+		goto out;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	for (i = 0; i < pmem[id].allocator.bitmap.bitmap_allocs; i++)
+		if (pmem[id].allocator.bitmap.bitm_alloc[i].bit == from)
+			break;
+	if (i >= pmem[id].allocator.bitmap.bitmap_allocs)
+		goto out_unlock;
+
+	quanta = pmem[id].allocator.bitmap.bitm_alloc[i].quanta;
+	next = from + quanta;
+	if (atomic_read(&data->pinned)) {
+		pmem[id].migrate_pinned++;
+		goto out_unlock;
+	}
+
+	/* let the search consider runs that overlap the allocation itself,
+	 * but only those that start below it */
+	bitmap_bits_clear_all(pmem[id].allocator.bitmap.bitmap,
+		from, from + quanta);
+	bitmap_tree_update(&pmem[id].allocator.bitmap.tree,
+		pmem[id].allocator.bitmap.bitmap, from, from + quanta);
+	to = bitmap_tree_allocate(&pmem[id].allocator.bitmap.tree,
+		pmem[id].allocator.bitmap.bitmap,
+		quanta, from + quanta - 1,
+		pmem[id].allocator.bitmap.bitm_alloc[i].spacing);
+	if (to < 0) {
+		bitmap_bits_set_all(pmem[id].allocator.bitmap.bitmap,
+			from, from + quanta);
+		bitmap_tree_update(&pmem[id].allocator.bitmap.tree,
+			pmem[id].allocator.bitmap.bitmap, from, from + quanta);
+		goto out_unlock;
+	}
+
+	DLOG("migrate id %d bit %d -> %d, %d quanta\n", id, from, to, quanta);
+
+	len = quanta * pmem[id].quantum;
+	if (data->vma)
+		zap_page_range(data->vma, data->vma->vm_start,
+			data->vma->vm_end - data->vma->vm_start, NULL);
+
+	vto = pmem[id].vbase + to * pmem[id].quantum;
+	memmove(vto, pmem[id].vbase + from * pmem[id].quantum, len);
+	if (pmem[id].cached) {
+		/* push the new copy out for devices and drop any dirty
+		 * lines left behind in the old range */
+		dmac_flush_range(vto, vto + (next - to) * pmem[id].quantum);
+#ifdef CONFIG_OUTER_CACHE
+		outer_flush_range(paddr_from_bit(id, to),
+			paddr_from_bit(id, next));
+#endif
+	}
+
+	pmem[id].allocator.bitmap.bitm_alloc[i].bit = to;
+	data->index = to;
+	next = to + quanta;
+	pmem[id].migrations++;
+	pmem[id].migrated_bytes += len;
+	mutex_unlock(&pmem[id].arena_mutex);
+
+	/* a lazily mapped vma just needs to know where to fault from */
+	if (data->vma && data->vma->vm_ops == &lazy_vm_ops)
+		data->vma->vm_pgoff = paddr_from_bit(id, to) >> PAGE_SHIFT;
+	else if (data->vma && pmem_map_pfn_range(id, data->vma, data, 0,
+				data->vma->vm_end - data->vma->vm_start)) {
+		pr_err("pmem: %s: unable to remap migrated allocation on "
+			"%s, pid %u\n", __func__, pmem[id].name, data->pid);
+		pmem_map_garbage(id, data->vma, data, 0,
+			data->vma->vm_end - data->vma->vm_start);
+	}
+	goto out;
+
+out_unlock:
+	mutex_unlock(&pmem[id].arena_mutex);
+out:
+	pmem_unlock_data_and_mm(data, mm);
+	return next;
+}
+
+/* slide the movable allocations of a region towards its base so that the
+ * free quanta collect at the top. Allocations are visited in address order,
+ * pinned and kernel allocations stay where they are and the others pack
+ * around them.
+ *
+ * munmap holds the mmap_sem when the last fput gets to pmem_release, which
+ * takes data_list_mutex, so the candidates are collected and referenced
+ * under data_list_mutex and migrated, taking each mmap_sem, after it has
+ * been dropped. */
+static void pmem_compact(int id)
+{
+	struct pmem_data *data;
+	LIST_HEAD(candidates);
+	int cursor = 0;
+
+	if (pmem[id].allocator_type != PMEM_ALLOCATORTYPE_MOVABLE)
+		return;
+
+	mutex_lock(&pmem[id].compact_mutex);
+	mutex_lock(&pmem[id].arena_mutex);
+	pmem[id].compactions++;
+	mutex_unlock(&pmem[id].arena_mutex);
+
+	mutex_lock(&pmem[id].data_list_mutex);
+	list_for_each_entry(data, &pmem[id].data_list, list) {
+		down_read(&data->sem);
+		if (data->index != -1 &&
+				!(data->flags & PMEM_FLAGS_CONNECTED)) {
+			atomic_inc(&data->users);
+			list_add_tail(&data->compact_list, &candidates);
+		}
+		up_read(&data->sem);
+	}
+	mutex_unlock(&pmem[id].data_list_mutex);
+
+	while ((data = pmem_next_movable(&candidates, cursor))) {
+		cursor = pmem_migrate(id, data);
+		pmem_data_put(data);
+	}
+	mutex_unlock(&pmem[id].compact_mutex);
+}
+
+static void pmem_compact_work(struct work_struct *work)
+{
+	struct pmem_info *info =
+		container_of(work, struct pmem_info, compact_work);
+
+	pmem_compact(info->id);
+}
+
+/* allocate on behalf of an ioctl. A movable region that has the space but
+ * not in one piece is compacted and the allocation tried once more. Called
+ * and returns with data->sem held for write. */
+static int pmem_allocate_or_compact(struct file *file, unsigned long len,
+		unsigned int align)
+{
+	struct pmem_data *data = file->private_data;
+	int id = get_id(file), index, retry;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	index = pmem[id].allocate(id, len, align);
+	retry = index == -1 &&
+		pmem[id].allocator_type == PMEM_ALLOCATORTYPE_MOVABLE &&
+		pmem[id].allocator.bitmap.bitmap_free >=
+			(len + pmem[id].quantum - 1) / pmem[id].quantum;
+	mutex_unlock(&pmem[id].arena_mutex);
+	if (!retry)
+		return index;
+
+	/* pmem_compact walks every file's sem, including ours */
+	up_write(&data->sem);
+	pmem_compact(id);
+	down_write(&data->sem);
+	if (has_allocation(file))
+		return data->index;
+
+	mutex_lock(&pmem[id].arena_mutex);
+	index = pmem[id].allocate(id, len, align);
+	mutex_unlock(&pmem[id].arena_mutex);
+	return index;
+}
+
 static void pmem_get_size(struct pmem_region *region, struct file *file)
 {
 	/* called via ioctl file op, so file guaranteed to be not NULL */
@@ -2413,7 +3113,12 @@ static void pmem_get_size(struct pmem_region *region, struct file *file)
 		region->offset = 0;
 		region->len = 0;
 	} else {
-		region->offset = pmem[id].start_addr(id, data);
+		/* a movable allocation's address is only given out by
+		 * PMEM_GET_PHYS, which pins it */
+		if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_MOVABLE)
+			region->offset = 0;
+		else
+			region->offset = pmem[id].start_addr(id, data);
 		region->len = pmem[id].len(id, data);
 	}
 	up_read(&data->sem);
@@ -2443,15 +3148,21 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			struct pmem_region region;
 
 			DLOG("get_phys\n");
-			down_read(&data->sem);
+			down_write(&data->sem);
 			if (!has_allocation(file)) {
 				region.offset = 0;
 				region.len = 0;
 			} else {
+				/* devices may be given the address from here
+				 * on, so compaction must leave it alone */
+				if (!(data->flags & PMEM_FLAGS_PHYS)) {
+					data->flags |= PMEM_FLAGS_PHYS;
+					atomic_inc(&data->pinned);
+				}
 				region.offset = pmem[id].start_addr(id, data);
 				region.len = pmem[id].len(id, data);
 			}
-			up_read(&data->sem);
+			up_write(&data->sem);
 
 			if (copy_to_user((void __user *)arg, &region,
 						sizeof(struct pmem_region)))
@@ -2537,11 +3248,8 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				return -EINVAL;
 			}
 
-			mutex_lock(&pmem[id].arena_mutex);
-			data->index = pmem[id].allocate(id,
-					arg,
+			data->index = pmem_allocate_or_compact(file, arg,
 					SZ_4K);
-			mutex_unlock(&pmem[id].arena_mutex);
 			ret = data->index == -1 ? -ENOMEM :
 				data->index;
 			up_write(&data->sem);
@@ -2571,7 +3279,9 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 
 			if (alloc.align != SZ_4K &&
 					(pmem[id].allocator_type !=
-						PMEM_ALLOCATORTYPE_BITMAP)) {
+						PMEM_ALLOCATORTYPE_BITMAP) &&
+					(pmem[id].allocator_type !=
+						PMEM_ALLOCATORTYPE_MOVABLE)) {
 				pr_err("pmem: Non 4k alignment requires bitmap"
 					" allocator on %s\n", pmem[id].name);
 				return -EINVAL;
@@ -2584,11 +3294,8 @@ static long pmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 				return -EINVAL;
 			}
 
-			mutex_lock(&pmem[id].arena_mutex);
-			data->index = pmem[id].allocate(id,
-					alloc.size,
-					alloc.align);
-			mutex_unlock(&pmem[id].arena_mutex);
+			data->index = pmem_allocate_or_compact(file,
+					alloc.size, alloc.align);
 			ret = data->index == -1 ? -ENOMEM :
 				data->index;
 			up_write(&data->sem);
@@ -2947,6 +3654,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 
 		break;
 
+	case PMEM_ALLOCATORTYPE_MOVABLE:
 	case PMEM_ALLOCATORTYPE_BITMAP: /* 0, default if not explicit */
 		pmem[id].allocator.bitmap.bitm_alloc = kmalloc(
 			PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS *
@@ -2961,10 +3669,15 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 		}
 
 		if (kobject_init_and_add(&pmem[id].kobj,
-				&pmem_bitmap_ktype, NULL,
+				pmem[id].allocator_type ==
+					PMEM_ALLOCATORTYPE_MOVABLE ?
+					&pmem_movable_ktype :
+					&pmem_bitmap_ktype, NULL,
 				"%s", pdata->name))
 			goto out_put_kobj;
 
+		INIT_WORK(&pmem[id].compact_work, pmem_compact_work);
+
 		for (i = 0; i < PMEM_INITIAL_NUM_BITMAP_ALLOCATIONS; i++) {
 			pmem[id].allocator.bitmap.bitm_alloc[i].bit = -1;
 			pmem[id].allocator.bitmap.bitm_alloc[i].quanta = 0;
@@ -2982,6 +3695,14 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 				__func__);
 			goto err_cant_register_device;
 		}
+		if (bitmap_tree_init(&pmem[id].allocator.bitmap.tree,
+				pmem[id].allocator.bitmap.bitmap,
+				pmem[id].num_entries)) {
+			pr_alert("pmem: %s: Unable to register pmem "
+				"driver - can't allocate bitmap tree!\n",
+				__func__);
+			goto err_cant_register_device;
+		}
 		pmem[id].allocator.bitmap.bitmap_free = pmem[id].num_entries;
 
 		pmem[id].allocate = pmem_allocator_bitmap;
@@ -3036,6 +3757,7 @@ int pmem_setup(struct android_pmem_platform_data *pdata,
 	pmem[id].release = release;
 	mutex_init(&pmem[id].arena_mutex);
 	mutex_init(&pmem[id].data_list_mutex);
+	mutex_init(&pmem[id].compact_mutex);
 	INIT_LIST_HEAD(&pmem[id].data_list);
 
 	pmem[id].dev.name = pdata->name;
@@ -3080,9 +3802,11 @@ out_put_kobj:
 	kobject_put(&pmem[id].kobj);
 	if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BUDDYBESTFIT)
 		kfree(pmem[id].allocator.buddy_bestfit.buddy_bitmap);
-	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP) {
+	else if (pmem[id].allocator_type == PMEM_ALLOCATORTYPE_BITMAP ||
+		 pmem[id].allocator_type == PMEM_ALLOCATORTYPE_MOVABLE) {
 		kfree(pmem[id].allocator.bitmap.bitmap);
 		kfree(pmem[id].allocator.bitmap.bitm_alloc);
+		bitmap_tree_free(&pmem[id].allocator.bitmap.tree);
 	}
 err_reset_pmem_info:
 	pmem[id].allocate = 0;
@@ -3144,6 +3868,109 @@ static struct platform_driver pmem_driver = {
 };
 
 
+#ifdef CONFIG_ANDROID_PMEM_BITMAP_SELFTEST
+#define PMEM_SELFTEST_ALLOCS 512
+#define PMEM_SELFTEST_ROUNDS 20000
+
+/* run the same random allocate/free sequence through the linear scan and
+ * the summary tree on two copies of a bitmap and check that every search
+ * lands on the same bit */
+static int __init pmem_bitmap_selftest_one(int total_bits)
+{
+	struct pmem_bitmap_tree tree;
+	uint32_t *scan_bits, *tree_bits;
+	struct { int bit, len; } *allocs;
+	int words = (total_bits + PMEM_BITS_PER_WORD - 1) >>
+		PMEM_32BIT_WORD_ORDER;
+	int nr_allocs = 0, searches = 0, round, ret = -ENOMEM;
+	s64 scan_ns = 0, tree_ns = 0;
+
+	scan_bits = kcalloc(words, sizeof(uint32_t), GFP_KERNEL);
+	tree_bits = kcalloc(words, sizeof(uint32_t), GFP_KERNEL);
+	allocs = kcalloc(PMEM_SELFTEST_ALLOCS, sizeof(*allocs), GFP_KERNEL);
+	if (!scan_bits || !tree_bits || !allocs ||
+			bitmap_tree_init(&tree, tree_bits, total_bits))
+		goto out;
+
+	for (round = 0; round < PMEM_SELFTEST_ROUNDS; round++) {
+		u32 r = random32();
+
+		if (nr_allocs < PMEM_SELFTEST_ALLOCS && (r % 3 || !nr_allocs)) {
+			/* mostly small requests, a few large and aligned */
+			int len = 1 + (r >> 8) % (r & 0x10 ? 512 : 32);
+			int spacing = 1 << ((r >> 4) & 0x7);
+			int scan_bit, tree_bit;
+			ktime_t t0, t1, t2;
+
+			t0 = ktime_get();
+			scan_bit = bitmap_allocate_contiguous(scan_bits, len,
+				total_bits, spacing);
+			t1 = ktime_get();
+			tree_bit = bitmap_tree_allocate(&tree, tree_bits, len,
+				total_bits, spacing);
+			t2 = ktime_get();
+			scan_ns += ktime_to_ns(ktime_sub(t1, t0));
+			tree_ns += ktime_to_ns(ktime_sub(t2, t1));
+			searches++;
+
+			if (scan_bit != tree_bit) {
+				pr_err("pmem: bitmap selftest: %d bits, len %d "
+					"spacing %d: scan found %d, tree %d\n",
+					total_bits, len, spacing, scan_bit,
+					tree_bit);
+				ret = -EINVAL;
+				goto out_tree;
+			}
+			if (scan_bit >= 0) {
+				allocs[nr_allocs].bit = scan_bit;
+				allocs[nr_allocs++].len = len;
+			}
+		} else {
+			int i = (r >> 8) % nr_allocs;
+
+			bitmap_bits_clear_all(scan_bits, allocs[i].bit,
+				allocs[i].bit + allocs[i].len);
+			bitmap_bits_clear_all(tree_bits, allocs[i].bit,
+				allocs[i].bit + allocs[i].len);
+			bitmap_tree_update(&tree, tree_bits, allocs[i].bit,
+				allocs[i].bit + allocs[i].len);
+			allocs[i] = allocs[--nr_allocs];
+		}
+	}
+
+	if (memcmp(scan_bits, tree_bits, words * sizeof(uint32_t))) {
+		pr_err("pmem: bitmap selftest: %d bits, bitmaps differ\n",
+			total_bits);
+		ret = -EINVAL;
+		goto out_tree;
+	}
+
+	pr_info("pmem: bitmap selftest: %d bits, %d searches, linear scan "
+		"%lld ns, tree %lld ns\n", total_bits, searches,
+		scan_ns, tree_ns);
+	ret = 0;
+out_tree:
+	bitmap_tree_free(&tree);
+out:
+	kfree(allocs);
+	kfree(tree_bits);
+	kfree(scan_bits);
+	return ret;
+}
+
+static void __init pmem_bitmap_selftest(void)
+{
+	/* word aligned, ragged last word and a large region of small
+	 * quanta */
+	static const int sizes[] __initconst = { 32, 1000, 4096, 65536 };
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); i++)
+		if (pmem_bitmap_selftest_one(sizes[i]))
+			return;
+}
+#endif
+
 static int __init pmem_init(void)
 {
 	/* create /sys/kernel/<PMEM_SYSFS_DIR_NAME> directory */
@@ -3156,6 +3983,9 @@ static int __init pmem_init(void)
 
 #ifdef CONFIG_MEMORY_HOTPLUG
 	hotplug_memory_notifier(pmem_memory_callback, 0);
+#endif
+#ifdef CONFIG_ANDROID_PMEM_BITMAP_SELFTEST
+	pmem_bitmap_selftest();
 #endif
 	return platform_driver_register(&pmem_driver);
 }
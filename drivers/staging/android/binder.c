@@ -19,6 +19,8 @@
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 #include <linux/list.h>
 #include <linux/miscdevice.h>
 #include <linux/mm.h>
@@ -37,7 +39,10 @@
 
 #include "binder.h"
 
-static DEFINE_MUTEX(binder_lock);
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
+static DEFINE_MUTEX(binder_main_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
@@ -88,6 +93,8 @@ static int procfs_binder_read_proc_proc(char *page, char **start, off_t off,
 
 #define BINDER_SMALL_BUF_SIZE (PAGE_SIZE * 64)
 
+#define BINDER_SG_MAX_SEGMENTS 256
+
 enum {
 	BINDER_DEBUG_USER_ERROR             = 1U << 0,
 	BINDER_DEBUG_FAILED_TRANSACTION     = 1U << 1,
@@ -110,6 +117,17 @@ static uint32_t binder_debug_mask = BINDER_DEBUG_USER_ERROR |
 	BINDER_DEBUG_FAILED_TRANSACTION | BINDER_DEBUG_DEAD_TRANSACTION;
 module_param_named(debug_mask, binder_debug_mask, uint, S_IWUSR | S_IRUGO);
 
+static int binder_page_pool_max = 16;
+module_param_named(page_pool_max, binder_page_pool_max, int,
+		   S_IWUSR | S_IRUGO);
+
+static int binder_inherit_rt = 1;
+module_param_named(inherit_rt, binder_inherit_rt, bool, S_IWUSR | S_IRUGO);
+
+static int binder_prefer_local_thread = 1;
+module_param_named(prefer_local_thread, binder_prefer_local_thread, bool,
+		   S_IWUSR | S_IRUGO);
+
 static int binder_debug_no_lock;
 module_param_named(proc_no_lock, binder_debug_no_lock, bool, S_IWUSR | S_IRUGO);
 
@@ -155,13 +173,42 @@ enum binder_stat_types {
 
 struct binder_stats {
 	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
+	int bc[_IOC_NR(BC_REPLY_SG) + 1];
 	int obj_created[BINDER_STAT_COUNT];
 	int obj_deleted[BINDER_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
+/* latency histogram buckets: <1us, <2us, <4us, ... >=2^14us */
+#define BINDER_LATENCY_HIST_BUCKETS 16
+
+struct binder_alloc_stats {
+	unsigned long pool_hits;
+	unsigned long pages_mapped;
+	unsigned long map_batches;
+	unsigned long latency_hist[BINDER_LATENCY_HIST_BUCKETS];
+};
+
+static atomic_t binder_alloc_latency_hist[BINDER_LATENCY_HIST_BUCKETS];
+
+static inline int binder_latency_hist_bucket(u64 ns)
+{
+	u64 us = div_u64(ns, NSEC_PER_USEC);
+
+	if (us >= 1U << (BINDER_LATENCY_HIST_BUCKETS - 2))
+		return BINDER_LATENCY_HIST_BUCKETS - 1;
+	return fls((u32)us);
+}
+
+struct binder_lock_stats {
+	unsigned long acquired;
+	unsigned long contended;
+	u64 wait_ns;
+};
+
+static struct binder_lock_stats binder_main_lock_stats;
+
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
 	binder_stats.obj_deleted[type]++;
@@ -181,8 +228,13 @@ struct binder_transaction_log_entry {
 	int to_proc;
 	int to_thread;
 	int to_node;
+	unsigned int code;
 	int data_size;
 	int offsets_size;
+	ktime_t enqueue_time;
+	ktime_t wakeup_time;
+	ktime_t reply_time;
+	ktime_t free_time;
 };
 struct binder_transaction_log {
 	int next;
@@ -206,6 +258,134 @@ static struct binder_transaction_log_entry *binder_transaction_log_add(
 	return e;
 }
 
+static struct binder_transaction_log_entry *binder_transaction_log_find(
+	struct binder_transaction_log *log, int debug_id)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(log->entry); i++) {
+		if (log->entry[i].debug_id == debug_id)
+			return &log->entry[i];
+	}
+	return NULL;
+}
+
+/*
+ * Service latency per (target node, code).  Synchronous transactions are
+ * measured from enqueue until the reply is sent, one-way transactions
+ * from enqueue until a thread picks them up.
+ */
+#define BINDER_LATENCY_MAX_ENTRIES 512
+
+struct binder_latency_entry {
+	struct rb_node rb_node;
+	int node_debug_id;
+	int to_proc;
+	unsigned int code;
+	unsigned long count;
+	u64 total_ns;
+	u64 max_ns;
+	unsigned long hist[BINDER_LATENCY_HIST_BUCKETS];
+};
+
+static struct rb_root binder_latency_entries;
+static int binder_latency_entry_count;
+static unsigned long binder_latency_dropped;
+
+static void binder_latency_erase(struct binder_latency_entry *entry)
+{
+	rb_erase(&entry->rb_node, &binder_latency_entries);
+	binder_latency_entry_count--;
+	kfree(entry);
+}
+
+/*
+ * binder_latency_release - forget the entries of a node that is freed
+ */
+static void binder_latency_release(int node_debug_id)
+{
+	struct rb_node *n = binder_latency_entries.rb_node;
+	struct binder_latency_entry *entry;
+	struct rb_node *first = NULL;
+
+	while (n) {
+		entry = rb_entry(n, struct binder_latency_entry, rb_node);
+		if (node_debug_id <= entry->node_debug_id) {
+			if (node_debug_id == entry->node_debug_id)
+				first = n;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+	while (first) {
+		entry = rb_entry(first, struct binder_latency_entry, rb_node);
+		if (entry->node_debug_id != node_debug_id)
+			break;
+		first = rb_next(first);
+		binder_latency_erase(entry);
+	}
+}
+
+static void binder_latency_record(int node_debug_id, int to_proc,
+				  unsigned int code, ktime_t start)
+{
+	struct rb_node **p;
+	struct rb_node *parent;
+	struct binder_latency_entry *entry;
+	u64 ns;
+
+	if (!node_debug_id || !start.tv64)
+		return;
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+retry:
+	p = &binder_latency_entries.rb_node;
+	parent = NULL;
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct binder_latency_entry, rb_node);
+
+		if (node_debug_id < entry->node_debug_id)
+			p = &parent->rb_left;
+		else if (node_debug_id > entry->node_debug_id)
+			p = &parent->rb_right;
+		else if (code < entry->code)
+			p = &parent->rb_left;
+		else if (code > entry->code)
+			p = &parent->rb_right;
+		else
+			goto found;
+	}
+	if (binder_latency_entry_count >= BINDER_LATENCY_MAX_ENTRIES) {
+		/*
+		 * Node debug ids only grow, so the leftmost entry belongs to
+		 * the oldest node; evict it rather than stop recording.
+		 */
+		entry = rb_entry(rb_first(&binder_latency_entries),
+				 struct binder_latency_entry, rb_node);
+		binder_latency_erase(entry);
+		binder_latency_dropped++;
+		goto retry;
+	}
+	entry = kzalloc(sizeof(*entry), GFP_KERNEL);
+	if (entry == NULL) {
+		binder_latency_dropped++;
+		return;
+	}
+	entry->node_debug_id = node_debug_id;
+	entry->to_proc = to_proc;
+	entry->code = code;
+	rb_link_node(&entry->rb_node, parent, p);
+	rb_insert_color(&entry->rb_node, &binder_latency_entries);
+	binder_latency_entry_count++;
+found:
+	entry->count++;
+	entry->total_ns += ns;
+	if (ns > entry->max_ns)
+		entry->max_ns = ns;
+	entry->hist[binder_latency_hist_bucket(ns)]++;
+}
+
 struct binder_work {
 	struct list_head entry;
 	enum {
@@ -308,16 +488,21 @@ struct binder_proc {
 	size_t free_async_space;
 
 	struct page **pages;
+	struct list_head page_pool;
+	int page_pool_count;
+	struct binder_alloc_stats alloc_stats;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
 	struct binder_stats stats;
+	struct binder_lock_stats lock_stats;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
+	struct list_head waiting_threads;
 	long default_priority;
 	struct dentry *debugfs_entry;
 };
@@ -334,6 +519,8 @@ enum {
 struct binder_thread {
 	struct binder_proc *proc;
 	struct rb_node rb_node;
+	struct list_head waiting_thread_node;
+	struct task_struct *task;
 	int pid;
 	int looper;
 	struct binder_transaction *transaction_stack;
@@ -362,12 +549,64 @@ struct binder_transaction {
 	unsigned int	flags;
 	long	priority;
 	long	saved_priority;
+	int	sched_policy;
+	int	rt_priority;
+	int	saved_sched_policy;
+	int	saved_rt_priority;
+	unsigned sched_inherited:1;
 	uid_t	sender_euid;
+	int	target_node_id;
+	ktime_t	start_time;
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+/*
+ * binder_main_lock protects the proc/thread/node/ref graph, the work
+ * lists and the per-proc buffer allocators. Nothing holds a reference on
+ * a proc or node, and binder_deferred_release frees them under this lock,
+ * so no path can drop it while it uses them; splitting it needs those
+ * lifetimes refcounted first. It is taken through the helpers below,
+ * which count contention so it can be seen in the stats files.
+ */
+static void binder_mutex_lock(struct mutex *lock,
+			      struct binder_lock_stats *stats,
+			      struct binder_lock_stats *proc_stats)
+{
+	ktime_t start;
+	u64 wait_ns;
+
+	if (mutex_trylock(lock)) {
+		stats->acquired++;
+		if (proc_stats)
+			proc_stats->acquired++;
+		return;
+	}
+	start = ktime_get();
+	mutex_lock(lock);
+	wait_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	stats->acquired++;
+	stats->contended++;
+	stats->wait_ns += wait_ns;
+	if (proc_stats) {
+		proc_stats->acquired++;
+		proc_stats->contended++;
+		proc_stats->wait_ns += wait_ns;
+	}
+}
+
+static inline void binder_lock(struct binder_proc *proc)
+{
+	binder_mutex_lock(&binder_main_lock, &binder_main_lock_stats,
+			  proc ? &proc->lock_stats : NULL);
+}
+
+static inline void binder_unlock(void)
+{
+	mutex_unlock(&binder_main_lock);
+}
+
 #if BINDER_BUG_DEBUG
 void debug_binder_buffer_info(struct binder_proc *proc, struct binder_buffer *buffer)
 {
@@ -558,6 +797,48 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+static inline int binder_rt_policy(int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static void binder_set_sched(int policy, int rt_priority)
+{
+	struct sched_param param = { .sched_priority = rt_priority };
+
+	if (current->policy == policy && current->rt_priority == rt_priority)
+		return;
+	if (sched_setscheduler_nocheck(current, policy, &param))
+		binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+			     "binder: %d: failed to set policy %d prio %d\n",
+			     current->pid, policy, rt_priority);
+}
+
+/*
+ * Let the thread picking up a synchronous transaction run with the
+ * caller's real-time policy until it replies.
+ */
+static void binder_inherit_sched(struct binder_transaction *t)
+{
+	t->saved_sched_policy = current->policy;
+	t->saved_rt_priority = current->rt_priority;
+	if (!binder_inherit_rt || !binder_rt_policy(t->sched_policy))
+		return;
+	if (binder_rt_policy(current->policy) &&
+	    current->rt_priority >= t->rt_priority)
+		return;
+	binder_set_sched(t->sched_policy, t->rt_priority);
+	t->sched_inherited = 1;
+}
+
+static void binder_restore_sched(struct binder_transaction *t)
+{
+	if (!t->sched_inherited)
+		return;
+	binder_set_sched(t->saved_sched_policy, t->saved_rt_priority);
+	t->sched_inherited = 0;
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -632,13 +913,14 @@ static void binder_insert_allocated_buffer(struct binder_proc *proc,
 static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 						  void __user *user_ptr)
 {
-	struct rb_node *n = proc->allocated_buffers.rb_node;
+	struct rb_node *n;
 	struct binder_buffer *buffer;
 	struct binder_buffer *kern_ptr;
 
 	kern_ptr = user_ptr - proc->user_buffer_offset
 		- offsetof(struct binder_buffer, data);
 
+	n = proc->allocated_buffers.rb_node;
 	while (n) {
 		buffer = rb_entry(n, struct binder_buffer, rb_node);
 		BUG_ON(buffer->free);
@@ -653,15 +935,56 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static struct page *binder_get_pool_page(struct binder_proc *proc)
+{
+	struct page *page;
+
+	if (list_empty(&proc->page_pool))
+		return alloc_page(GFP_KERNEL | __GFP_ZERO);
+
+	/*
+	 * Pool pages only ever held this proc's own buffer contents, so they
+	 * are handed out again without clearing.
+	 */
+	page = list_first_entry(&proc->page_pool, struct page, lru);
+	list_del(&page->lru);
+	proc->page_pool_count--;
+	proc->alloc_stats.pool_hits++;
+	return page;
+}
+
+static void binder_put_pool_page(struct binder_proc *proc, struct page *page)
+{
+	if (proc->page_pool_count >= binder_page_pool_max) {
+		__free_page(page);
+		return;
+	}
+	list_add(&page->lru, &proc->page_pool);
+	proc->page_pool_count++;
+}
+
+static void binder_drain_page_pool(struct binder_proc *proc)
+{
+	struct page *page, *tmp;
+
+	list_for_each_entry_safe(page, tmp, &proc->page_pool, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+	proc->page_pool_count = 0;
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
 {
-	void *page_addr;
-	unsigned long user_page_addr;
+	unsigned long user_page_addr = 0;
 	struct vm_struct tmp_area;
-	struct page **page;
+	struct page **pages;
+	struct page **page_array_ptr;
 	struct mm_struct *mm;
+	size_t nr_pages, i;
+	int ret;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -670,6 +993,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
+	nr_pages = (end - start) / PAGE_SIZE;
+	pages = &proc->pages[(start - proc->buffer) / PAGE_SIZE];
+
 	if (vma)
 		mm = NULL;
 	else
@@ -689,39 +1015,45 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		goto err_no_vma;
 	}
 
-	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-		int ret;
-		struct page **page_array_ptr;
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+	/*
+	 * Populate the whole range in one go: gather the pages first, map
+	 * them into the kernel area with a single map_vm_area call, then
+	 * insert them into the user vma.
+	 */
+	for (i = 0; i < nr_pages; i++) {
+		BUG_ON(pages[i]);
+		pages[i] = binder_get_pool_page(proc);
+		if (pages[i] == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "for page at %p\n", proc->pid, page_addr);
+			       "for page at %p\n", proc->pid,
+			       start + i * PAGE_SIZE);
 			goto err_alloc_page_failed;
 		}
-		tmp_area.addr = page_addr;
-		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
-		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
-		if (ret) {
-			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
-			       "to map page at %p in kernel\n",
-			       proc->pid, page_addr);
-			goto err_map_kernel_failed;
-		}
-		user_page_addr =
-			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+	}
+	tmp_area.addr = start;
+	tmp_area.size = (nr_pages + 1) * PAGE_SIZE /* guard page? */;
+	page_array_ptr = pages;
+	ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
+	if (ret) {
+		printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
+		       "to map pages at %p in kernel\n",
+		       proc->pid, start);
+		goto err_map_kernel_failed;
+	}
+	user_page_addr = (uintptr_t)start + proc->user_buffer_offset;
+	for (i = 0; i < nr_pages; i++) {
+		ret = vm_insert_page(vma, user_page_addr + i * PAGE_SIZE,
+				     pages[i]);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
-			       proc->pid, user_page_addr);
+			       proc->pid, user_page_addr + i * PAGE_SIZE);
 			goto err_vm_insert_page_failed;
 		}
 		/* vm_insert_page does not seem to increment the refcount */
 	}
+	proc->alloc_stats.pages_mapped += nr_pages;
+	proc->alloc_stats.map_batches++;
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
@@ -729,19 +1061,30 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	return 0;
 
 free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
+	if (vma)
+		zap_page_range(vma, (uintptr_t)start + proc->user_buffer_offset,
+			       end - start, NULL);
+	unmap_kernel_range((unsigned long)start, end - start);
+	for (i = 0; i < nr_pages; i++) {
+		binder_put_pool_page(proc, pages[i]);
+		pages[i] = NULL;
+	}
+	if (mm) {
+		up_write(&mm->mmap_sem);
+		mmput(mm);
+	}
+	return 0;
+
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	if (i)
+		zap_page_range(vma, user_page_addr, i * PAGE_SIZE, NULL);
+	unmap_kernel_range((unsigned long)start, end - start);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	i = nr_pages;
 err_alloc_page_failed:
-		;
+	while (i--) {
+		binder_put_pool_page(proc, pages[i]);
+		pages[i] = NULL;
 	}
 err_no_vma:
 	if (mm) {
@@ -751,9 +1094,10 @@ err_no_vma:
 	return -ENOMEM;
 }
 
-static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
-					      size_t data_size,
-					      size_t offsets_size, int is_async)
+static struct binder_buffer *__binder_alloc_buf(struct binder_proc *proc,
+						size_t data_size,
+						size_t offsets_size,
+						int is_async)
 {
 	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
@@ -860,6 +1204,23 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	return buffer;
 }
 
+static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
+					      size_t data_size,
+					      size_t offsets_size, int is_async)
+{
+	struct binder_buffer *buffer;
+	ktime_t start;
+	int bucket;
+
+	start = ktime_get();
+	buffer = __binder_alloc_buf(proc, data_size, offsets_size, is_async);
+	bucket = binder_latency_hist_bucket(ktime_to_ns(ktime_sub(ktime_get(),
+								 start)));
+	proc->alloc_stats.latency_hist[bucket]++;
+	atomic_inc(&binder_alloc_latency_hist[bucket]);
+	return buffer;
+}
+
 static void *buffer_start_page(struct binder_buffer *buffer)
 {
 	return (void *)((uintptr_t)buffer & PAGE_MASK);
@@ -1101,6 +1462,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 					     "binder: dead node %d deleted\n",
 					     node->debug_id);
 			}
+			binder_latency_release(node->debug_id);
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		}
@@ -1424,9 +1786,71 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
+/*
+ * Gather a scatter-gather payload straight into the target buffer.  The
+ * segment sizes must add up to exactly data_size.
+ */
+static int binder_copy_sg_segments(void *dst, size_t data_size,
+		const struct binder_buffer_segment __user *usegs,
+		size_t segments_count)
+{
+	struct binder_buffer_segment segs[8];
+	size_t copied = 0;
+	size_t i, n;
+
+	if (segments_count > BINDER_SG_MAX_SEGMENTS)
+		return -EINVAL;
+
+	while (segments_count) {
+		n = min(segments_count, ARRAY_SIZE(segs));
+		if (copy_from_user(segs, usegs, n * sizeof(segs[0])))
+			return -EFAULT;
+		for (i = 0; i < n; i++) {
+			if (segs[i].size > data_size - copied)
+				return -EINVAL;
+			if (copy_from_user(dst + copied, segs[i].buffer,
+					   segs[i].size))
+				return -EFAULT;
+			copied += segs[i].size;
+		}
+		usegs += n;
+		segments_count -= n;
+	}
+	return copied == data_size ? 0 : -EINVAL;
+}
+
+/*
+ * Wake a thread to handle work queued on the proc.  An idle looper that
+ * last ran on this cpu is preferred, since it can start without a
+ * cross-core wakeup; otherwise the proc wait queue picks one.  A thread
+ * stays on waiting_threads from just before it sleeps until it retakes
+ * binder_main_lock, so the one picked may already be awake with other
+ * work to take; a reader that finds proc work left over after taking its
+ * own wakes the wait queue again.
+ */
+static void binder_wakeup_proc(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+	int cpu = raw_smp_processor_id();
+
+	if (binder_prefer_local_thread) {
+		list_for_each_entry(thread, &proc->waiting_threads,
+				    waiting_thread_node) {
+			if (task_cpu(thread->task) != cpu)
+				continue;
+			list_del_init(&thread->waiting_thread_node);
+			if (wake_up_process(thread->task))
+				return;
+			break;
+		}
+	}
+	wake_up_interruptible(&proc->wait);
+}
+
 static void binder_transaction(struct binder_proc *proc,
 			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+			       struct binder_transaction_data *tr, int reply,
+			       int sg, size_t segments_count)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
@@ -1445,6 +1869,7 @@ static void binder_transaction(struct binder_proc *proc,
 	e->from_proc = proc->pid;
 	e->from_thread = thread->pid;
 	e->target_handle = tr->target.handle;
+	e->code = tr->code;
 	e->data_size = tr->data_size;
 	e->offsets_size = tr->offsets_size;
 
@@ -1471,6 +1896,8 @@ static void binder_transaction(struct binder_proc *proc,
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
+		/* before any failure below, so an error reply drops it too */
+		binder_restore_sched(in_reply_to);
 		thread->transaction_stack = in_reply_to->to_parent;
 		target_thread = in_reply_to->from;
 		if (target_thread == NULL) {
@@ -1592,6 +2019,8 @@ static void binder_transaction(struct binder_proc *proc,
 	t->code = tr->code;
 	t->flags = tr->flags;
 	t->priority = task_nice(current);
+	t->sched_policy = current->policy;
+	t->rt_priority = current->rt_priority;
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
 		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
@@ -1607,7 +2036,19 @@ static void binder_transaction(struct binder_proc *proc,
 
 	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
 
-	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
+	if (sg) {
+		if (binder_copy_sg_segments(t->buffer->data, tr->data_size,
+					    tr->data.ptr.buffer,
+					    segments_count)) {
+			binder_user_error("binder: %d:%d got transaction with "
+				"invalid segment list, %zd segments for %zd "
+				"bytes\n", proc->pid, thread->pid,
+				segments_count, tr->data_size);
+			return_error = BR_FAILED_REPLY;
+			goto err_copy_data_failed;
+		}
+	} else if (copy_from_user(t->buffer->data, tr->data.ptr.buffer,
+				  tr->data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
 			"data ptr\n", proc->pid, thread->pid);
 		return_error = BR_FAILED_REPLY;
@@ -1765,8 +2206,25 @@ static void binder_transaction(struct binder_proc *proc,
 			goto err_bad_object_type;
 		}
 	}
+	t->start_time = ktime_get();
+	e->enqueue_time = t->start_time;
+	if (target_node)
+		t->target_node_id = target_node->debug_id;
+	trace_binder_transaction(t->debug_id, reply, t->flags, t->code,
+				 target_proc->pid,
+				 target_thread ? target_thread->pid : 0,
+				 t->target_node_id);
 	if (reply) {
+		struct binder_transaction_log_entry *re;
+
 		BUG_ON(t->buffer->async_transaction != 0);
+		re = binder_transaction_log_find(&binder_transaction_log,
+						 in_reply_to->debug_id);
+		if (re)
+			re->reply_time = t->start_time;
+		binder_latency_record(in_reply_to->target_node_id, proc->pid,
+				      in_reply_to->code,
+				      in_reply_to->start_time);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1786,7 +2244,9 @@ static void binder_transaction(struct binder_proc *proc,
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
+	if (target_wait == &target_proc->wait)
+		binder_wakeup_proc(target_proc);
+	else if (target_wait)
 		wake_up_interruptible(target_wait);
 	return;
 
@@ -2001,6 +2461,15 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
 				     buffer->transaction ? "active" : "finished");
+			{
+				struct binder_transaction_log_entry *fe;
+				fe = binder_transaction_log_find(
+					&binder_transaction_log,
+					buffer->debug_id);
+				if (fe)
+					fe->free_time = ktime_get();
+			}
+			trace_binder_transaction_buffer_free(buffer->debug_id);
 
 			if (buffer->transaction) {
 				buffer->transaction->buffer = NULL;
@@ -2025,7 +2494,21 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			binder_transaction(proc, thread, &tr, cmd == BC_REPLY,
+					   0, 0);
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg trsg;
+
+			if (copy_from_user(&trsg, ptr, sizeof(trsg)))
+				return -EFAULT;
+			ptr += sizeof(trsg);
+			binder_transaction(proc, thread, &trsg.transaction_data,
+					   cmd == BC_REPLY_SG, 1,
+					   trsg.segments_count);
 			break;
 		}
 
@@ -2251,6 +2734,7 @@ static int binder_thread_read(struct binder_proc *proc,
 
 	int ret = 0;
 	int wait_for_proc_work;
+	int queued = 0;
 
 	if (*consumed == 0) {
 		if (put_user(BR_NOOP, (uint32_t __user *)ptr))
@@ -2280,9 +2764,17 @@ retry:
 
 
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+		if (!non_block &&
+		    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
+				       BINDER_LOOPER_STATE_ENTERED))) {
+			list_add(&thread->waiting_thread_node,
+				 &proc->waiting_threads);
+			queued = 1;
+		}
+	}
+	binder_unlock();
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2306,13 +2798,22 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
-	if (wait_for_proc_work)
+	binder_lock(proc);
+	if (wait_for_proc_work) {
 		proc->ready_threads--;
+		/* binder_wakeup_proc takes the thread off the list it picks */
+		if (queued && !list_empty(&thread->waiting_thread_node))
+			queued = 0;
+		list_del_init(&thread->waiting_thread_node);
+	}
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
-	if (ret)
+	if (ret) {
+		/* picked for proc work but leaving without it: pass it on */
+		if (queued && !list_empty(&proc->todo))
+			wake_up_interruptible(&proc->wait);
 		return ret;
+	}
 
 	while (1) {
 		uint32_t cmd;
@@ -2402,6 +2903,7 @@ retry:
 						     proc->pid, thread->pid, node->debug_id,
 						     node->ptr, node->cookie);
 					rb_erase(&node->rb_node, &proc->nodes);
+					binder_latency_release(node->debug_id);
 					kfree(node);
 					binder_stats_deleted(BINDER_STAT_NODE);
 				} else {
@@ -2463,6 +2965,8 @@ retry:
 			else if (!(t->flags & TF_ONE_WAY) ||
 				 t->saved_priority > target_node->min_priority)
 				binder_set_nice(target_node->min_priority);
+			if (!(t->flags & TF_ONE_WAY))
+				binder_inherit_sched(t);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2508,6 +3012,21 @@ retry:
 			     t->buffer->data_size, t->buffer->offsets_size,
 			     tr.data.ptr.buffer, tr.data.ptr.offsets);
 
+		{
+			struct binder_transaction_log_entry *we;
+			ktime_t now = ktime_get();
+
+			we = binder_transaction_log_find(&binder_transaction_log,
+							 t->debug_id);
+			if (we)
+				we->wakeup_time = now;
+			trace_binder_transaction_received(t->debug_id,
+				ktime_to_ns(ktime_sub(now, t->start_time)));
+		}
+		if (t->flags & TF_ONE_WAY)
+			binder_latency_record(t->target_node_id, proc->pid,
+					      t->code, t->start_time);
+
 		list_del(&t->work.entry);
 		t->buffer->allow_user_free = 1;
 		if (cmd == BR_TRANSACTION && !(t->flags & TF_ONE_WAY)) {
@@ -2525,6 +3044,9 @@ retry:
 done:
 
 	*consumed = ptr - buffer;
+	/* our wakeup may have been meant for a second item: pass it on */
+	if (wait_for_proc_work && !list_empty(&proc->todo))
+		wake_up_interruptible(&proc->wait);
 	if (proc->requested_threads + proc->ready_threads == 0 &&
 	    proc->requested_threads_started < proc->max_threads &&
 	    (thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
@@ -2589,8 +3111,10 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		binder_stats_created(BINDER_STAT_THREAD);
 		thread->proc = proc;
 		thread->pid = current->pid;
+		thread->task = current;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		rb_link_node(&thread->rb_node, parent, p);
 		rb_insert_color(&thread->rb_node, &proc->threads);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2605,9 +3129,11 @@ static int binder_free_thread(struct binder_proc *proc,
 {
 	struct binder_transaction *t;
 	struct binder_transaction *send_reply = NULL;
+	struct binder_transaction *inherited = NULL;
 	int active_transactions = 0;
 
 	rb_erase(&thread->rb_node, &proc->threads);
+	list_del_init(&thread->waiting_thread_node);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2620,6 +3146,8 @@ static int binder_free_thread(struct binder_proc *proc,
 			     (t->to_thread == thread) ? "in" : "out");
 
 		if (t->to_thread == thread) {
+			if (t->sched_inherited)
+				inherited = t;
 			t->to_proc = NULL;
 			t->to_thread = NULL;
 			if (t->buffer) {
@@ -2633,6 +3161,13 @@ static int binder_free_thread(struct binder_proc *proc,
 		} else
 			BUG();
 	}
+	/*
+	 * The outermost inherited transaction saved the policy the thread
+	 * had before any of them. Only the thread itself can drop it; when
+	 * the proc is released from the deferred work the task is exiting.
+	 */
+	if (inherited && thread->task == current)
+		binder_restore_sched(inherited);
 	if (send_reply)
 		binder_send_failed_reply(send_reply, BR_DEAD_REPLY);
 	binder_release_work(&thread->todo);
@@ -2648,12 +3183,12 @@ static unsigned int binder_poll(struct file *filp,
 	struct binder_thread *thread = NULL;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_lock(proc);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2685,7 +3220,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	binder_lock(proc);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2794,7 +3329,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2959,15 +3494,17 @@ static int binder_open(struct inode *nodp, struct file *filp)
 	get_task_struct(current);
 	proc->tsk = current;
 	INIT_LIST_HEAD(&proc->todo);
+	INIT_LIST_HEAD(&proc->waiting_threads);
 	init_waitqueue_head(&proc->wait);
+	INIT_LIST_HEAD(&proc->page_pool);
 	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	binder_lock(proc);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	binder_unlock();
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -3066,6 +3603,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		rb_erase(&node->rb_node, &proc->nodes);
 		list_del_init(&node->work.entry);
 		if (hlist_empty(&node->refs)) {
+			binder_latency_release(node->debug_id);
 			kfree(node);
 			binder_stats_deleted(BINDER_STAT_NODE);
 		} else {
@@ -3143,6 +3681,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 		kfree(proc->pages);
 		vfree(proc->buffer);
 	}
+	binder_drain_page_pool(proc);
 
 	put_task_struct(proc->tsk);
 
@@ -3163,7 +3702,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3190,7 +3729,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3651,7 +4190,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3698,6 +4239,25 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	}
 }
 
+static void print_binder_lock_stats(struct seq_file *m, const char *prefix,
+				    struct binder_lock_stats *stats)
+{
+	seq_printf(m, "%s%lu acquired, %lu contended, %llu us waited\n",
+		   prefix, stats->acquired, stats->contended,
+		   (unsigned long long)div_u64(stats->wait_ns, NSEC_PER_USEC));
+}
+
+static void print_binder_latency_hist(struct seq_file *m, const char *prefix,
+				      unsigned long *hist)
+{
+	int i;
+
+	seq_printf(m, "%s", prefix);
+	for (i = 0; i < BINDER_LATENCY_HIST_BUCKETS - 1; i++)
+		seq_printf(m, " <%u:%lu", 1U << i, hist[i]);
+	seq_printf(m, " >=%u:%lu\n", 1U << (i - 1), hist[i]);
+}
+
 static void print_binder_proc_stats(struct seq_file *m,
 				    struct binder_proc *proc)
 {
@@ -3747,6 +4307,14 @@ static void print_binder_proc_stats(struct seq_file *m,
 		}
 	}
 	seq_printf(m, "  pending transactions: %d\n", count);
+	print_binder_lock_stats(m, "  lock: ", &proc->lock_stats);
+	seq_printf(m, "  alloc pages: %lu mapped in %lu batches, "
+		   "pool %d, pool hits %lu\n",
+		   proc->alloc_stats.pages_mapped,
+		   proc->alloc_stats.map_batches, proc->page_pool_count,
+		   proc->alloc_stats.pool_hits);
+	print_binder_latency_hist(m, "  alloc latency us:",
+				  proc->alloc_stats.latency_hist);
 
 	print_binder_stats(m, "  ", &proc->stats);
 }
@@ -3760,7 +4328,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3772,7 +4340,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3780,19 +4348,25 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 {
 	struct binder_proc *proc;
 	struct hlist_node *pos;
+	unsigned long hist[BINDER_LATENCY_HIST_BUCKETS];
+	int i;
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 
 	seq_puts(m, "binder stats:\n");
 
+	print_binder_lock_stats(m, "lock: ", &binder_main_lock_stats);
+	for (i = 0; i < BINDER_LATENCY_HIST_BUCKETS; i++)
+		hist[i] = atomic_read(&binder_alloc_latency_hist[i]);
+	print_binder_latency_hist(m, "alloc latency us:", hist);
 	print_binder_stats(m, "", &binder_stats);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3803,13 +4377,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
@@ -3819,23 +4393,35 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	return 0;
 }
 
+static long long binder_log_delta_us(ktime_t start, ktime_t t)
+{
+	if (!start.tv64 || !t.tv64)
+		return -1;
+	return ktime_to_us(ktime_sub(t, start));
+}
+
 static void print_binder_transaction_log_entry(struct seq_file *m,
 					struct binder_transaction_log_entry *e)
 {
 	seq_printf(m,
-		   "%d: %s from %d:%d to %d:%d node %d handle %d size %d:%d\n",
+		   "%d: %s from %d:%d to %d:%d node %d handle %d code %x "
+		   "size %d:%d at %lld us wake %lld reply %lld free %lld\n",
 		   e->debug_id, (e->call_type == 2) ? "reply" :
 		   ((e->call_type == 1) ? "async" : "call "), e->from_proc,
 		   e->from_thread, e->to_proc, e->to_thread, e->to_node,
-		   e->target_handle, e->data_size, e->offsets_size);
+		   e->target_handle, e->code, e->data_size, e->offsets_size,
+		   (long long)ktime_to_us(e->enqueue_time),
+		   binder_log_delta_us(e->enqueue_time, e->wakeup_time),
+		   binder_log_delta_us(e->enqueue_time, e->reply_time),
+		   binder_log_delta_us(e->enqueue_time, e->free_time));
 }
 
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
@@ -3852,6 +4438,35 @@ static int binder_transaction_log_show(struct seq_file *m, void *unused)
 	return 0;
 }
 
+static int binder_transaction_latency_show(struct seq_file *m, void *unused)
+{
+	struct rb_node *n;
+	int do_lock = !binder_debug_no_lock;
+
+	if (do_lock)
+		binder_lock(NULL);
+
+	seq_printf(m, "binder transaction latency: %d entries, %lu dropped\n",
+		   binder_latency_entry_count, binder_latency_dropped);
+	for (n = rb_first(&binder_latency_entries); n != NULL;
+	     n = rb_next(n)) {
+		struct binder_latency_entry *entry =
+			rb_entry(n, struct binder_latency_entry, rb_node);
+
+		seq_printf(m, "node %d proc %d code %x: count %lu "
+			   "avg %llu us max %llu us\n",
+			   entry->node_debug_id, entry->to_proc, entry->code,
+			   entry->count,
+			   div_u64(div64_u64(entry->total_ns, entry->count),
+				   NSEC_PER_USEC),
+			   div_u64(entry->max_ns, NSEC_PER_USEC));
+		print_binder_latency_hist(m, "  latency us:", entry->hist);
+	}
+	if (do_lock)
+		binder_unlock();
+	return 0;
+}
+
 static char *procfs_print_binder_stats(char *buf, char *end, const char *prefix,
 				struct binder_stats *stats)
 {
@@ -3896,6 +4511,36 @@ static char *procfs_print_binder_stats(char *buf, char *end, const char *prefix,
 	return buf;
 }
 
+static char *procfs_print_binder_lock_stats(char *buf, char *end,
+				const char *prefix,
+				struct binder_lock_stats *stats)
+{
+	buf += snprintf(buf, end - buf,
+			"%s%lu acquired, %lu contended, %llu us waited\n",
+			prefix, stats->acquired, stats->contended,
+			(unsigned long long)div_u64(stats->wait_ns,
+						    NSEC_PER_USEC));
+	return buf;
+}
+
+static char *procfs_print_binder_latency_hist(char *buf, char *end,
+				const char *prefix, unsigned long *hist)
+{
+	int i;
+
+	buf += snprintf(buf, end - buf, "%s", prefix);
+	for (i = 0; i < BINDER_LATENCY_HIST_BUCKETS - 1; i++) {
+		if (buf >= end)
+			return buf;
+		buf += snprintf(buf, end - buf, " <%u:%lu", 1U << i, hist[i]);
+	}
+	if (buf >= end)
+		return buf;
+	buf += snprintf(buf, end - buf, " >=%u:%lu\n", 1U << (i - 1),
+			hist[i]);
+	return buf;
+}
+
 static char *procfs_print_binder_proc_stats(char *buf, char *end,
 				     struct binder_proc *proc)
 {
@@ -3960,6 +4605,21 @@ static char *procfs_print_binder_proc_stats(char *buf, char *end,
 	buf += snprintf(buf, end - buf, "  pending transactions: %d\n", count);
 	if (buf >= end)
 		return buf;
+	buf = procfs_print_binder_lock_stats(buf, end, "  lock: ",
+					     &proc->lock_stats);
+	if (buf >= end)
+		return buf;
+	buf += snprintf(buf, end - buf, "  alloc pages: %lu mapped in %lu "
+			"batches, pool %d, pool hits %lu\n",
+			proc->alloc_stats.pages_mapped,
+			proc->alloc_stats.map_batches, proc->page_pool_count,
+			proc->alloc_stats.pool_hits);
+	if (buf >= end)
+		return buf;
+	buf = procfs_print_binder_latency_hist(buf, end, "  alloc latency us:",
+					       proc->alloc_stats.latency_hist);
+	if (buf >= end)
+		return buf;
 
 	buf = procfs_print_binder_stats(buf, end, "  ", &proc->stats);
 
@@ -3982,7 +4642,7 @@ static int procfs_binder_read_proc_state(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 
 	buf += snprintf(buf, end - buf, "binder state:\n");
 
@@ -4000,7 +4660,7 @@ static int procfs_binder_read_proc_state(char *page, char **start, off_t off,
 		buf = procfs_print_binder_proc(buf, end, proc, 1);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -4020,6 +4680,8 @@ static int procfs_binder_read_proc_stats(char *page, char **start, off_t off,
 {
 	struct binder_proc *proc;
 	struct hlist_node *pos;
+	unsigned long hist[BINDER_LATENCY_HIST_BUCKETS];
+	int i;
 	int len = 0;
 	char *p = page;
 	int do_lock = !binder_debug_no_lock;
@@ -4028,10 +4690,17 @@ static int procfs_binder_read_proc_stats(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 
 	p += snprintf(p, PAGE_SIZE, "binder stats:\n");
 
+	p = procfs_print_binder_lock_stats(p, page + PAGE_SIZE, "lock: ",
+					   &binder_main_lock_stats);
+	for (i = 0; i < BINDER_LATENCY_HIST_BUCKETS; i++)
+		hist[i] = atomic_read(&binder_alloc_latency_hist[i]);
+	p = procfs_print_binder_latency_hist(p, page + PAGE_SIZE,
+					     "alloc latency us:", hist);
+
 	p = procfs_print_binder_stats(p, page + PAGE_SIZE, "", &binder_stats);
 
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
@@ -4040,7 +4709,7 @@ static int procfs_binder_read_proc_stats(char *page, char **start, off_t off,
 		p = procfs_print_binder_proc_stats(p, page + PAGE_SIZE, proc);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
 
@@ -4069,7 +4738,7 @@ static int procfs_binder_read_proc_transactions(char *page, char **start, off_t
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 
 	buf += snprintf(buf, end - buf, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node) {
@@ -4078,7 +4747,7 @@ static int procfs_binder_read_proc_transactions(char *page, char **start, off_t
 		buf = procfs_print_binder_proc(buf, end, proc, 0);
 	}
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 	if (buf > page + PAGE_SIZE)
 		buf = page + PAGE_SIZE;
 
@@ -4105,11 +4774,11 @@ static int procfs_binder_read_proc_proc(char *page, char **start, off_t off,
 		return 0;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		binder_lock(NULL);
 	p += snprintf(p, PAGE_SIZE, "binder proc state:\n");
 	p = procfs_print_binder_proc(p, page + PAGE_SIZE, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		binder_unlock();
 
 	if (p > page + PAGE_SIZE)
 		p = page + PAGE_SIZE;
@@ -4129,11 +4798,17 @@ static char *procfs_print_binder_transaction_log_entry(char *buf, char *end,
 {
 	buf += snprintf(buf, end - buf,
 			"%d: %s from %d:%d to %d:%d node %d handle %d "
-			"size %d:%d\n",
+			"code %x size %d:%d at %lld us wake %lld reply %lld "
+			"free %lld\n",
 			e->debug_id, (e->call_type == 2) ? "reply" :
 			((e->call_type == 1) ? "async" : "call "), e->from_proc,
 			e->from_thread, e->to_proc, e->to_thread, e->to_node,
-			e->target_handle, e->data_size, e->offsets_size);
+			e->target_handle, e->code, e->data_size,
+			e->offsets_size,
+			(long long)ktime_to_us(e->enqueue_time),
+			binder_log_delta_us(e->enqueue_time, e->wakeup_time),
+			binder_log_delta_us(e->enqueue_time, e->reply_time),
+			binder_log_delta_us(e->enqueue_time, e->free_time));
 	return buf;
 }
 
@@ -4195,6 +4870,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(transaction_latency);
 
 static int __init binder_init(void)
 {
@@ -4239,6 +4915,11 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("transaction_latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_transaction_latency_fops);
 	}
 
 	if (binder_proc_dir_entry_root) {
@@ -147,6 +147,26 @@ struct binder_transaction_data {
 	} data;
 };
 
+/*
+ * One piece of a scatter-gather transaction payload.  The segments are
+ * gathered in order into the target's buffer and together form the
+ * transaction data that the offsets refer to.
+ */
+struct binder_buffer_segment {
+	const void	*buffer;
+	size_t		size;
+};
+
+/*
+ * Used with BC_TRANSACTION_SG and BC_REPLY_SG.  transaction_data.data.ptr.buffer
+ * points to an array of segments_count binder_buffer_segment entries and
+ * transaction_data.data_size is the sum of their sizes.
+ */
+struct binder_transaction_data_sg {
+	struct binder_transaction_data	transaction_data;
+	size_t				segments_count;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +344,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, with the data
+	 * described as a list of user-space segments.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
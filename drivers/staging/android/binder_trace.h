@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2010 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/**
+ * binder_transaction - a transaction or reply was queued for a target
+ * @debug_id:	transaction id, matches the transaction log
+ * @reply:	non-zero for BC_REPLY
+ * @flags:	transaction flags
+ * @code:	transaction code
+ * @to_proc:	target process
+ * @to_thread:	target thread, 0 when queued on the process
+ * @to_node:	target node debug id, 0 for replies
+ */
+TRACE_EVENT(binder_transaction,
+
+	TP_PROTO(int debug_id, int reply, unsigned int flags,
+		 unsigned int code, int to_proc, int to_thread, int to_node),
+
+	TP_ARGS(debug_id, reply, flags, code, to_proc, to_thread, to_node),
+
+	TP_STRUCT__entry(
+		__field(int,		debug_id)
+		__field(int,		reply)
+		__field(unsigned int,	flags)
+		__field(unsigned int,	code)
+		__field(int,		to_proc)
+		__field(int,		to_thread)
+		__field(int,		to_node)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->reply		= reply;
+		__entry->flags		= flags;
+		__entry->code		= code;
+		__entry->to_proc	= to_proc;
+		__entry->to_thread	= to_thread;
+		__entry->to_node	= to_node;
+	),
+
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->to_node, __entry->to_proc,
+		  __entry->to_thread, __entry->reply, __entry->flags,
+		  __entry->code)
+);
+
+/**
+ * binder_transaction_received - a transaction was handed to a reader
+ * @debug_id:	transaction id
+ * @latency_ns:	time since the transaction was queued
+ */
+TRACE_EVENT(binder_transaction_received,
+
+	TP_PROTO(int debug_id, s64 latency_ns),
+
+	TP_ARGS(debug_id, latency_ns),
+
+	TP_STRUCT__entry(
+		__field(int,	debug_id)
+		__field(s64,	latency_ns)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+		__entry->latency_ns	= latency_ns;
+	),
+
+	TP_printk("transaction=%d latency_ns=%lld",
+		  __entry->debug_id, (long long)__entry->latency_ns)
+);
+
+/**
+ * binder_transaction_buffer_free - a delivered buffer was freed
+ * @debug_id:	id of the transaction that owned the buffer
+ */
+TRACE_EVENT(binder_transaction_buffer_free,
+
+	TP_PROTO(int debug_id),
+
+	TP_ARGS(debug_id),
+
+	TP_STRUCT__entry(
+		__field(int,	debug_id)
+	),
+
+	TP_fast_assign(
+		__entry->debug_id	= debug_id;
+	),
+
+	TP_printk("transaction=%d", __entry->debug_id)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -25,6 +25,9 @@
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
@@ -45,6 +48,7 @@ struct logger_log {
 	size_t			w_off;	/* current write head offset */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_staging	*staging; /* per-cpu payload buffers */
 };
 
 /*
@@ -57,6 +61,22 @@ struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			batch;	/* read() returns as many entries as fit */
+};
+
+/*
+ * struct logger_staging - per-cpu buffer a writer gathers its payload into
+ *
+ * Copying from user space can fault and sleep, so it is done into this
+ * buffer before log->mutex is taken; the mutex then only covers the copy
+ * into the ring. Each log has its own set, so writers to different logs
+ * never share one. The mutex, taken before log->mutex, only serializes
+ * writers to the same log on the same cpu, which would queue on
+ * log->mutex anyway.
+ */
+struct logger_staging {
+	struct mutex		mutex;
+	unsigned char		buf[LOGGER_ENTRY_MAX_PAYLOAD];
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -149,7 +169,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or in batch mode
+ * 	  (LOGGER_SET_BATCH_READ) as many whole entries as fit
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -207,6 +228,19 @@ start:
 	/* get exactly one entry from the log */
 	ret = do_read_log_to_user(log, reader, buf, ret);
 
+	/* in batch mode, keep going while whole entries fit */
+	while (reader->batch && ret > 0 && log->w_off != reader->r_off) {
+		ssize_t len = get_entry_len(log, reader->r_off);
+		ssize_t nr;
+
+		if (count - ret < len)
+			break;
+		nr = do_read_log_to_user(log, reader, buf + ret, len);
+		if (nr < 0)
+			break;
+		ret += nr;
+	}
+
 out:
 	mutex_unlock(&log->mutex);
 
@@ -255,6 +289,10 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
+ * Every reader sits between the start head and the write head, so a write
+ * that does not lap the start head cannot lap any reader and the walk is
+ * skipped.
+ *
  * The caller needs to hold log->mutex.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
@@ -263,8 +301,10 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (!clock_interval(old, new, log->head))
+		return;
+
+	log->head = get_next_entry(log, log->head, len);
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -290,32 +330,6 @@ static void do_write_log(struct logger_log *log, const void *buf, size_t count)
 
 }
 
-/*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
- *
- * The caller needs to hold log->mutex.
- *
- * Returns 'count' on success, negative error code on failure.
- */
-static ssize_t do_write_log_from_user(struct logger_log *log,
-				      const void __user *buf, size_t count)
-{
-	size_t len;
-
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
-		return -EFAULT;
-
-	if (count != len)
-		if (copy_from_user(log->buffer, buf + len, count - len))
-			return -EFAULT;
-
-	log->w_off = logger_offset(log->w_off + count);
-
-	return count;
-}
-
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -325,7 +339,7 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
+	struct logger_staging *staging;
 	struct logger_entry header;
 	struct timespec now;
 	ssize_t ret = 0;
@@ -342,38 +356,43 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
-
 	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
+	 * Gather the payload outside of log->mutex. A bad user pointer fails
+	 * the write before anything reaches the ring.
 	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
-
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	staging = per_cpu_ptr(log->staging, raw_smp_processor_id());
+	mutex_lock(&staging->mutex);
 
-	while (nr_segs-- > 0) {
+	while (nr_segs-- > 0 && ret < header.len) {
 		size_t len;
-		ssize_t nr;
 
 		/* figure out how much of this vector we can keep */
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
-		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
-		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+		if (unlikely(copy_from_user(staging->buf + ret, iov->iov_base,
+					    len))) {
+			mutex_unlock(&staging->mutex);
+			return -EFAULT;
 		}
 
 		iov++;
-		ret += nr;
+		ret += len;
 	}
+	header.len = ret;
+
+	mutex_lock(&log->mutex);
+
+	/*
+	 * Fix up any readers, pulling them forward to the first readable
+	 * entry after (what will be) the new write offset.
+	 */
+	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+
+	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, staging->buf, header.len);
 
 	mutex_unlock(&log->mutex);
+	mutex_unlock(&staging->mutex);
 
 	/* wake up any blocked readers */
 	wake_up_interruptible(&log->wq);
@@ -409,6 +428,7 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->batch = 0;
 		INIT_LIST_HEAD(&reader->list);
 
 		mutex_lock(&log->mutex);
@@ -473,12 +493,42 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 	return ret;
 }
 
+/*
+ * sync_reader - move a reader of the mmap'd ring forward to 'off'
+ *
+ * 'off' must be an entry boundary between the reader's head and the write
+ * head. Returns 0 on success, -EINVAL otherwise.
+ *
+ * Caller must hold log->mutex.
+ */
+static int sync_reader(struct logger_log *log, struct logger_reader *reader,
+		       size_t off)
+{
+	size_t r_off = reader->r_off;
+
+	if (off >= log->size)
+		return -EINVAL;
+
+	while (r_off != off) {
+		if (r_off == log->w_off)
+			return -EINVAL;
+		r_off = logger_offset(r_off + get_entry_len(log, r_off));
+	}
+	reader->r_off = off;
+	return 0;
+}
+
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
 	struct logger_reader *reader;
+	struct logger_reader_pos pos;
 	long ret = -ENOTTY;
 
+	if (cmd == LOGGER_SYNC_READER &&
+	    copy_from_user(&pos, (void __user *)arg, sizeof(pos)))
+		return -EFAULT;
+
 	mutex_lock(&log->mutex);
 
 	switch (cmd) {
@@ -517,13 +567,69 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		log->head = log->w_off;
 		ret = 0;
 		break;
+	case LOGGER_SET_BATCH_READ:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		reader->batch = !!arg;
+		ret = 0;
+		break;
+	case LOGGER_SYNC_READER:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		/*
+		 * A reader that was lapped has already been pulled past
+		 * 'pos.r_off'; it just gets the current heads back.
+		 */
+		if (pos.r_off != reader->r_off &&
+		    clock_interval(reader->r_off, log->w_off, pos.r_off)) {
+			ret = sync_reader(log, reader, pos.r_off);
+			if (ret)
+				break;
+		}
+		pos.r_off = reader->r_off;
+		pos.w_off = log->w_off;
+		ret = 0;
+		break;
 	}
 
 	mutex_unlock(&log->mutex);
 
+	if (cmd == LOGGER_SYNC_READER && !ret &&
+	    copy_to_user((void __user *)arg, &pos, sizeof(pos)))
+		ret = -EFAULT;
+
 	return ret;
 }
 
+/*
+ * logger_mmap - map the log's ring read-only into a reader
+ *
+ * The mapping lets collectors parse entries in place and use
+ * LOGGER_SYNC_READER to advance, instead of a read() per entry.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long size = vma->vm_end - vma->vm_start;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_pgoff || size > PAGE_ALIGN(log->size))
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTCOPY | VM_DONTEXPAND;
+
+	return remap_vmalloc_range(vma, log->buffer, 0);
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -531,6 +637,7 @@ static const struct file_operations logger_fops = {
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
+	.mmap = logger_mmap,
 	.open = logger_open,
 	.release = logger_release,
 };
@@ -538,12 +645,12 @@ static const struct file_operations logger_fops = {
 /*
  * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
  * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * LONG_MAX minus LOGGER_ENTRY_MAX_LEN. The buffer is allocated by init_log
+ * with vmalloc_user() so that it can be mapped into readers.
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.buffer = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -556,6 +663,7 @@ static struct logger_log VAR = { \
 	.w_off = 0, \
 	.head = 0, \
 	.size = SIZE, \
+	.staging = NULL, \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 64*1024)
@@ -579,11 +687,34 @@ static struct logger_log *get_log_from_minor(int minor)
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
+	int cpu;
+
+	log->buffer = vmalloc_user(log->size);
+	if (unlikely(!log->buffer)) {
+		printk(KERN_ERR "logger: failed to allocate buffer "
+		       "for log '%s'!\n", log->misc.name);
+		return -ENOMEM;
+	}
+
+	log->staging = alloc_percpu(struct logger_staging);
+	if (unlikely(!log->staging)) {
+		printk(KERN_ERR "logger: failed to allocate staging "
+		       "buffers for log '%s'!\n", log->misc.name);
+		vfree(log->buffer);
+		log->buffer = NULL;
+		return -ENOMEM;
+	}
+	for_each_possible_cpu(cpu)
+		mutex_init(&per_cpu_ptr(log->staging, cpu)->mutex);
 
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_percpu(log->staging);
+		log->staging = NULL;
+		vfree(log->buffer);
+		log->buffer = NULL;
 		return ret;
 	}
 
@@ -45,5 +45,21 @@ struct logger_entry {
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_SET_BATCH_READ		_IO(__LOGGERIO, 5) /* many entries/read */
+
+/*
+ * struct logger_reader_pos - reader head for readers of the mmap'd ring
+ *
+ * Passed to LOGGER_SYNC_READER with r_off set to the offset the reader
+ * has consumed up to (an entry boundary). The driver advances the reader
+ * and returns its read head and the write head. If the reader was lapped
+ * while it was parsing, the returned r_off is past the requested one.
+ */
+struct logger_reader_pos {
+	__u32		r_off;	/* read head offset into the ring */
+	__u32		w_off;	/* write head offset into the ring */
+};
+
+#define LOGGER_SYNC_READER	_IOWR(__LOGGERIO, 6, struct logger_reader_pos)
 
 #endif /* _LINUX_LOGGER_H */
@@ -0,0 +1,162 @@
+/*
+ * drivers/staging/android/logger_bench.c
+ *
+ * Write throughput benchmark for the Android log driver
+ *
+ * Copyright (C) 2010 Google, Inc.
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Loading the module starts 'threads' kernel threads that each write
+ * 'len'-byte entries to 'log' for 'seconds' seconds. The module reports
+ * the aggregate writes/sec when it is done; insmod returns once the run
+ * has finished.
+ *
+ *   insmod logger_bench.ko threads=4 seconds=5 log=/dev/log/main
+ */
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/err.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+#include <linux/jiffies.h>
+#include <linux/sched.h>
+#include "logger.h"
+
+static char *log = "/dev/log/main";
+module_param(log, charp, S_IRUGO);
+MODULE_PARM_DESC(log, "log device to write to");
+
+static int threads = 2;
+module_param(threads, int, S_IRUGO);
+MODULE_PARM_DESC(threads, "number of concurrent writer threads");
+
+static int seconds = 5;
+module_param(seconds, int, S_IRUGO);
+MODULE_PARM_DESC(seconds, "duration of the run");
+
+static int len = 64;
+module_param(len, int, S_IRUGO);
+MODULE_PARM_DESC(len, "payload bytes per entry, including priority and tag");
+
+struct logger_bench_thread {
+	struct task_struct	*task;
+	unsigned long		writes;
+	int			error;
+	struct completion	done;
+};
+
+static unsigned long logger_bench_end;
+
+static int logger_bench_fn(void *data)
+{
+	struct logger_bench_thread *bt = data;
+	struct file *filp;
+	mm_segment_t old_fs;
+	char *buf;
+	loff_t pos = 0;
+	ssize_t ret;
+
+	buf = kmalloc(len, GFP_KERNEL);
+	if (!buf) {
+		bt->error = -ENOMEM;
+		goto out;
+	}
+	/* priority, "bench" tag and a message, as liblog lays them out */
+	memset(buf, 'x', len);
+	buf[0] = 4;
+	memcpy(buf + 1, "bench", 6);
+	buf[len - 1] = '\0';
+
+	filp = filp_open(log, O_WRONLY, 0);
+	if (IS_ERR(filp)) {
+		bt->error = PTR_ERR(filp);
+		goto out_free;
+	}
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (time_before(jiffies, logger_bench_end)) {
+		ret = vfs_write(filp, (char __user *)buf, len, &pos);
+		if (ret < 0) {
+			bt->error = ret;
+			break;
+		}
+		bt->writes++;
+		cond_resched();
+	}
+	set_fs(old_fs);
+
+	filp_close(filp, NULL);
+out_free:
+	kfree(buf);
+out:
+	complete(&bt->done);
+	return 0;
+}
+
+static int __init logger_bench_init(void)
+{
+	struct logger_bench_thread *bt;
+	unsigned long total = 0;
+	int started = 0;
+	int ret = 0;
+	int i;
+
+	if (threads <= 0 || seconds <= 0 || len < 8 ||
+	    len > LOGGER_ENTRY_MAX_PAYLOAD)
+		return -EINVAL;
+
+	bt = kcalloc(threads, sizeof(*bt), GFP_KERNEL);
+	if (!bt)
+		return -ENOMEM;
+
+	logger_bench_end = jiffies + seconds * HZ;
+	for (i = 0; i < threads; i++) {
+		init_completion(&bt[i].done);
+		bt[i].task = kthread_run(logger_bench_fn, &bt[i],
+					 "logger_bench/%d", i);
+		if (IS_ERR(bt[i].task)) {
+			ret = PTR_ERR(bt[i].task);
+			break;
+		}
+		started++;
+	}
+
+	for (i = 0; i < started; i++) {
+		wait_for_completion(&bt[i].done);
+		if (bt[i].error && !ret)
+			ret = bt[i].error;
+		total += bt[i].writes;
+		printk(KERN_INFO "logger_bench: thread %d: %lu writes\n",
+		       i, bt[i].writes);
+	}
+
+	printk(KERN_INFO "logger_bench: %s: %d threads, %d byte entries, "
+	       "%lu writes in %ds, %lu writes/sec\n", log, started, len,
+	       total, seconds, total / seconds);
+
+	kfree(bt);
+	return ret;
+}
+
+static void __exit logger_bench_exit(void)
+{
+}
+
+module_init(logger_bench_init);
+module_exit(logger_bench_exit);
+
+MODULE_LICENSE("GPL v2");
+MODULE_DESCRIPTION("Android log driver write benchmark");
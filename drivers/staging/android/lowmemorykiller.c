@@ -16,6 +16,19 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Processes are kept in per oom_adj lists, updated from fork, oom_adj writes
+ * and task free, so picking a victim only looks at the highest oom_adj level
+ * that has processes in it instead of walking every task. Scan cost and kill
+ * latency are reported in debugfs under lowmemorykiller/stats.
+ *
+ * /dev/lowmem_pressure lets user-space trim caches before it gets killed.
+ * The pressure level is the number of minfree thresholds that free and file
+ * memory are within pressure_margin percent of, so a level is reported
+ * before the matching oom_adj range starts getting killed. Reading returns
+ * a line with the level, the oom_adj that would be killed at it and the
+ * free and file page counts it was based on; poll signals a level change.
+ * Level crossings are kept in debugfs under lowmemorykiller/pressure.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +48,16 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/poll.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
 
 #define DEBUG_LEVEL_DEATHPENDING 6
 
@@ -66,8 +89,71 @@ static int lowmem_minfile_size = 6;
 
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
+static ktime_t lowmem_deathpending_start;
 static uint32_t lowmem_check_filepages = 0;
 
+/*
+ * struct lowmem_task - a process in the oom_adj index
+ *
+ * One per thread group leader. Entries are found by task through
+ * lowmem_task_hash and linked on the lowmem_adj_lists entry for their
+ * oom_adj. The task pointer is not referenced; the entry is dropped from
+ * the task free notifier before the task goes away, and the shrinker
+ * takes its own reference before looking at the task.
+ */
+struct lowmem_task {
+	struct hlist_node	hash;
+	struct list_head	list;
+	struct task_struct	*task;
+	int			oom_adj;
+};
+
+#define LOWMEM_ADJ_LEVELS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+
+static struct list_head lowmem_adj_lists[LOWMEM_ADJ_LEVELS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+static struct kmem_cache *lowmem_task_cachep;
+static int lowmem_index_count;
+static int lowmem_index_stale;
+static DEFINE_SPINLOCK(lowmem_index_lock);
+
+static struct lowmem_stats {
+	unsigned long	selections;
+	unsigned long	tasks_scanned;
+	unsigned long	max_scanned;
+	unsigned long	rebuilds;
+	unsigned long	full_scans;
+	u64		scan_ns;
+	u64		max_scan_ns;
+	unsigned long	kills;
+	unsigned long	kills_reaped;
+	u64		kill_latency_ns;
+	u64		max_kill_latency_ns;
+} lowmem_stats;
+
+#define LOWMEM_PRESSURE_HISTORY	32
+
+struct lowmem_pressure_event {
+	ktime_t		time;
+	int		level;
+	int		other_free;
+	int		other_file;
+};
+
+static int lowmem_pressure_margin = 25;
+static int lowmem_pressure_level;
+static int lowmem_pressure_adj = OOM_ADJUST_MAX + 1;
+static int lowmem_pressure_free;
+static int lowmem_pressure_file;
+static unsigned int lowmem_pressure_seq;
+static unsigned long lowmem_pressure_crossings[ARRAY_SIZE(lowmem_adj) + 1];
+static struct lowmem_pressure_event
+	lowmem_pressure_history[LOWMEM_PRESSURE_HISTORY];
+static unsigned int lowmem_pressure_next;
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_pressure_wait);
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level)) {	\
@@ -83,20 +169,153 @@ static struct notifier_block task_nb = {
 	.notifier_call	= task_notify_func,
 };
 
+static struct lowmem_task *lowmem_index_find(struct task_struct *task)
+{
+	struct hlist_head *head;
+	struct hlist_node *n;
+	struct lowmem_task *lt;
+
+	head = &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)];
+	hlist_for_each_entry(lt, n, head, hash) {
+		if (lt->task == task)
+			return lt;
+	}
+	return NULL;
+}
+
+static int lowmem_adj_level(int oom_adj)
+{
+	if (oom_adj < OOM_DISABLE)
+		return 0;
+	if (oom_adj > OOM_ADJUST_MAX)
+		return LOWMEM_ADJ_LEVELS - 1;
+	return oom_adj - OOM_DISABLE;
+}
+
+/*
+ * lowmem_index_update - add @task to the index or move it to @oom_adj
+ *
+ * Runs from notifiers and under spinlocks, so the allocation can not
+ * sleep. If it fails the index is marked stale and rebuilt by the next
+ * shrink. Caller must hold lowmem_index_lock.
+ */
+static void lowmem_index_update(struct task_struct *task, int oom_adj)
+{
+	struct lowmem_task *lt;
+	int level = lowmem_adj_level(oom_adj);
+
+	lt = lowmem_index_find(task);
+	if (!lt) {
+		lt = kmem_cache_alloc(lowmem_task_cachep, GFP_ATOMIC);
+		if (!lt) {
+			lowmem_index_stale = 1;
+			return;
+		}
+		lt->task = task;
+		hlist_add_head(&lt->hash,
+			&lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)]);
+		INIT_LIST_HEAD(&lt->list);
+		lowmem_index_count++;
+	}
+	lt->oom_adj = oom_adj;
+	list_move_tail(&lt->list, &lowmem_adj_lists[level]);
+}
+
+static void lowmem_index_remove(struct lowmem_task *lt)
+{
+	hlist_del(&lt->hash);
+	list_del(&lt->list);
+	lowmem_index_count--;
+	kmem_cache_free(lowmem_task_cachep, lt);
+}
+
+/*
+ * lowmem_index_rebuild - resync the index with the process list
+ *
+ * Covers allocation failures in lowmem_index_update and leaders that
+ * change under exec from a non-leader thread. Entries for exited
+ * processes are left to the task free notifier. Caller must hold
+ * tasklist_lock and lowmem_index_lock.
+ */
+static void lowmem_index_rebuild(void)
+{
+	struct task_struct *p;
+
+	lowmem_index_stale = 0;
+	for_each_process(p) {
+		if (p->signal)
+			lowmem_index_update(p, p->signal->oom_adj);
+	}
+	lowmem_stats.rebuilds++;
+}
+
 static int
 task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 {
 	struct task_struct *task = data;
+	struct lowmem_task *lt;
+	unsigned long flags;
 
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lt = lowmem_index_find(task);
+	if (lt)
+		lowmem_index_remove(lt);
 	if (task == lowmem_deathpending) {
+		u64 ns = ktime_to_ns(ktime_sub(ktime_get(),
+					       lowmem_deathpending_start));
+
+		lowmem_stats.kills_reaped++;
+		lowmem_stats.kill_latency_ns += ns;
+		if (ns > lowmem_stats.max_kill_latency_ns)
+			lowmem_stats.max_kill_latency_ns = ns;
 		lowmem_deathpending = NULL;
 		lowmem_print(2, "deathpending end %d (%s)\n",
 			task->pid, task->comm);
 	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return NOTIFY_OK;
+}
+
+static int
+task_fork_func(struct notifier_block *self, unsigned long clone_flags,
+	       void *data)
+{
+	struct task_struct *task = data;
+	unsigned long flags;
+
+	if (clone_flags & CLONE_THREAD)
+		return NOTIFY_OK;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lowmem_index_update(task, task->signal->oom_adj);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block task_fork_nb = {
+	.notifier_call	= task_fork_func,
+};
+
+static int
+oom_adj_notify_func(struct notifier_block *self, unsigned long val,
+		    void *data)
+{
+	struct task_struct *task = data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lowmem_index_update(task->group_leader, (int)val);
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
 
 	return NOTIFY_OK;
 }
 
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
 static void dump_deathpending(struct task_struct *t_deathpending)
 {
 	struct task_struct *p;
@@ -133,17 +352,172 @@ static void dump_deathpending(struct task_struct *t_deathpending)
 	read_unlock(&tasklist_lock);
 }
 
+/*
+ * lowmem_threshold - index of the lowest minfree threshold that memory is
+ * under once each threshold is raised by @margin percent, or -1 if none
+ */
+static int lowmem_threshold(int other_free, int other_file, int lru_file,
+			    int margin)
+{
+	int array_size = ARRAY_SIZE(lowmem_adj);
+	int i;
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	for (i = 0; i < array_size; i++) {
+		int minfree = lowmem_minfree[i] * (100 + margin) / 100;
+		int minfile = lowmem_minfile[i] * (100 + margin) / 100;
+
+		if (other_free < minfree) {
+			if (other_file < minfree ||
+				(lowmem_check_filepages &&
+				(lru_file < minfile)))
+				return i;
+		}
+	}
+	return -1;
+}
+
+static void lowmem_pressure_work_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_pressure_work, lowmem_pressure_work_fn);
+
+/*
+ * lowmem_pressure_update - recompute the pressure level
+ *
+ * Called with the counters lowmem_shrink already read. Reclaim stops
+ * calling the shrinker once memory recovers, so while the level is up it
+ * is also rechecked from a delayed work to report the way back down.
+ */
+static void lowmem_pressure_update(int other_free, int other_file,
+				   int lru_file)
+{
+	int array_size = min(lowmem_adj_size, lowmem_minfree_size);
+	int adj = OOM_ADJUST_MAX + 1;
+	int level = 0;
+	int i;
+
+	i = lowmem_threshold(other_free, other_file, lru_file,
+			     lowmem_pressure_margin);
+	if (i >= 0) {
+		level = min_t(int, array_size, ARRAY_SIZE(lowmem_adj)) - i;
+		adj = lowmem_adj[i];
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	lowmem_pressure_free = other_free;
+	lowmem_pressure_file = other_file;
+	if (level != lowmem_pressure_level) {
+		struct lowmem_pressure_event *e;
+
+		e = &lowmem_pressure_history[lowmem_pressure_next++ %
+					     LOWMEM_PRESSURE_HISTORY];
+		e->time = ktime_get();
+		e->level = level;
+		e->other_free = other_free;
+		e->other_file = other_file;
+		lowmem_pressure_crossings[level]++;
+		lowmem_pressure_level = level;
+		lowmem_pressure_adj = adj;
+		lowmem_pressure_seq++;
+		wake_up_interruptible(&lowmem_pressure_wait);
+		lowmem_print(3, "pressure level %d, ofree %d %d\n",
+			     level, other_free, other_file);
+	}
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (level)
+		schedule_delayed_work(&lowmem_pressure_work, HZ);
+}
+
+static void lowmem_pressure_work_fn(struct work_struct *work)
+{
+	lowmem_pressure_update(global_page_state(NR_FREE_PAGES),
+			       global_page_state(NR_FILE_PAGES) -
+			       global_page_state(NR_SHMEM),
+			       global_page_state(NR_ACTIVE_FILE) +
+			       global_page_state(NR_INACTIVE_FILE));
+}
+
+/*
+ * lowmem_task_size - resident pages of process @p, 0 if it has no mm
+ */
+static int lowmem_task_size(struct task_struct *p)
+{
+	int tasksize = 0;
+
+	task_lock(p);
+	if (p->mm)
+		tasksize = get_mm_rss(p->mm);
+	task_unlock(p);
+	return tasksize;
+}
+
+#define LOWMEM_SCAN_BATCH	32
+
+/*
+ * lowmem_index_collect - pin up to @max processes from index @level
+ *
+ * Skips the first @skip entries of the level and the ones below
+ * @min_adj. lowmem_index_lock is also taken from the task free path, so
+ * task_lock and the RSS walk can not run under it: the caller sizes the
+ * pinned tasks after the lock is dropped and puts them when done. A task
+ * whose last reference is already gone is about to be dropped from the
+ * index by the free notifier and is not pinned. Returns the number of
+ * tasks stored in @tasks and @adj, and sets *@more if the level has
+ * entries past them.
+ */
+static int lowmem_index_collect(int level, int min_adj, int skip, int max,
+				struct task_struct **tasks, int *adj,
+				unsigned long *scanned, int *more)
+{
+	struct lowmem_task *lt;
+	unsigned long flags;
+	int n = 0;
+
+	*more = 0;
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	list_for_each_entry(lt, &lowmem_adj_lists[level], list) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (n == max) {
+			*more = 1;
+			break;
+		}
+		(*scanned)++;
+		if (lt->oom_adj < min_adj)
+			continue;
+		if (!atomic_inc_not_zero(&lt->task->usage))
+			continue;
+		tasks[n] = lt->task;
+		adj[n] = lt->oom_adj;
+		n++;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	return n;
+}
+
 static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
 	struct task_struct *p;
 	struct task_struct *selected = NULL;
+	struct task_struct *tasks[LOWMEM_SCAN_BATCH];
+	int adj[LOWMEM_SCAN_BATCH];
+	unsigned long flags;
+	unsigned long scanned = 0;
+	ktime_t start;
+	u64 scan_ns;
+	int level;
+	int stale;
 	int rem = 0;
 	int tasksize;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
 	int selected_tasksize = 0;
 	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -157,27 +531,17 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	 * this pass.
 	 *
 	 */
+	lowmem_pressure_update(other_free, other_file, lru_file);
+
 	if (lowmem_deathpending &&
 	    time_before_eq(jiffies, lowmem_deathpending_timeout)) {
 		dump_deathpending(lowmem_deathpending);
 		return 0;
 	}
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
-	for (i = 0; i < array_size; i++) {
-		if (other_free < lowmem_minfree[i]) {
-			if (other_file < lowmem_minfree[i] ||
-				(lowmem_check_filepages &&
-				(lru_file < lowmem_minfile[i]))) {
-
-				min_adj = lowmem_adj[i];
-				break;
-			}
-		}
-	}
+	i = lowmem_threshold(other_free, other_file, lru_file, 0);
+	if (i >= 0)
+		min_adj = lowmem_adj[i];
 	if (nr_to_scan > 0)
 		lowmem_print(3, "lowmem_shrink %d, %x, ofree %d %d, ma %d\n",
 			     nr_to_scan, gfp_mask, other_free, other_file,
@@ -193,49 +557,108 @@ static int lowmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 	}
 	selected_oom_adj = min_adj;
 
+	start = ktime_get();
 	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	/*
+	 * Fewer entries than processes means a fork or exec was missed;
+	 * extra entries are just exited processes not yet freed.
+	 */
+	if (lowmem_index_stale || lowmem_index_count < nr_processes())
+		lowmem_index_rebuild();
+	stale = lowmem_index_stale;
+	if (stale)
+		lowmem_stats.full_scans++;
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
 
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
+	if (!stale) {
+		for (level = LOWMEM_ADJ_LEVELS - 1;
+		     level >= lowmem_adj_level(min_adj) && !selected;
+		     level--) {
+			int skip = 0;
+			int more;
+
+			do {
+				int n = lowmem_index_collect(level, min_adj,
+					skip, LOWMEM_SCAN_BATCH, tasks, adj,
+					&scanned, &more);
+
+				skip += LOWMEM_SCAN_BATCH;
+				for (i = 0; i < n; i++) {
+					tasksize = lowmem_task_size(tasks[i]);
+					if (tasksize <= selected_tasksize) {
+						put_task_struct(tasks[i]);
+						continue;
+					}
+					if (selected)
+						put_task_struct(selected);
+					selected = tasks[i];
+					selected_tasksize = tasksize;
+					selected_oom_adj = adj[i];
+					lowmem_print(2, "select %d (%s), adj %d, "
+						     "size %d, to kill\n",
+						     selected->pid, selected->comm,
+						     selected_oom_adj, tasksize);
+				}
+			} while (more);
 		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
+	} else {
+		for_each_process(p) {
+			struct signal_struct *sig = p->signal;
+			int oom_adj;
+
+			scanned++;
+			if (!sig)
+				continue;
+			oom_adj = sig->oom_adj;
+			if (oom_adj < min_adj)
 				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
+			tasksize = lowmem_task_size(p);
+			if (tasksize <= 0)
 				continue;
+			if (selected) {
+				if (oom_adj < selected_oom_adj)
+					continue;
+				if (oom_adj == selected_oom_adj &&
+				    tasksize <= selected_tasksize)
+					continue;
+				put_task_struct(selected);
+			}
+			get_task_struct(p);
+			selected = p;
+			selected_tasksize = tasksize;
+			selected_oom_adj = oom_adj;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n",
+				     p->pid, p->comm, oom_adj, tasksize);
 		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
 	}
+
+	scan_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	lowmem_stats.selections++;
+	lowmem_stats.tasks_scanned += scanned;
+	if (scanned > lowmem_stats.max_scanned)
+		lowmem_stats.max_scanned = scanned;
+	lowmem_stats.scan_ns += scan_ns;
+	if (scan_ns > lowmem_stats.max_scan_ns)
+		lowmem_stats.max_scan_ns = scan_ns;
+
 	if (selected) {
 		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
 			     selected->pid, selected->comm,
 			     selected_oom_adj, selected_tasksize);
 		lowmem_deathpending = selected;
 		lowmem_deathpending_timeout = jiffies + HZ;
+		lowmem_deathpending_start = ktime_get();
+		lowmem_stats.kills++;
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	if (selected) {
 		force_sig(SIGKILL, selected);
 		rem -= selected_tasksize;
+		put_task_struct(selected);
 	}
 	lowmem_print(4, "lowmem_shrink %d, %x, return %d\n",
 		     nr_to_scan, gfp_mask, rem);
@@ -248,17 +671,226 @@ static struct shrinker lowmem_shrinker = {
 	.seeks = DEFAULT_SEEKS * 16
 };
 
+static int lowmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_stats stats;
+	unsigned long count;
+	unsigned long flags;
+	int level;
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	stats = lowmem_stats;
+	count = lowmem_index_count;
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+
+	seq_printf(m, "indexed: %lu%s\n", count,
+		   lowmem_index_stale ? " (stale)" : "");
+	seq_printf(m, "selections: %lu\n", stats.selections);
+	seq_printf(m, "tasks scanned: %lu (max %lu)\n",
+		   stats.tasks_scanned, stats.max_scanned);
+	seq_printf(m, "rebuilds: %lu\n", stats.rebuilds);
+	seq_printf(m, "full scans: %lu\n", stats.full_scans);
+	seq_printf(m, "scan time: %llu us (max %llu us)\n",
+		   div_u64(stats.scan_ns, NSEC_PER_USEC),
+		   div_u64(stats.max_scan_ns, NSEC_PER_USEC));
+	seq_printf(m, "kills: %lu\n", stats.kills);
+	seq_printf(m, "kill latency: %llu us (max %llu us) over %lu reaped\n",
+		   stats.kills_reaped ?
+		   div_u64(div_u64(stats.kill_latency_ns, stats.kills_reaped),
+			   NSEC_PER_USEC) : 0,
+		   div_u64(stats.max_kill_latency_ns, NSEC_PER_USEC),
+		   stats.kills_reaped);
+
+	spin_lock_irqsave(&lowmem_index_lock, flags);
+	for (level = 0; level < LOWMEM_ADJ_LEVELS; level++) {
+		struct lowmem_task *lt;
+		int n = 0;
+
+		list_for_each_entry(lt, &lowmem_adj_lists[level], list)
+			n++;
+		if (n)
+			seq_printf(m, "  adj %d: %d\n", level + OOM_DISABLE, n);
+	}
+	spin_unlock_irqrestore(&lowmem_index_lock, flags);
+	return 0;
+}
+
+static int lowmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_stats_show, inode->i_private);
+}
+
+static const struct file_operations lowmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int lowmem_pressure_show(struct seq_file *m, void *unused)
+{
+	struct lowmem_pressure_event *e;
+	unsigned int next;
+	unsigned int n;
+	int level;
+
+	spin_lock(&lowmem_pressure_lock);
+	seq_printf(m, "level: %d\n", lowmem_pressure_level);
+	seq_printf(m, "margin: %d%%\n", lowmem_pressure_margin);
+	seq_printf(m, "free: %d file: %d\n",
+		   lowmem_pressure_free, lowmem_pressure_file);
+	for (level = 0; level < ARRAY_SIZE(lowmem_pressure_crossings); level++)
+		seq_printf(m, "  to level %d: %lu\n", level,
+			   lowmem_pressure_crossings[level]);
+	next = lowmem_pressure_next;
+	n = min_t(unsigned int, next, LOWMEM_PRESSURE_HISTORY);
+	seq_printf(m, "history:\n");
+	while (n) {
+		e = &lowmem_pressure_history[(next - n) %
+					     LOWMEM_PRESSURE_HISTORY];
+		seq_printf(m, "  %llu ms: level %d, free %d, file %d\n",
+			   div_u64(ktime_to_ns(e->time), NSEC_PER_MSEC),
+			   e->level, e->other_free, e->other_file);
+		n--;
+	}
+	spin_unlock(&lowmem_pressure_lock);
+	return 0;
+}
+
+static int lowmem_pressure_debug_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, lowmem_pressure_show, inode->i_private);
+}
+
+static const struct file_operations lowmem_pressure_debug_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_debug_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *lowmem_debugfs_dir;
+
+/*
+ * Each open file remembers the last sequence number it read, so the first
+ * read returns the current state right away and later ones wait for a
+ * level change.
+ */
+static int lowmem_pressure_open(struct inode *inode, struct file *file)
+{
+	file->private_data = (void *)(unsigned long)(lowmem_pressure_seq - 1);
+	return nonseekable_open(inode, file);
+}
+
+static ssize_t lowmem_pressure_read(struct file *file, char __user *buf,
+				    size_t count, loff_t *pos)
+{
+	unsigned int seen = (unsigned long)file->private_data;
+	unsigned int seq;
+	char tmp[80];
+	int len;
+
+	if (seen == lowmem_pressure_seq) {
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(lowmem_pressure_wait,
+					     seen != lowmem_pressure_seq))
+			return -ERESTARTSYS;
+	}
+
+	spin_lock(&lowmem_pressure_lock);
+	seq = lowmem_pressure_seq;
+	len = scnprintf(tmp, sizeof(tmp), "level %d adj %d free %d file %d\n",
+			lowmem_pressure_level, lowmem_pressure_adj,
+			lowmem_pressure_free, lowmem_pressure_file);
+	spin_unlock(&lowmem_pressure_lock);
+
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+	file->private_data = (void *)(unsigned long)seq;
+	return len;
+}
+
+static unsigned int lowmem_pressure_poll(struct file *file, poll_table *wait)
+{
+	unsigned int seen = (unsigned long)file->private_data;
+
+	poll_wait(file, &lowmem_pressure_wait, wait);
+	if (seen != lowmem_pressure_seq)
+		return POLLIN | POLLRDNORM;
+	return 0;
+}
+
+static const struct file_operations lowmem_pressure_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_pressure_open,
+	.read = lowmem_pressure_read,
+	.poll = lowmem_pressure_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_pressure_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_pressure_fops,
+};
+
 static int __init lowmem_init(void)
 {
+	int i;
+
+	lowmem_task_cachep = KMEM_CACHE(lowmem_task, 0);
+	if (!lowmem_task_cachep)
+		return -ENOMEM;
+	for (i = 0; i < LOWMEM_ADJ_LEVELS; i++)
+		INIT_LIST_HEAD(&lowmem_adj_lists[i]);
+
 	task_free_register(&task_nb);
+	task_fork_register(&task_fork_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+
+	read_lock(&tasklist_lock);
+	spin_lock_irq(&lowmem_index_lock);
+	lowmem_index_rebuild();
+	spin_unlock_irq(&lowmem_index_lock);
+	read_unlock(&tasklist_lock);
+
+	lowmem_debugfs_dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (lowmem_debugfs_dir) {
+		debugfs_create_file("stats", S_IRUGO, lowmem_debugfs_dir,
+				    NULL, &lowmem_stats_fops);
+		debugfs_create_file("pressure", S_IRUGO, lowmem_debugfs_dir,
+				    NULL, &lowmem_pressure_debug_fops);
+	}
+
+	if (misc_register(&lowmem_pressure_misc))
+		printk(KERN_ERR "lowmem: failed to register pressure device\n");
+
 	register_shrinker(&lowmem_shrinker);
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	struct lowmem_task *lt, *tmp;
+	int i;
+
 	unregister_shrinker(&lowmem_shrinker);
+	cancel_delayed_work_sync(&lowmem_pressure_work);
+	misc_deregister(&lowmem_pressure_misc);
+	debugfs_remove_recursive(lowmem_debugfs_dir);
+	unregister_oom_adj_notifier(&oom_adj_nb);
+	task_fork_unregister(&task_fork_nb);
 	task_free_unregister(&task_nb);
+
+	for (i = 0; i < LOWMEM_ADJ_LEVELS; i++)
+		list_for_each_entry_safe(lt, tmp, &lowmem_adj_lists[i], list)
+			lowmem_index_remove(lt);
+	kmem_cache_destroy(lowmem_task_cachep);
 }
 
 module_param_named(cost, lowmem_shrinker.seeks, int, S_IRUGO | S_IWUSR);
@@ -267,6 +899,8 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure_margin, lowmem_pressure_margin, int,
+		   S_IRUGO | S_IWUSR);
 
 module_param_named(check_filepages , lowmem_check_filepages, uint,
 		   S_IRUGO | S_IWUSR);
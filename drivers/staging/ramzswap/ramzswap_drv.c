@@ -23,6 +23,10 @@
 #include <linux/device.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/jhash.h>
+#include <linux/ktime.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/slab.h>
 #include <linux/lzo.h>
 #include <linux/string.h>
@@ -38,6 +42,14 @@ static struct ramzswap *devices;
 
 /* Module params (documentation at end) */
 static unsigned int num_devices;
+static int dedup = 1;
+static unsigned int compact_threshold = 40;
+static unsigned int writeback_interval = 60;
+static unsigned int writeback_age = 5;
+
+static struct kmem_cache *rzs_dedup_cachep;
+
+static struct block_device_operations ramzswap_devops;
 
 static int rzs_test_flag(struct ramzswap *rzs, u32 index,
 			enum rzs_pageflags flag)
@@ -57,21 +69,593 @@ static void rzs_clear_flag(struct ramzswap *rzs, u32 index,
 	rzs->table[index].flags &= ~BIT(flag);
 }
 
-static int page_zero_filled(void *ptr)
+/*
+ * Returns 1 if the page is a single word repeated, and that word in
+ * *element; zero pages are the common case of this.
+ */
+static int page_same_filled(void *ptr, unsigned long *element)
 {
 	unsigned int pos;
 	unsigned long *page;
 
 	page = (unsigned long *)ptr;
 
-	for (pos = 0; pos != PAGE_SIZE / sizeof(*page); pos++) {
-		if (page[pos])
+	for (pos = 1; pos != PAGE_SIZE / sizeof(*page); pos++) {
+		if (page[pos] != page[0])
 			return 0;
 	}
 
+	*element = page[0];
+	return 1;
+}
+
+/*
+ * Look for a stored object identical to the compressed data in src and
+ * take a reference to it. Caller must hold rzs->lock.
+ */
+static struct rzs_dedup *rzs_dedup_get(struct ramzswap *rzs, u32 hash,
+			unsigned char *src, size_t clen)
+{
+	struct rzs_dedup *d;
+	struct hlist_node *n;
+	unsigned char *cmem;
+	struct hlist_head *head;
+	int same;
+
+	head = &rzs->dedup_hash[hash & ((1 << RZS_DEDUP_HASH_BITS) - 1)];
+
+	spin_lock(&rzs->obj_lock);
+	hlist_for_each_entry(d, n, head, node) {
+		if (d->hash != hash || d->clen != clen)
+			continue;
+		cmem = kmap_atomic(d->page, KM_USER1) + d->offset;
+		same = !memcmp(cmem + sizeof(struct zobj_header), src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		if (same) {
+			d->refcount++;
+			spin_unlock(&rzs->obj_lock);
+			return d;
+		}
+	}
+	spin_unlock(&rzs->obj_lock);
+
+	return NULL;
+}
+
+/*
+ * Drop a slot's reference to a shared object. Returns 1 if it was the
+ * last one; the object is then unhashed and up to the caller to free
+ * with rzs_dedup_free. Called without rzs->lock from slot free notify,
+ * so the refcount is protected by obj_lock, which the caller holds.
+ */
+static int rzs_dedup_unref(struct ramzswap *rzs, struct rzs_dedup *d)
+{
+	if (--d->refcount) {
+		rzs_stat_dec(&rzs->stats.pages_dedup);
+		rzs_stat64_add(rzs, &rzs->stats.dedup_saved, -(u64)d->clen);
+		return 0;
+	}
+	hlist_del(&d->node);
+
+	rzs->stats.compr_size -= d->clen;
+	rzs->stats.pool_data -= d->clen + sizeof(struct zobj_header);
 	return 1;
 }
 
+static void rzs_dedup_free(struct ramzswap *rzs, struct rzs_dedup *d)
+{
+	xv_free(rzs->mem_pool, d->page, d->offset);
+	kmem_cache_free(rzs_dedup_cachep, d);
+}
+
+static void rzs_dedup_put(struct ramzswap *rzs, struct rzs_dedup *d)
+{
+	if (rzs_dedup_unref(rzs, d))
+		rzs_dedup_free(rzs, d);
+}
+
+/*
+ * Called by xv_compact, with obj_lock held, when the object that was at
+ * <old_page, old_offset> is now at <new_page, new_offset>. Points
+ * whatever referenced it at the new copy.
+ */
+static void ramzswap_relocate(void *priv, void *obj,
+			struct page *old_page, u32 old_offset,
+			struct page *new_page, u32 new_offset)
+{
+	struct ramzswap *rzs = priv;
+	struct zobj_header *zheader = obj;
+	u32 index = zheader->table_idx;
+	struct table *t = &rzs->table[index];
+	struct hlist_node *n;
+	struct rzs_dedup *d;
+	size_t clen;
+	u32 hash;
+
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		d = t->dedup;
+		if (d->page == old_page && d->offset == old_offset)
+			goto found;
+	} else if (!(t->flags & (BIT(RZS_SAME) | BIT(RZS_ZERO) |
+				 BIT(RZS_UNCOMPRESSED))) &&
+		   t->page == old_page && t->offset == old_offset) {
+		t->page = new_page;
+		t->offset = new_offset;
+		return;
+	}
+
+	/*
+	 * A shared object whose first slot has since been freed; find its
+	 * entry by content.
+	 */
+	clen = xv_get_object_size(obj) - sizeof(*zheader);
+	hash = jhash(obj + sizeof(*zheader), clen, 0);
+	hlist_for_each_entry(d, n, &rzs->dedup_hash[hash &
+			((1 << RZS_DEDUP_HASH_BITS) - 1)], node) {
+		if (d->page == old_page && d->offset == old_offset)
+			goto found;
+	}
+	WARN_ONCE(1, "ramzswap: no owner for moved object\n");
+	return;
+
+found:
+	d->page = new_page;
+	d->offset = new_offset;
+}
+
+/*
+ * Move objects out of sparsely used pages and free those pages.
+ * Pages are looked at in batches of compact_batch_pages with rzs->lock
+ * held, which keeps writers out; the lock is dropped between batches.
+ * Readers don't take the lock: they retry through migrate_seq and read
+ * under rcu_read_lock, so an emptied page is only freed after a grace
+ * period. Slot frees are held off by obj_lock.
+ */
+static void ramzswap_compact(struct ramzswap *rzs)
+{
+	struct xv_compact_control cc = {
+		.max_fill = compact_max_fill,
+		.max_pages = compact_batch_pages,
+		.lock = &rzs->obj_lock,
+		.seq = &rzs->migrate_seq,
+		.relocate = ramzswap_relocate,
+		.priv = rzs,
+	};
+	struct page *page, *tmp;
+	u64 pages;
+	int ret = 0;
+
+	INIT_LIST_HEAD(&cc.freed);
+	pages = xv_get_total_size_bytes(rzs->mem_pool) >> PAGE_SHIFT;
+
+	while (cc.pages_scanned < pages) {
+		u32 scanned = cc.pages_scanned;
+
+		mutex_lock(&rzs->lock);
+		if (rzs->init_done)
+			ret = xv_compact(rzs->mem_pool, &cc);
+		mutex_unlock(&rzs->lock);
+
+		if (!list_empty(&cc.freed)) {
+			synchronize_rcu();
+			list_for_each_entry_safe(page, tmp, &cc.freed, lru) {
+				list_del(&page->lru);
+				__free_page(page);
+			}
+		}
+		if (ret || cc.pages_scanned == scanned)
+			break;
+	}
+	if (ret)
+		return;
+
+	rzs_stat64_inc(rzs, &rzs->stats.compactions);
+	rzs_stat64_add(rzs, &rzs->stats.compact_pages_freed, cc.pages_freed);
+	rzs_stat64_add(rzs, &rzs->stats.compact_objs_moved, cc.objs_moved);
+	pr_debug("Compaction freed %u pages, moved %u objects\n",
+		cc.pages_freed, cc.objs_moved);
+}
+
+static void ramzswap_compact_work(struct work_struct *work)
+{
+	struct ramzswap *rzs = container_of(work, struct ramzswap,
+					    compact_work);
+
+	ramzswap_compact(rzs);
+}
+
+/*
+ * Queue a compaction once the pool holds compact_threshold % more than
+ * the compressed data in it, at most every ten seconds.
+ */
+static void ramzswap_check_fragmentation(struct ramzswap *rzs)
+{
+	u64 pool_bytes;
+
+	if (!compact_threshold)
+		return;
+
+	pool_bytes = xv_get_total_size_bytes(rzs->mem_pool);
+	if (pool_bytes < compact_min_pages << PAGE_SHIFT ||
+	    pool_bytes * 100 <
+	    (u64)rzs->stats.pool_data * (100 + compact_threshold))
+		return;
+	if (time_before(jiffies, rzs->compact_next))
+		return;
+
+	rzs->compact_next = jiffies + 10 * HZ;
+	schedule_work(&rzs->compact_work);
+}
+
+static void ramzswap_writeback_endio(struct bio *bio, int err)
+{
+	struct rzs_writeback *wb = bio->bi_private;
+	struct ramzswap *rzs = wb->rzs;
+	unsigned long flags;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	wb->error = err;
+
+	spin_lock_irqsave(&rzs->wb_lock, flags);
+	list_add_tail(&wb->list, &rzs->wb_done);
+	spin_unlock_irqrestore(&rzs->wb_lock, flags);
+
+	schedule_work(&rzs->wb_done_work);
+}
+
+static struct rzs_writeback *ramzswap_writeback_alloc(struct ramzswap *rzs)
+{
+	struct rzs_writeback *wb;
+
+	wb = kmalloc(sizeof(*wb), GFP_NOIO);
+	if (!wb)
+		return NULL;
+
+	wb->rzs = rzs;
+	wb->page = alloc_page(GFP_NOIO | __GFP_HIGHMEM | __GFP_NOWARN);
+	wb->bio = bio_alloc(GFP_NOIO, 1);
+	if (!wb->page || !wb->bio) {
+		if (wb->page)
+			__free_page(wb->page);
+		if (wb->bio)
+			bio_put(wb->bio);
+		kfree(wb);
+		return NULL;
+	}
+
+	return wb;
+}
+
+static void ramzswap_writeback_free(struct rzs_writeback *wb)
+{
+	bio_put(wb->bio);
+	__free_page(wb->page);
+	kfree(wb);
+}
+
+/*
+ * Copy the data of slot index into wb->page and set up its bio.
+ * Caller holds rzs->lock, so the slot can't be rewritten or compacted;
+ * obj_lock keeps it from being freed under us. The slot stays marked in
+ * wb_busy until the bio has completed and been handled, so its sector
+ * on the backing swap is not written again in the meantime.
+ */
+static int ramzswap_writeback_fill(struct ramzswap *rzs, u32 index,
+			struct rzs_writeback *wb)
+{
+	int ret = LZO_E_OK;
+	u32 size, offset;
+	size_t clen = PAGE_SIZE;
+	struct table *t = &rzs->table[index];
+	struct bio *bio = wb->bio;
+	struct page *obj_page;
+	unsigned char *user_mem, *cmem;
+
+	spin_lock(&rzs->obj_lock);
+
+	/* It may be gone by now */
+	if (!t->page || (t->flags & RZS_WRITEBACK_SKIP)) {
+		spin_unlock(&rzs->obj_lock);
+		return -ENOENT;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		obj_page = t->dedup->page;
+		offset = t->dedup->offset;
+	} else {
+		obj_page = t->page;
+		offset = t->offset;
+	}
+
+	user_mem = kmap_atomic(wb->page, KM_USER0);
+	cmem = kmap_atomic(obj_page, KM_USER1) + offset;
+
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		memcpy(user_mem, cmem, PAGE_SIZE);
+	} else {
+		size = xv_get_object_size(cmem);
+		ret = lzo1x_decompress_safe(cmem + sizeof(struct zobj_header),
+				size - sizeof(struct zobj_header),
+				user_mem, &clen);
+	}
+
+	kunmap_atomic(user_mem, KM_USER0);
+	kunmap_atomic(cmem, KM_USER1);
+
+	if (unlikely(ret != LZO_E_OK)) {
+		spin_unlock(&rzs->obj_lock);
+		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
+		return -EIO;
+	}
+
+	rzs_set_flag(rzs, index, RZS_WRITEBACK);
+	spin_unlock(&rzs->obj_lock);
+
+	set_bit(index, rzs->wb_busy);
+	wb->index = index;
+	bio->bi_bdev = rzs->backing_swap;
+	bio->bi_sector = (sector_t)index << SECTORS_PER_PAGE_SHIFT;
+	bio_add_page(bio, wb->page, PAGE_SIZE, 0);
+	bio->bi_end_io = ramzswap_writeback_endio;
+	bio->bi_private = wb;
+
+	atomic_inc(&rzs->wb_inflight);
+	return 0;
+}
+
+/*
+ * The copy of slot wb->index is on the backing swap; take the one in
+ * memory out of the table unless the slot was freed while the write was
+ * in flight. Lockless readers may still be decompressing it, so what is
+ * to be freed is left in wb for ramzswap_writeback_release to free after
+ * a grace period. A shared object only loses this slot's reference.
+ */
+static void ramzswap_writeback_done(struct ramzswap *rzs,
+			struct rzs_writeback *wb)
+{
+	u32 index = wb->index;
+	struct table *t = &rzs->table[index];
+	struct rzs_dedup *d = NULL;
+	u32 clen;
+	void *obj;
+
+	wb->free_dedup = NULL;
+	wb->free_page = NULL;
+	wb->free_uncompressed = 0;
+	spin_lock(&rzs->obj_lock);
+
+	if (!rzs_test_flag(rzs, index, RZS_WRITEBACK))
+		goto out;
+	rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+
+	if (wb->error) {
+		rzs_stat64_inc(rzs, &rzs->stats.writeback_failed);
+		goto out;
+	}
+
+	if (rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
+		clen = PAGE_SIZE;
+		wb->free_page = t->page;
+		wb->free_uncompressed = 1;
+	} else if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		d = t->dedup;
+		clen = d->clen;
+	} else {
+		obj = kmap_atomic(t->page, KM_USER0) + t->offset;
+		clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
+		kunmap_atomic(obj, KM_USER0);
+		wb->free_page = t->page;
+		wb->free_offset = t->offset;
+	}
+
+	/*
+	 * Readers that find no page go to the backing swap, so the flag
+	 * must be visible first, and the pointer must be gone before the
+	 * flags that say what it points to. Those still decompressing the
+	 * old copy retry through migrate_seq.
+	 */
+	write_seqcount_begin(&rzs->migrate_seq);
+	rzs_set_flag(rzs, index, RZS_BACKED);
+	smp_wmb();
+	t->page = NULL;
+	t->offset = 0;
+	smp_wmb();
+	rzs_clear_flag(rzs, index, RZS_DEDUP);
+	rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
+	write_seqcount_end(&rzs->migrate_seq);
+
+	if (d) {
+		if (rzs_dedup_unref(rzs, d))
+			wb->free_dedup = d;
+	} else if (wb->free_uncompressed) {
+		rzs->stats.compr_size -= clen;
+		rzs_stat_dec(&rzs->stats.pages_expand);
+	} else {
+		rzs->stats.pool_data -= clen + sizeof(struct zobj_header);
+		rzs->stats.compr_size -= clen;
+	}
+	if (clen <= PAGE_SIZE / 2)
+		rzs_stat_dec(&rzs->stats.good_compress);
+	rzs_stat_dec(&rzs->stats.pages_stored);
+	rzs_stat_inc(&rzs->stats.pages_backed);
+	rzs_stat64_inc(rzs, &rzs->stats.writeback_pages);
+
+out:
+	spin_unlock(&rzs->obj_lock);
+}
+
+/* Free what ramzswap_writeback_done dropped. Caller holds obj_lock. */
+static void ramzswap_writeback_release(struct ramzswap *rzs,
+			struct rzs_writeback *wb)
+{
+	if (wb->free_dedup)
+		rzs_dedup_free(rzs, wb->free_dedup);
+	else if (wb->free_uncompressed)
+		__free_page(wb->free_page);
+	else if (wb->free_page)
+		xv_free(rzs->mem_pool, wb->free_page, wb->free_offset);
+}
+
+static void ramzswap_wb_done_work(struct work_struct *work)
+{
+	struct ramzswap *rzs = container_of(work, struct ramzswap,
+					    wb_done_work);
+	struct rzs_writeback *wb, *tmp;
+	LIST_HEAD(done);
+	int dropped = 0;
+
+	spin_lock_irq(&rzs->wb_lock);
+	list_splice_init(&rzs->wb_done, &done);
+	spin_unlock_irq(&rzs->wb_lock);
+
+	/*
+	 * rzs->lock keeps compaction from moving the dropped objects until
+	 * they are freed; they are no longer in the table for it to fix up.
+	 */
+	mutex_lock(&rzs->lock);
+	list_for_each_entry(wb, &done, list) {
+		ramzswap_writeback_done(rzs, wb);
+		if (wb->free_page || wb->free_dedup)
+			dropped = 1;
+	}
+	if (dropped) {
+		synchronize_rcu();
+		spin_lock(&rzs->obj_lock);
+		list_for_each_entry(wb, &done, list)
+			ramzswap_writeback_release(rzs, wb);
+		spin_unlock(&rzs->obj_lock);
+	}
+	mutex_unlock(&rzs->lock);
+
+	list_for_each_entry_safe(wb, tmp, &done, list) {
+		/*
+		 * Only now, so a newer writeback of the slot can't set
+		 * RZS_WRITEBACK and be mistaken for this one above.
+		 */
+		clear_bit(wb->index, rzs->wb_busy);
+		ramzswap_writeback_free(wb);
+		atomic_dec(&rzs->wb_inflight);
+		wake_up(&rzs->wb_wait);
+	}
+}
+
+/*
+ * Age every compressed slot and write the ones that have not been read
+ * for writeback_age scans to the backing swap, RZS_WRITEBACK_BATCH bios
+ * at a time. rzs->lock is dropped between batches so swap-out isn't held
+ * up for a whole scan.
+ */
+static void ramzswap_writeback_work(struct work_struct *work)
+{
+	struct ramzswap *rzs = container_of(to_delayed_work(work),
+					    struct ramzswap, wb_work);
+	struct rzs_writeback *batch[RZS_WRITEBACK_BATCH];
+	struct rzs_writeback *wb = NULL;
+	unsigned int age = min(writeback_age, 255u);
+	unsigned int i, nr, scanned, written = 0;
+	int need_wb;
+	size_t index = 1;
+
+	do {
+		/* Let the previous batch drain before queueing another */
+		wait_event(rzs->wb_wait, atomic_read(&rzs->wb_inflight) <
+					 RZS_WRITEBACK_BATCH);
+
+		nr = 0;
+		need_wb = 0;
+		mutex_lock(&rzs->lock);
+		if (!rzs->init_done) {
+			mutex_unlock(&rzs->lock);
+			break;
+		}
+
+		for (scanned = 0; index < rzs->backing_pages &&
+		     scanned < RZS_WRITEBACK_SCAN &&
+		     nr < RZS_WRITEBACK_BATCH; index++, scanned++) {
+			struct table *t = &rzs->table[index];
+
+			if (!t->page || (t->flags & RZS_WRITEBACK_SKIP) ||
+			    test_bit(index, rzs->wb_busy))
+				continue;
+			if (t->age < age) {
+				t->age++;
+				continue;
+			}
+			if (written + nr >= writeback_max_pages)
+				continue;
+
+			/* Allocate outside the lock and come back to it */
+			if (!wb) {
+				need_wb = 1;
+				break;
+			}
+			if (ramzswap_writeback_fill(rzs, index, wb))
+				continue;
+			batch[nr++] = wb;
+			wb = NULL;
+		}
+		mutex_unlock(&rzs->lock);
+
+		for (i = 0; i < nr; i++)
+			submit_bio(WRITE, batch[i]->bio);
+		written += nr;
+
+		if (need_wb) {
+			wb = ramzswap_writeback_alloc(rzs);
+			if (!wb)
+				written = writeback_max_pages;
+		}
+		cond_resched();
+	} while (index < rzs->backing_pages);
+
+	if (wb)
+		ramzswap_writeback_free(wb);
+
+	if (rzs->init_done && writeback_interval)
+		schedule_delayed_work(&rzs->wb_work, writeback_interval * HZ);
+}
+
+/*
+ * Open the device named by RZSIO_SET_BACKING_SWAP. Without a disksize
+ * the ramzswap device takes the size of the backing one.
+ */
+static int setup_backing_swap(struct ramzswap *rzs)
+{
+	struct block_device *bdev;
+	u64 size;
+
+	bdev = open_bdev_exclusive(rzs->backing_swap_name,
+				   FMODE_READ | FMODE_WRITE, rzs);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device: %s\n",
+			rzs->backing_swap_name);
+		return PTR_ERR(bdev);
+	}
+
+	if (bdev->bd_disk->fops == &ramzswap_devops) {
+		pr_err("Backing device cannot be a ramzswap device\n");
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -EINVAL;
+	}
+
+	size = min_t(u64, i_size_read(bdev->bd_inode), ULONG_MAX) & PAGE_MASK;
+	if (!size) {
+		pr_err("Backing device %s is empty\n", rzs->backing_swap_name);
+		close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+		return -EINVAL;
+	}
+
+	if (!rzs->disksize)
+		rzs->disksize = size;
+	rzs->backing_pages = size >> PAGE_SHIFT;
+	rzs->backing_swap = bdev;
+
+	pr_info("Using backing swap device: %s, %llu kB\n",
+		rzs->backing_swap_name, size >> 10);
+	return 0;
+}
+
 static void ramzswap_set_disksize(struct ramzswap *rzs, size_t totalram_bytes)
 {
 	if (!rzs->disksize) {
@@ -116,8 +700,10 @@ static void setup_swap_header(struct ramzswap *rzs, union swap_header *s)
 }
 
 static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
-			struct ramzswap_ioctl_stats *s)
+			struct ramzswap_ioctl_stats_ext *x)
 {
+	struct ramzswap_ioctl_stats *s = &x->base;
+
 	s->disksize = rzs->disksize;
 
 #if defined(CONFIG_RAMZSWAP_STATS)
@@ -154,43 +740,115 @@ static void ramzswap_ioctl_get_stats(struct ramzswap *rzs,
 	s->orig_data_size = rs->pages_stored << PAGE_SHIFT;
 	s->compr_data_size = rs->compr_size;
 	s->mem_used_total = mem_used;
+
+	x->write_ns = rzs_stat64_read(rzs, &rs->write_ns);
+	x->read_ns = rzs_stat64_read(rzs, &rs->read_ns);
+	x->read_ns_max = rzs_stat64_read(rzs, &rs->read_ns_max);
+
+	x->pages_same = rs->pages_same;
+	x->pages_dedup = rs->pages_dedup;
+	x->dedup_hits = rzs_stat64_read(rzs, &rs->dedup_hits);
+	x->dedup_saved = rzs_stat64_read(rzs, &rs->dedup_saved);
+	x->compactions = rzs_stat64_read(rzs, &rs->compactions);
+	x->compact_pages_freed = rzs_stat64_read(rzs,
+					&rs->compact_pages_freed);
+	x->compact_objs_moved = rzs_stat64_read(rzs,
+					&rs->compact_objs_moved);
+
+	x->pages_backed = rs->pages_backed;
+	x->backing_writes = rzs_stat64_read(rzs, &rs->backing_writes);
+	x->backing_reads = rzs_stat64_read(rzs, &rs->backing_reads);
+	x->writeback_pages = rzs_stat64_read(rzs, &rs->writeback_pages);
+	x->writeback_failed = rzs_stat64_read(rzs, &rs->writeback_failed);
 	}
 #endif /* CONFIG_RAMZSWAP_STATS */
 }
 
 static void ramzswap_free_page(struct ramzswap *rzs, size_t index)
 {
-	u32 clen;
+	u32 clen, offset;
 	void *obj;
 
 	struct page *page = rzs->table[index].page;
-	u32 offset = rzs->table[index].offset;
+
+	/*
+	 * No memory is allocated for same filled pages.
+	 * Simply clear the flag.
+	 */
+	if (rzs_test_flag(rzs, index, RZS_SAME)) {
+		rzs_clear_flag(rzs, index, RZS_SAME);
+		rzs_stat_dec(&rzs->stats.pages_same);
+		rzs->table[index].element = 0;
+		return;
+	}
 
 	if (unlikely(!page)) {
-		/*
-		 * No memory is allocated for zero filled pages.
-		 * Simply clear zero page flag.
-		 */
 		if (rzs_test_flag(rzs, index, RZS_ZERO)) {
 			rzs_clear_flag(rzs, index, RZS_ZERO);
 			rzs_stat_dec(&rzs->stats.pages_zero);
+			return;
+		}
+
+		/* Nothing to free on the backing swap either */
+		spin_lock(&rzs->obj_lock);
+		if (rzs_test_flag(rzs, index, RZS_BACKED)) {
+			rzs_clear_flag(rzs, index, RZS_BACKED);
+			rzs_stat_dec(&rzs->stats.pages_backed);
 		}
+		spin_unlock(&rzs->obj_lock);
+		return;
+	}
+
+	/*
+	 * Compaction may be moving the object, and writeback copying it;
+	 * both hold obj_lock to do so.
+	 */
+	spin_lock(&rzs->obj_lock);
+
+	/* Writeback completed after we looked at the page */
+	if (unlikely(rzs_test_flag(rzs, index, RZS_BACKED))) {
+		rzs_clear_flag(rzs, index, RZS_BACKED);
+		rzs_stat_dec(&rzs->stats.pages_backed);
+		spin_unlock(&rzs->obj_lock);
 		return;
 	}
 
+	/* Any writeback in flight finds the flag gone and drops its copy */
+	rzs_clear_flag(rzs, index, RZS_WRITEBACK);
+
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
 		__free_page(page);
 		rzs_clear_flag(rzs, index, RZS_UNCOMPRESSED);
 		rzs_stat_dec(&rzs->stats.pages_expand);
+		spin_unlock(&rzs->obj_lock);
 		goto out;
 	}
 
+	if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+		struct rzs_dedup *d = rzs->table[index].dedup;
+
+		if (d->clen <= PAGE_SIZE / 2)
+			rzs_stat_dec(&rzs->stats.good_compress);
+		rzs_dedup_put(rzs, d);
+		rzs_clear_flag(rzs, index, RZS_DEDUP);
+		rzs_stat_dec(&rzs->stats.pages_stored);
+		rzs->table[index].dedup = NULL;
+		spin_unlock(&rzs->obj_lock);
+		return;
+	}
+
+	page = rzs->table[index].page;
+	offset = rzs->table[index].offset;
+
 	obj = kmap_atomic(page, KM_USER0) + offset;
 	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
 	kunmap_atomic(obj, KM_USER0);
 
 	xv_free(rzs->mem_pool, page, offset);
+	spin_unlock(&rzs->obj_lock);
+
+	rzs->stats.pool_data -= clen + sizeof(struct zobj_header);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_dec(&rzs->stats.good_compress);
 
@@ -218,22 +876,55 @@ static int handle_zero_page(struct bio *bio)
 	return 0;
 }
 
+static int handle_same_page(struct ramzswap *rzs, struct bio *bio)
+{
+	u32 index, pos;
+	unsigned long *user_mem, element;
+	struct page *page = bio->bi_io_vec[0].bv_page;
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	element = rzs->table[index].element;
+
+	user_mem = kmap_atomic(page, KM_USER0);
+	for (pos = 0; pos != PAGE_SIZE / sizeof(*user_mem); pos++)
+		user_mem[pos] = element;
+	kunmap_atomic(user_mem, KM_USER0);
+
+	flush_dcache_page(page);
+
+	set_bit(BIO_UPTODATE, &bio->bi_flags);
+	bio_endio(bio, 0);
+	return 0;
+}
+
+/*
+ * Returns -ENOENT if the page was written back since the caller looked;
+ * the page is only freed after a grace period, so a copy begun before
+ * that is still good.
+ */
 static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
 {
 	u32 index;
-	struct page *page;
+	struct page *page, *obj_page;
 	unsigned char *user_mem, *cmem;
 
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	rcu_read_lock();
+	obj_page = ACCESS_ONCE(rzs->table[index].page);
+	if (unlikely(!obj_page)) {
+		rcu_read_unlock();
+		return -ENOENT;
+	}
+
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+	cmem = kmap_atomic(obj_page, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
 	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
+	rcu_read_unlock();
 
 	flush_dcache_page(page);
 
@@ -242,6 +933,16 @@ static int handle_uncompressed_page(struct ramzswap *rzs, struct bio *bio)
 	return 0;
 }
 
+/*
+ * Point the bio at the same offset on the backing swap; a non-zero
+ * return has generic_make_request() resubmit it there.
+ */
+static int ramzswap_remap_backing(struct ramzswap *rzs, struct bio *bio)
+{
+	bio->bi_bdev = rzs->backing_swap;
+	return 1;
+}
+
 /*
  * Called when request page is not present in ramzswap.
  * This is an attempt to read before any previous write
@@ -264,10 +965,12 @@ static int handle_ramzswap_fault(struct ramzswap *rzs, struct bio *bio)
 static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 {
 	int ret;
-	u32 index;
+	u32 index, offset, size;
+	unsigned seq;
 	size_t clen;
-	struct page *page;
+	struct page *page, *obj_page;
 	struct zobj_header *zheader;
+	struct rzs_dedup *d;
 	unsigned char *user_mem, *cmem;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_reads);
@@ -275,30 +978,76 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
+	/* Recently used; keep it out of the next writeback */
+	rzs->table[index].age = 0;
+
 	if (rzs_test_flag(rzs, index, RZS_ZERO))
 		return handle_zero_page(bio);
 
+	if (rzs_test_flag(rzs, index, RZS_SAME))
+		return handle_same_page(rzs, bio);
+
 	/* Requested page is not present in compressed area */
-	if (!rzs->table[index].page)
+	if (!rzs->table[index].page) {
+		smp_rmb();
+		if (rzs_test_flag(rzs, index, RZS_BACKED))
+			goto backed;
 		return handle_ramzswap_fault(rzs, bio);
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
-	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-		return handle_uncompressed_page(rzs, bio);
+	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED))) {
+		if (!handle_uncompressed_page(rzs, bio))
+			return 0;
+		smp_rmb();
+		goto backed;
+	}
 
-	user_mem = kmap_atomic(page, KM_USER0);
-	clen = PAGE_SIZE;
+	/*
+	 * Compaction may move the object while we decompress it. The old
+	 * page is not freed before rcu_read_unlock, so the old copy stays
+	 * readable, but if migrate_seq changed the output may be garbage
+	 * and we go again.
+	 */
+	rcu_read_lock();
+	do {
+		seq = read_seqcount_begin(&rzs->migrate_seq);
+		if (rzs_test_flag(rzs, index, RZS_DEDUP)) {
+			/* Writeback clears the pointer before the flag */
+			smp_rmb();
+			d = ACCESS_ONCE(rzs->table[index].dedup);
+			obj_page = d ? d->page : NULL;
+			offset = d ? d->offset : 0;
+		} else {
+			obj_page = rzs->table[index].page;
+			offset = rzs->table[index].offset;
+		}
 
-	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
-			rzs->table[index].offset;
+		/* Written back since we looked */
+		if (unlikely(!obj_page))
+			break;
 
-	ret = lzo1x_decompress_safe(
-		cmem + sizeof(*zheader),
-		xv_get_object_size(cmem) - sizeof(*zheader),
-		user_mem, &clen);
+		user_mem = kmap_atomic(page, KM_USER0);
+		clen = PAGE_SIZE;
 
-	kunmap_atomic(user_mem, KM_USER0);
-	kunmap_atomic(cmem, KM_USER1);
+		cmem = kmap_atomic(obj_page, KM_USER1) + offset;
+
+		size = clamp_t(u32, xv_get_object_size(cmem),
+				sizeof(*zheader), PAGE_SIZE - offset);
+		ret = lzo1x_decompress_safe(
+			cmem + sizeof(*zheader),
+			size - sizeof(*zheader),
+			user_mem, &clen);
+
+		kunmap_atomic(user_mem, KM_USER0);
+		kunmap_atomic(cmem, KM_USER1);
+	} while (read_seqcount_retry(&rzs->migrate_seq, seq));
+	rcu_read_unlock();
+
+	if (unlikely(!obj_page)) {
+		smp_rmb();
+		goto backed;
+	}
 
 	/* should NEVER happen */
 	if (unlikely(ret != LZO_E_OK)) {
@@ -314,6 +1063,10 @@ static int ramzswap_read(struct ramzswap *rzs, struct bio *bio)
 	bio_endio(bio, 0);
 	return 0;
 
+backed:
+	rzs_stat64_inc(rzs, &rzs->stats.backing_reads);
+	return ramzswap_remap_backing(rzs, bio);
+
 out:
 	bio_io_error(bio);
 	return 0;
@@ -321,11 +1074,14 @@ out:
 
 static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 {
-	int ret;
-	u32 offset, index;
+	int ret, share = 0;
+	u32 offset, index, hash = 0;
 	size_t clen;
+	unsigned long element;
 	struct zobj_header *zheader;
 	struct page *page, *page_store;
+	struct ramzswap_stream *stream;
+	struct rzs_dedup *d;
 	unsigned char *user_mem, *cmem, *src;
 
 	rzs_stat64_inc(rzs, &rzs->stats.num_writes);
@@ -333,44 +1089,90 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 	page = bio->bi_io_vec[0].bv_page;
 	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
 
-	src = rzs->compress_buffer;
-
-	mutex_lock(&rzs->lock);
-
 	user_mem = kmap_atomic(page, KM_USER0);
-	if (page_zero_filled(user_mem)) {
+	if (page_same_filled(user_mem, &element)) {
 		kunmap_atomic(user_mem, KM_USER0);
+		mutex_lock(&rzs->lock);
+		if (!element) {
+			rzs_stat_inc(&rzs->stats.pages_zero);
+			rzs_set_flag(rzs, index, RZS_ZERO);
+		} else {
+			rzs_stat_inc(&rzs->stats.pages_same);
+			rzs_set_flag(rzs, index, RZS_SAME);
+			rzs->table[index].element = element;
+		}
 		mutex_unlock(&rzs->lock);
-		rzs_stat_inc(&rzs->stats.pages_zero);
-		rzs_set_flag(rzs, index, RZS_ZERO);
 
 		set_bit(BIO_UPTODATE, &bio->bi_flags);
 		bio_endio(bio, 0);
 		return 0;
 	}
+	kunmap_atomic(user_mem, KM_USER0);
 
-	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-				rzs->compress_workmem);
+	/*
+	 * Compress with this CPU's stream, outside rzs->lock; the device
+	 * lock is only needed to allocate and store the result.
+	 */
+	stream = per_cpu_ptr(rzs->streams, raw_smp_processor_id());
+	mutex_lock(&stream->lock);
+	src = stream->buffer;
 
+	user_mem = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
+				stream->workmem);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	if (unlikely(ret != LZO_E_OK)) {
-		mutex_unlock(&rzs->lock);
+		mutex_unlock(&stream->lock);
 		pr_err("Compression failed! err=%d\n", ret);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
 		goto out;
 	}
 
+	mutex_lock(&rzs->lock);
+
+	/* Share an identical object if one is already stored */
+	if (dedup && rzs->dedup_hash && clen <= max_zpage_size) {
+		share = 1;
+		hash = jhash(src, clen, 0);
+		d = rzs_dedup_get(rzs, hash, src, clen);
+		if (d) {
+			rzs->table[index].dedup = d;
+			rzs_set_flag(rzs, index, RZS_DEDUP);
+			rzs_stat_inc(&rzs->stats.pages_dedup);
+			rzs_stat64_inc(rzs, &rzs->stats.dedup_hits);
+			rzs_stat64_add(rzs, &rzs->stats.dedup_saved, clen);
+			goto stored;
+		}
+	}
+
 	/*
-	 * Page is incompressible. Store it as-is (uncompressed)
-	 * since we do not want to return too many swap write
-	 * errors which has side effect of hanging the system.
+	 * Page is incompressible. Send it to the backing swap if there
+	 * is one; otherwise store it as-is (uncompressed) since we do
+	 * not want to return too many swap write errors which has side
+	 * effect of hanging the system. The same goes while a writeback
+	 * of the slot's old contents is still headed for that sector, as
+	 * it could land after this write.
 	 */
+	if (unlikely(clen > max_zpage_size) && index < rzs->backing_pages &&
+	    !test_bit(index, rzs->wb_busy)) {
+		if (!rzs_test_flag(rzs, index, RZS_BACKED)) {
+			rzs_set_flag(rzs, index, RZS_BACKED);
+			rzs_stat_inc(&rzs->stats.pages_backed);
+		}
+		mutex_unlock(&rzs->lock);
+		mutex_unlock(&stream->lock);
+
+		rzs_stat64_inc(rzs, &rzs->stats.backing_writes);
+		return ramzswap_remap_backing(rzs, bio);
+	}
+
 	if (unlikely(clen > max_zpage_size)) {
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
 			mutex_unlock(&rzs->lock);
+			mutex_unlock(&stream->lock);
 			pr_info("Error allocating memory for incompressible "
 				"page: %u\n", index);
 			rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -389,6 +1191,7 @@ static int ramzswap_write(struct ramzswap *rzs, struct bio *bio)
 			&rzs->table[index].page, &offset,
 			GFP_NOIO | __GFP_HIGHMEM)) {
 		mutex_unlock(&rzs->lock);
+		mutex_unlock(&stream->lock);
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		rzs_stat64_inc(rzs, &rzs->stats.failed_writes);
@@ -401,14 +1204,13 @@ memstore:
 	cmem = kmap_atomic(rzs->table[index].page, KM_USER1) +
 			rzs->table[index].offset;
 
-#if 0
 	/* Back-reference needed for memory defragmentation */
 	if (!rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)) {
 		zheader = (struct zobj_header *)cmem;
 		zheader->table_idx = index;
 		cmem += sizeof(*zheader);
+		rzs->stats.pool_data += clen + sizeof(*zheader);
 	}
-#endif
 
 	memcpy(cmem, src, clen);
 
@@ -416,13 +1218,40 @@ memstore:
 	if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
 		kunmap_atomic(src, KM_USER0);
 
-	/* Update stats */
+	/*
+	 * Make the object findable by later identical pages. If the entry
+	 * can't be allocated the object is simply not shared.
+	 */
+	d = share ? kmem_cache_alloc(rzs_dedup_cachep, GFP_NOIO) : NULL;
+	if (d) {
+		d->page = rzs->table[index].page;
+		d->offset = offset;
+		d->clen = clen;
+		d->hash = hash;
+		d->refcount = 1;
+
+		spin_lock(&rzs->obj_lock);
+		hlist_add_head(&d->node, &rzs->dedup_hash[hash &
+				((1 << RZS_DEDUP_HASH_BITS) - 1)]);
+		spin_unlock(&rzs->obj_lock);
+
+		rzs->table[index].dedup = d;
+		rzs->table[index].offset = 0;
+		rzs_set_flag(rzs, index, RZS_DEDUP);
+	}
+
 	rzs->stats.compr_size += clen;
+
+stored:
+	rzs->table[index].age = 0;
+
+	/* Update stats */
 	rzs_stat_inc(&rzs->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		rzs_stat_inc(&rzs->stats.good_compress);
 
 	mutex_unlock(&rzs->lock);
+	mutex_unlock(&stream->lock);
 
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
@@ -452,6 +1281,26 @@ static inline int valid_swap_request(struct ramzswap *rzs, struct bio *bio)
 	return 1;
 }
 
+#if defined(CONFIG_RAMZSWAP_STATS)
+static void ramzswap_account_io(struct ramzswap *rzs, int rw, ktime_t start)
+{
+	struct ramzswap_stats *rs = &rzs->stats;
+	u64 delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&rzs->stat64_lock);
+	if (rw == WRITE) {
+		rs->write_ns += delta;
+	} else {
+		rs->read_ns += delta;
+		if (delta > rs->read_ns_max)
+			rs->read_ns_max = delta;
+	}
+	spin_unlock(&rzs->stat64_lock);
+}
+#else
+#define ramzswap_account_io(r, rw, s)
+#endif
+
 /*
  * Handler function for all ramzswap I/O requests.
  */
@@ -459,6 +1308,7 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 {
 	int ret = 0;
 	struct ramzswap *rzs = queue->queuedata;
+	ktime_t start;
 
 	if (unlikely(!rzs->init_done)) {
 		bio_io_error(bio);
@@ -471,13 +1321,16 @@ static int ramzswap_make_request(struct request_queue *queue, struct bio *bio)
 		return 0;
 	}
 
+	start = ktime_get();
 	switch (bio_data_dir(bio)) {
 	case READ:
 		ret = ramzswap_read(rzs, bio);
+		ramzswap_account_io(rzs, READ, start);
 		break;
 
 	case WRITE:
 		ret = ramzswap_write(rzs, bio);
+		ramzswap_account_io(rzs, WRITE, start);
 		break;
 	}
 
@@ -491,36 +1344,53 @@ static void reset_device(struct ramzswap *rzs)
 	/* Do not accept any new I/O request */
 	rzs->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(rzs->compress_workmem);
-	free_pages((unsigned long)rzs->compress_buffer, 1);
-
-	rzs->compress_workmem = NULL;
-	rzs->compress_buffer = NULL;
+	cancel_work_sync(&rzs->compact_work);
 
-	/* Free all pages that are still in this ramzswap device */
-	for (index = 0; index < rzs->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
+	/* Let writeback finish with the table before it goes away */
+	cancel_delayed_work_sync(&rzs->wb_work);
+	wait_event(rzs->wb_wait, !atomic_read(&rzs->wb_inflight));
+	cancel_work_sync(&rzs->wb_done_work);
 
-		page = rzs->table[index].page;
-		offset = rzs->table[index].offset;
+	/* Free various per-device buffers */
+	if (rzs->streams) {
+		int cpu;
 
-		if (!page)
-			continue;
+		for_each_possible_cpu(cpu) {
+			struct ramzswap_stream *stream;
 
-		if (unlikely(rzs_test_flag(rzs, index, RZS_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(rzs->mem_pool, page, offset);
+			stream = per_cpu_ptr(rzs->streams, cpu);
+			kfree(stream->workmem);
+			free_pages((unsigned long)stream->buffer, 1);
+		}
+		free_percpu(rzs->streams);
+		rzs->streams = NULL;
 	}
 
+	/* Free all pages that are still in this ramzswap device */
+	for (index = 0; rzs->table && index < rzs->disksize >> PAGE_SHIFT;
+	     index++)
+		ramzswap_free_page(rzs, index);
+
 	vfree(rzs->table);
 	rzs->table = NULL;
 
+	vfree(rzs->dedup_hash);
+	rzs->dedup_hash = NULL;
+
+	vfree(rzs->wb_busy);
+	rzs->wb_busy = NULL;
+
 	xv_destroy_pool(rzs->mem_pool);
 	rzs->mem_pool = NULL;
 
+	if (rzs->backing_swap) {
+		close_bdev_exclusive(rzs->backing_swap,
+				     FMODE_READ | FMODE_WRITE);
+		rzs->backing_swap = NULL;
+	}
+	rzs->backing_pages = 0;
+	rzs->backing_swap_name[0] = '\0';
+
 	/* Reset stats */
 	memset(&rzs->stats, 0, sizeof(rzs->stats));
 
@@ -529,8 +1399,8 @@ static void reset_device(struct ramzswap *rzs)
 
 static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 {
-	int ret;
-	size_t num_pages;
+	int ret, cpu;
+	size_t num_pages, index;
 	struct page *page;
 	union swap_header *swap_header;
 
@@ -539,20 +1409,38 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 		return -EBUSY;
 	}
 
+	if (rzs->backing_swap_name[0]) {
+		ret = setup_backing_swap(rzs);
+		if (ret)
+			goto fail;
+	}
+
 	ramzswap_set_disksize(rzs, totalram_pages << PAGE_SHIFT);
 
-	rzs->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!rzs->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
+	rzs->streams = alloc_percpu(struct ramzswap_stream);
+	if (!rzs->streams) {
+		pr_err("Error allocating compression streams!\n");
 		ret = -ENOMEM;
 		goto fail;
 	}
 
-	rzs->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!rzs->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
-		goto fail;
+	for_each_possible_cpu(cpu) {
+		struct ramzswap_stream *stream = per_cpu_ptr(rzs->streams, cpu);
+
+		mutex_init(&stream->lock);
+		stream->workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
+		if (!stream->workmem) {
+			pr_err("Error allocating compressor working memory!\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+
+		stream->buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
+		if (!stream->buffer) {
+			pr_err("Error allocating compressor buffer space\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
 	}
 
 	num_pages = rzs->disksize >> PAGE_SHIFT;
@@ -566,6 +1454,34 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 	}
 	memset(rzs->table, 0, num_pages * sizeof(*rzs->table));
 
+	if (rzs->backing_pages > num_pages)
+		rzs->backing_pages = num_pages;
+
+	if (rzs->backing_pages) {
+		size_t size = BITS_TO_LONGS(rzs->backing_pages) *
+			      sizeof(unsigned long);
+
+		rzs->wb_busy = vmalloc(size);
+		if (!rzs->wb_busy) {
+			pr_err("Error allocating writeback bitmap\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+		memset(rzs->wb_busy, 0, size);
+	}
+
+	if (dedup) {
+		rzs->dedup_hash = vmalloc(sizeof(*rzs->dedup_hash) <<
+					  RZS_DEDUP_HASH_BITS);
+		if (!rzs->dedup_hash) {
+			pr_err("Error allocating dedup hash table\n");
+			ret = -ENOMEM;
+			goto fail;
+		}
+		for (index = 0; index < 1 << RZS_DEDUP_HASH_BITS; index++)
+			INIT_HLIST_HEAD(&rzs->dedup_hash[index]);
+	}
+
 	page = alloc_page(__GFP_ZERO);
 	if (!page) {
 		pr_err("Error allocating swap header page\n");
@@ -593,6 +1509,9 @@ static int ramzswap_ioctl_init_device(struct ramzswap *rzs)
 
 	rzs->init_done = 1;
 
+	if (rzs->backing_swap && writeback_interval)
+		schedule_delayed_work(&rzs->wb_work, writeback_interval * HZ);
+
 	pr_debug("Initialization done!\n");
 	return 0;
 
@@ -634,9 +1553,24 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		pr_info("Disk size set to %zu kB\n", disksize_kb);
 		break;
 
+	case RZSIO_SET_BACKING_SWAP:
+		if (rzs->init_done) {
+			ret = -EBUSY;
+			goto out;
+		}
+		if (copy_from_user(&rzs->backing_swap_name, (void *)arg,
+						_IOC_SIZE(cmd))) {
+			ret = -EFAULT;
+			goto out;
+		}
+		rzs->backing_swap_name[MAX_SWAP_NAME_LEN - 1] = '\0';
+		pr_info("Backing swap set to %s\n", rzs->backing_swap_name);
+		break;
+
 	case RZSIO_GET_STATS:
+	case RZSIO_GET_STATS_EXT:
 	{
-		struct ramzswap_ioctl_stats *stats;
+		struct ramzswap_ioctl_stats_ext *stats;
 		if (!rzs->init_done) {
 			ret = -ENOTTY;
 			goto out;
@@ -647,7 +1581,8 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 			goto out;
 		}
 		ramzswap_ioctl_get_stats(rzs, stats);
-		if (copy_to_user((void *)arg, stats, sizeof(*stats))) {
+		/* the old ioctl gets the base part only */
+		if (copy_to_user((void *)arg, stats, _IOC_SIZE(cmd))) {
 			kfree(stats);
 			ret = -EFAULT;
 			goto out;
@@ -655,6 +1590,54 @@ static int ramzswap_ioctl(struct block_device *bdev, fmode_t mode,
 		kfree(stats);
 		break;
 	}
+	case RZSIO_GET_FRAG:
+	{
+		struct ramzswap_ioctl_frag *frag;
+		struct xv_frag_stats *xs;
+
+		BUILD_BUG_ON(RZS_FRAG_CLASSES != XV_FRAG_CLASSES);
+		BUILD_BUG_ON(RZS_FILL_BUCKETS != XV_FILL_BUCKETS);
+
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		frag = kzalloc(sizeof(*frag), GFP_KERNEL);
+		xs = kmalloc(sizeof(*xs), GFP_KERNEL);
+		if (!frag || !xs) {
+			kfree(frag);
+			kfree(xs);
+			ret = -ENOMEM;
+			goto out;
+		}
+		mutex_lock(&rzs->lock);
+		xv_get_frag_stats(rzs->mem_pool, xs);
+		mutex_unlock(&rzs->lock);
+
+		frag->pages = xs->pages;
+		memcpy(frag->pages_by_fill, xs->pages_by_fill,
+			sizeof(frag->pages_by_fill));
+		memcpy(frag->objs, xs->objs, sizeof(frag->objs));
+		memcpy(frag->obj_bytes, xs->obj_bytes, sizeof(frag->obj_bytes));
+		memcpy(frag->free_blocks, xs->free_blocks,
+			sizeof(frag->free_blocks));
+		memcpy(frag->free_bytes, xs->free_bytes,
+			sizeof(frag->free_bytes));
+		kfree(xs);
+
+		if (copy_to_user((void *)arg, frag, sizeof(*frag)))
+			ret = -EFAULT;
+		kfree(frag);
+		break;
+	}
+	case RZSIO_COMPACT:
+		if (!rzs->init_done) {
+			ret = -ENOTTY;
+			goto out;
+		}
+		ramzswap_compact(rzs);
+		break;
+
 	case RZSIO_INIT:
 		ret = ramzswap_ioctl_init_device(rzs);
 		break;
@@ -689,6 +1672,7 @@ void ramzswap_slot_free_notify(struct block_device *bdev, unsigned long index)
 	rzs = bdev->bd_disk->private_data;
 	ramzswap_free_page(rzs, index);
 	rzs_stat64_inc(rzs, &rzs->stats.notify_free);
+	ramzswap_check_fragmentation(rzs);
 
 	return;
 }
@@ -704,7 +1688,16 @@ static int create_device(struct ramzswap *rzs, int device_id)
 	int ret = 0;
 
 	mutex_init(&rzs->lock);
+	spin_lock_init(&rzs->obj_lock);
 	spin_lock_init(&rzs->stat64_lock);
+	seqcount_init(&rzs->migrate_seq);
+	INIT_WORK(&rzs->compact_work, ramzswap_compact_work);
+	INIT_DELAYED_WORK(&rzs->wb_work, ramzswap_writeback_work);
+	INIT_WORK(&rzs->wb_done_work, ramzswap_wb_done_work);
+	INIT_LIST_HEAD(&rzs->wb_done);
+	spin_lock_init(&rzs->wb_lock);
+	atomic_set(&rzs->wb_inflight, 0);
+	init_waitqueue_head(&rzs->wb_wait);
 
 	rzs->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!rzs->queue) {
@@ -770,11 +1763,17 @@ static int __init ramzswap_init(void)
 		goto out;
 	}
 
+	rzs_dedup_cachep = KMEM_CACHE(rzs_dedup, 0);
+	if (!rzs_dedup_cachep) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
 	ramzswap_major = register_blkdev(0, "ramzswap");
 	if (ramzswap_major <= 0) {
 		pr_warning("Unable to get major number\n");
 		ret = -EBUSY;
-		goto out;
+		goto free_cache;
 	}
 
 	if (!num_devices) {
@@ -803,6 +1802,8 @@ free_devices:
 		destroy_device(&devices[--dev_id]);
 unregister:
 	unregister_blkdev(ramzswap_major, "ramzswap");
+free_cache:
+	kmem_cache_destroy(rzs_dedup_cachep);
 out:
 	return ret;
 }
@@ -823,12 +1824,29 @@ static void __exit ramzswap_exit(void)
 	unregister_blkdev(ramzswap_major, "ramzswap");
 
 	kfree(devices);
+	kmem_cache_destroy(rzs_dedup_cachep);
 	pr_debug("Cleanup done!\n");
 }
 
 module_param(num_devices, uint, 0);
 MODULE_PARM_DESC(num_devices, "Number of ramzswap devices");
 
+module_param(dedup, bool, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(dedup, "Store identical compressed pages only once");
+
+module_param(compact_threshold, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(compact_threshold,
+	"Compact when the pool exceeds its data by this % (0: never)");
+
+module_param(writeback_interval, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(writeback_interval,
+	"Seconds between scans for idle pages to move to the backing swap "
+	"(0: only incompressible pages go there)");
+
+module_param(writeback_age, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(writeback_age,
+	"Scans a page must go unread before it is written back");
+
 module_init(ramzswap_init);
 module_exit(ramzswap_exit);
 
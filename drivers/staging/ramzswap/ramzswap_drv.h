@@ -17,6 +17,9 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #include "ramzswap_ioctl.h"
 #include "xvmalloc.h"
@@ -32,11 +35,10 @@ static const unsigned max_num_devices = 32;
  *
  * It stores back-reference to table entry which points to this
  * object. This is required to support memory defragmentation.
+ * For a shared object it names the slot that first stored it.
  */
 struct zobj_header {
-#if 0
 	u32 table_idx;
-#endif
 };
 
 /*-- Configurable parameters */
@@ -50,6 +52,29 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/* Buckets in the table used to find identical compressed pages */
+#define RZS_DEDUP_HASH_BITS	12
+
+/* Pages at most this % used are emptied by compaction */
+static const unsigned compact_max_fill = 50;
+
+/* Don't compact pools smaller than this many pages on our own */
+static const unsigned compact_min_pages = 64;
+
+/* Compaction drops rzs->lock after looking at this many pages */
+static const unsigned compact_batch_pages = 32;
+
+/* Cold pages written to the backing swap per bio batch and per scan */
+#define RZS_WRITEBACK_BATCH	32
+static const unsigned writeback_max_pages = 1024;
+
+/* Table entries looked at per rzs->lock hold while scanning */
+#define RZS_WRITEBACK_SCAN	1024
+
+/* Slots writeback leaves alone: nothing stored, or already on its way */
+#define RZS_WRITEBACK_SKIP	(BIT(RZS_ZERO) | BIT(RZS_SAME) | \
+				 BIT(RZS_WRITEBACK) | BIT(RZS_BACKED))
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
  *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
@@ -71,19 +96,49 @@ enum rzs_pageflags {
 	/* Page consists entirely of zeros */
 	RZS_ZERO,
 
+	/* Page is one word repeated; table[page_no].element holds it */
+	RZS_SAME,
+
+	/* Object is shared; table[page_no].dedup points to it */
+	RZS_DEDUP,
+
+	/* Page is being copied to the backing swap */
+	RZS_WRITEBACK,
+
+	/* Page lives only on the backing swap, at the same offset */
+	RZS_BACKED,
+
 	__NR_RZS_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
+/*
+ * A compressed object that may be shared by several swap slots holding
+ * identical data. Found through ramzswap->dedup_hash by a hash of the
+ * compressed data, and freed when the last slot drops it.
+ */
+struct rzs_dedup {
+	struct hlist_node node;
+	struct page *page;
+	u32 hash;
+	u32 refcount;
+	u16 offset;
+	u16 clen;
+};
+
 /*
  * Allocated for each swap slot, indexed by page no.
  * These table entries must fit exactly in a page.
  */
 struct table {
-	struct page *page;
+	union {
+		struct page *page;
+		unsigned long element;		/* RZS_SAME */
+		struct rzs_dedup *dedup;	/* RZS_DEDUP */
+	};
 	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
+	u8 age;		/* writeback scans since last access */
 	u8 flags;
 } __attribute__((aligned(4)));
 
@@ -91,6 +146,8 @@ struct ramzswap_stats {
 	/* basic stats */
 	size_t compr_size;	/* compressed size of pages stored -
 				 * needed to enforce memlimit */
+	size_t pool_data;	/* bytes of objects in mem_pool -
+				 * needed to measure fragmentation */
 	/* more stats */
 #if defined(CONFIG_RAMZSWAP_STATS)
 	u64 num_reads;		/* failed + successful */
@@ -100,17 +157,67 @@ struct ramzswap_stats {
 	u64 invalid_io;		/* non-swap I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
 	u32 pages_zero;		/* no. of zero filled pages */
+	u32 pages_same;		/* no. of other same-filled pages */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
+	u64 dedup_hits;		/* writes that found an identical object */
+	u64 dedup_saved;	/* compressed bytes not stored due to dedup */
 	u32 pages_stored;	/* no. of pages currently stored */
 	u32 good_compress;	/* % of pages with compression ratio<=50% */
 	u32 pages_expand;	/* % of incompressible pages */
+	u64 write_ns;		/* time spent serving writes */
+	u64 read_ns;		/* time spent serving reads */
+	u64 read_ns_max;	/* slowest read */
+	u64 compactions;	/* compaction passes run */
+	u64 compact_pages_freed;
+	u64 compact_objs_moved;
+	u32 pages_backed;	/* no. of pages on the backing swap */
+	u64 backing_writes;	/* incompressible writes sent to it */
+	u64 backing_reads;
+	u64 writeback_pages;	/* cold pages moved to it */
+	u64 writeback_failed;
 #endif
 };
 
+/*
+ * Compression state used by one CPU. Writers use the stream of the CPU
+ * they run on, so swap-out on different CPUs compresses in parallel;
+ * the mutex only matters when a writer is preempted and another one
+ * picks the same stream.
+ */
+struct ramzswap_stream {
+	struct mutex lock;
+	void *workmem;
+	void *buffer;
+};
+
+/*
+ * A cold page on its way to the backing swap. The bio completes in
+ * interrupt context; the table is updated later from wb_done_work.
+ */
+struct rzs_writeback {
+	struct list_head list;
+	struct ramzswap *rzs;
+	struct bio *bio;
+	struct page *page;
+	u32 index;
+	int error;
+	/* object dropped from memory, freed once readers are done with it */
+	struct rzs_dedup *free_dedup;
+	struct page *free_page;
+	u32 free_offset;
+	int free_uncompressed;
+};
+
 struct ramzswap {
 	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct ramzswap_stream *streams;	/* per-CPU */
 	struct table *table;
+	struct hlist_head *dedup_hash;
+	spinlock_t obj_lock;	/* protect dedup_hash, refcounts and object
+				 * locations against compaction */
+	seqcount_t migrate_seq;	/* readers retry if objects moved */
+	struct work_struct compact_work;
+	unsigned long compact_next;	/* jiffies */
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
 	struct mutex lock;
 	struct request_queue *queue;
@@ -123,6 +230,22 @@ struct ramzswap {
 	 */
 	size_t disksize;	/* bytes */
 
+	/*
+	 * Optional backing swap. Incompressible pages are written straight
+	 * to it and pages idle for writeback_age scans are moved there by
+	 * wb_work; slot N is always stored at page N of the device.
+	 */
+	char backing_swap_name[MAX_SWAP_NAME_LEN];
+	struct block_device *backing_swap;
+	size_t backing_pages;	/* slots that fit on backing_swap */
+	struct delayed_work wb_work;
+	struct work_struct wb_done_work;
+	struct list_head wb_done;	/* completed rzs_writeback */
+	spinlock_t wb_lock;	/* protect wb_done */
+	unsigned long *wb_busy;	/* slots with a writeback bio outstanding */
+	atomic_t wb_inflight;
+	wait_queue_head_t wb_wait;
+
 	struct ramzswap_stats stats;
 };
 
@@ -147,6 +270,13 @@ static void rzs_stat64_inc(struct ramzswap *rzs, u64 *v)
 	spin_unlock(&rzs->stat64_lock);
 }
 
+static inline void rzs_stat64_add(struct ramzswap *rzs, u64 *v, u64 inc)
+{
+	spin_lock(&rzs->stat64_lock);
+	*v = *v + inc;
+	spin_unlock(&rzs->stat64_lock);
+}
+
 static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 {
 	u64 val;
@@ -161,6 +291,7 @@ static u64 rzs_stat64_read(struct ramzswap *rzs, u64 *v)
 #define rzs_stat_inc(v)
 #define rzs_stat_dec(v)
 #define rzs_stat64_inc(r, v)
+#define rzs_stat64_add(r, v, i)
 #define rzs_stat64_read(r, v)
 #endif /* CONFIG_RAMZSWAP_STATS */
 
@@ -15,6 +15,8 @@
 #ifndef _RAMZSWAP_IOCTL_H_
 #define _RAMZSWAP_IOCTL_H_
 
+#define MAX_SWAP_NAME_LEN 128
+
 struct ramzswap_ioctl_stats {
 	u64 disksize;		/* user specified or equal to backing swap
 				 * size (if present) */
@@ -34,9 +36,50 @@ struct ramzswap_ioctl_stats {
 	u64 mem_used_total;
 } __attribute__ ((packed, aligned(4)));
 
+/*
+ * Returned by RZSIO_GET_STATS_EXT. RZSIO_GET_STATS keeps returning only
+ * the base part, so its ioctl number and layout stay what existing
+ * tools were built against; new counters go at the end of this one.
+ */
+struct ramzswap_ioctl_stats_ext {
+	struct ramzswap_ioctl_stats base;
+	u64 write_ns;		/* time spent serving writes; with
+				 * num_writes gives swap-out throughput */
+	u64 read_ns;		/* time spent serving reads (faults) */
+	u64 read_ns_max;	/* slowest read */
+	u32 pages_same;		/* no. of non-zero same-filled pages */
+	u32 pages_dedup;	/* no. of pages sharing a stored object */
+	u64 dedup_hits;		/* writes that found an identical object */
+	u64 dedup_saved;	/* compressed bytes not stored due to dedup */
+	u64 compactions;	/* compaction passes run */
+	u64 compact_pages_freed;
+	u64 compact_objs_moved;
+	u32 pages_backed;	/* no. of pages on the backing swap */
+	u64 backing_writes;	/* incompressible writes sent to it */
+	u64 backing_reads;	/* reads served from it */
+	u64 writeback_pages;	/* idle pages moved to it */
+	u64 writeback_failed;	/* ..and writes of those that failed */
+} __attribute__ ((packed, aligned(4)));
+
+#define RZS_FRAG_CLASSES	16	/* of PAGE_SIZE / 16 bytes each */
+#define RZS_FILL_BUCKETS	10	/* pages 0-9%, 10-19%, ... used */
+
+struct ramzswap_ioctl_frag {
+	u32 pages;
+	u32 pages_by_fill[RZS_FILL_BUCKETS];
+	u32 objs[RZS_FRAG_CLASSES];	/* live objects per size class */
+	u32 obj_bytes[RZS_FRAG_CLASSES];
+	u32 free_blocks[RZS_FRAG_CLASSES];	/* free blocks per size class */
+	u32 free_bytes[RZS_FRAG_CLASSES];
+} __attribute__ ((packed, aligned(4)));
+
 #define RZSIO_SET_DISKSIZE_KB	_IOW('z', 0, size_t)
 #define RZSIO_GET_STATS		_IOR('z', 1, struct ramzswap_ioctl_stats)
 #define RZSIO_INIT		_IO('z', 2)
 #define RZSIO_RESET		_IO('z', 3)
+#define RZSIO_COMPACT		_IO('z', 4)
+#define RZSIO_GET_FRAG		_IOR('z', 5, struct ramzswap_ioctl_frag)
+#define RZSIO_SET_BACKING_SWAP	_IOW('z', 6, unsigned char[MAX_SWAP_NAME_LEN])
+#define RZSIO_GET_STATS_EXT	_IOR('z', 7, struct ramzswap_ioctl_stats_ext)
 
 #endif
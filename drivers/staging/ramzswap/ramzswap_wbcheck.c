@@ -0,0 +1,223 @@
+/*
+ * Compressed RAM based swap device
+ *
+ * Checks that cold pages make it to the backing swap
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ *
+ * Loading the module writes 'pages' pages to slots 1.. of 'dev', each
+ * identical to its neighbour so half of them are stored as shared
+ * objects, waits up to 'seconds' for writeback to move all of them to
+ * the backing swap, then reads them back and compares. The device must
+ * be freshly initialized with a backing swap and not be in use as swap;
+ * nothing frees the slots afterwards, so reset and init it again before
+ * another run. insmod fails unless every page was written back and read
+ * back intact.
+ *
+ *   echo 1 > /sys/module/ramzswap/parameters/writeback_interval
+ *   echo 0 > /sys/module/ramzswap/parameters/writeback_age
+ *   rzscontrol /dev/ramzswap0 --backing_swap=/dev/block/loop0 --init
+ *   insmod ramzswap_wbcheck.ko dev=/dev/ramzswap0 pages=256
+ */
+
+#define KMSG_COMPONENT "ramzswap_wbcheck"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bio.h>
+#include <linux/blkdev.h>
+#include <linux/completion.h>
+#include <linux/err.h>
+#include <linux/fs.h>
+#include <linux/highmem.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "ramzswap_ioctl.h"
+
+static char *dev = "/dev/ramzswap0";
+module_param(dev, charp, S_IRUGO);
+MODULE_PARM_DESC(dev, "initialized ramzswap device with a backing swap");
+
+static int pages = 256;
+module_param(pages, int, S_IRUGO);
+MODULE_PARM_DESC(pages, "number of slots to write, from slot 1 on");
+
+static int seconds = 30;
+module_param(seconds, int, S_IRUGO);
+MODULE_PARM_DESC(seconds, "how long to wait for writeback");
+
+static void rzs_check_endio(struct bio *bio, int err)
+{
+	complete(bio->bi_private);
+}
+
+static int rzs_check_rw(struct block_device *bdev, int rw, u32 index,
+			struct page *page)
+{
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct bio *bio;
+	int ret;
+
+	bio = bio_alloc(GFP_KERNEL, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_bdev = bdev;
+	bio->bi_sector = (sector_t)index << (PAGE_SHIFT - 9);
+	bio_add_page(bio, page, PAGE_SIZE, 0);
+	bio->bi_end_io = rzs_check_endio;
+	bio->bi_private = &done;
+
+	submit_bio(rw, bio);
+	wait_for_completion(&done);
+
+	ret = test_bit(BIO_UPTODATE, &bio->bi_flags) ? 0 : -EIO;
+	bio_put(bio);
+	return ret;
+}
+
+static int rzs_check_stats(struct block_device *bdev,
+			struct ramzswap_ioctl_stats_ext *s)
+{
+	mm_segment_t old_fs;
+	int ret;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	ret = __blkdev_driver_ioctl(bdev, FMODE_READ, RZSIO_GET_STATS_EXT,
+				    (unsigned long)s);
+	set_fs(old_fs);
+	return ret;
+}
+
+/*
+ * Compressible but not same-filled, and the same for each pair of slots
+ * so the second of them is stored as a reference to the first.
+ */
+static void rzs_check_fill(struct page *page, u32 index)
+{
+	u32 *p = kmap(page);
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(*p); i++)
+		p[i] = (index - 1) / 2 * 16 + (i & 15);
+	kunmap(page);
+}
+
+static int rzs_check_compare(struct page *page, struct page *expect)
+{
+	void *a = kmap(page), *b = kmap(expect);
+	int ret = memcmp(a, b, PAGE_SIZE) ? -EIO : 0;
+
+	kunmap(expect);
+	kunmap(page);
+	return ret;
+}
+
+static int __init ramzswap_wbcheck_init(void)
+{
+	struct ramzswap_ioctl_stats_ext *before, *after;
+	struct block_device *bdev;
+	struct page *page, *expect;
+	u64 written = 0;
+	int i, bad = 0, ret;
+
+	if (pages <= 0 || seconds <= 0)
+		return -EINVAL;
+
+	before = kzalloc(sizeof(*before), GFP_KERNEL);
+	after = kzalloc(sizeof(*after), GFP_KERNEL);
+	page = alloc_page(GFP_KERNEL);
+	expect = alloc_page(GFP_KERNEL);
+	if (!before || !after || !page || !expect) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	bdev = open_bdev_exclusive(dev, FMODE_READ | FMODE_WRITE,
+				   ramzswap_wbcheck_init);
+	if (IS_ERR(bdev)) {
+		ret = PTR_ERR(bdev);
+		pr_err("cannot open %s: %d\n", dev, ret);
+		goto out_free;
+	}
+
+	ret = rzs_check_stats(bdev, before);
+	if (ret) {
+		pr_err("%s: no extended stats: %d\n", dev, ret);
+		goto out_close;
+	}
+
+	for (i = 1; i <= pages; i++) {
+		rzs_check_fill(page, i);
+		ret = rzs_check_rw(bdev, WRITE, i, page);
+		if (ret) {
+			pr_err("write of slot %d failed: %d\n", i, ret);
+			goto out_close;
+		}
+	}
+
+	rzs_check_stats(bdev, after);
+	if (after->dedup_hits - before->dedup_hits < pages / 2) {
+		pr_err("only %llu of %d pages shared, is dedup off?\n",
+		       after->dedup_hits - before->dedup_hits, pages / 2);
+		ret = -EINVAL;
+		goto out_close;
+	}
+
+	for (i = 0; i < seconds; i++) {
+		rzs_check_stats(bdev, after);
+		written = after->writeback_pages - before->writeback_pages;
+		if (written >= pages)
+			break;
+		schedule_timeout_interruptible(HZ);
+		if (signal_pending(current))
+			break;
+	}
+
+	for (i = 1; i <= pages; i++) {
+		rzs_check_fill(expect, i);
+		ret = rzs_check_rw(bdev, READ, i, page);
+		if (ret || rzs_check_compare(page, expect))
+			bad++;
+	}
+	rzs_check_stats(bdev, after);
+
+	pr_info("%s: %d pages written, %llu moved to the backing swap "
+		"(%llu failed), %llu read back from it, %d bad\n", dev, pages,
+		written, after->writeback_failed - before->writeback_failed,
+		after->backing_reads - before->backing_reads, bad);
+
+	ret = 0;
+	if (written < pages || bad ||
+	    after->backing_reads - before->backing_reads < pages)
+		ret = -EIO;
+
+out_close:
+	close_bdev_exclusive(bdev, FMODE_READ | FMODE_WRITE);
+out_free:
+	if (expect)
+		__free_page(expect);
+	if (page)
+		__free_page(page);
+	kfree(after);
+	kfree(before);
+	return ret;
+}
+
+static void __exit ramzswap_wbcheck_exit(void)
+{
+}
+
+module_init(ramzswap_wbcheck_init);
+module_exit(ramzswap_wbcheck_exit);
+
+MODULE_LICENSE("Dual BSD/GPL");
+MODULE_DESCRIPTION("Checks ramzswap writeback to the backing swap");
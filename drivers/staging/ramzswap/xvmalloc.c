@@ -14,6 +14,7 @@
 #include <linux/errno.h>
 #include <linux/highmem.h>
 #include <linux/init.h>
+#include <linux/sched.h>
 #include <linux/string.h>
 #include <linux/slab.h>
 
@@ -287,6 +288,7 @@ static int grow_pool(struct xv_pool *pool, gfp_t flags)
 	stat_inc(&pool->total_pages);
 
 	spin_lock(&pool->lock);
+	list_add_tail(&page->lru, &pool->pages);
 	block = get_ptr_atomic(page, 0, KM_USER0);
 
 	block->size = PAGE_SIZE - XV_ALIGN;
@@ -317,6 +319,7 @@ struct xv_pool *xv_create_pool(void)
 		return NULL;
 
 	spin_lock_init(&pool->lock);
+	INIT_LIST_HEAD(&pool->pages);
 
 	return pool;
 }
@@ -326,55 +329,22 @@ void xv_destroy_pool(struct xv_pool *pool)
 	kfree(pool);
 }
 
-/**
- * xv_malloc - Allocate block of given size from pool.
- * @pool: pool to allocate from
- * @size: size of block to allocate
- * @page: page no. that holds the object
- * @offset: location of object within page
- *
- * On success, <page, offset> identifies block allocated
- * and 0 is returned. On failure, <page, offset> is set to
- * 0 and -ENOMEM is returned.
- *
- * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+/*
+ * Allocate a block of (aligned) size from blocks already in the pool.
+ * Caller must hold pool->lock.
  */
-int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
-		u32 *offset, gfp_t flags)
+static int __xv_malloc(struct xv_pool *pool, u32 size, u32 origsize,
+			struct page **page, u32 *offset)
 {
-	int error;
-	u32 index, tmpsize, origsize, tmpoffset;
+	u32 index, tmpsize, tmpoffset;
 	struct block_header *block, *tmpblock;
 
 	*page = NULL;
 	*offset = 0;
-	origsize = size;
-
-	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
-		return -ENOMEM;
-
-	size = ALIGN(size, XV_ALIGN);
-
-	spin_lock(&pool->lock);
 
 	index = find_block(pool, size, page, offset);
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
-		if (flags & GFP_NOWAIT)
-			return -ENOMEM;
-		error = grow_pool(pool, flags);
-		if (unlikely(error))
-			return error;
-
-		spin_lock(&pool->lock);
-		index = find_block(pool, size, page, offset);
-	}
-
-	if (!*page) {
-		spin_unlock(&pool->lock);
+	if (!*page)
 		return -ENOMEM;
-	}
 
 	block = get_ptr_atomic(*page, *offset, KM_USER0);
 
@@ -407,25 +377,72 @@ int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
 	clear_flag(block, BLOCK_FREE);
 
 	put_ptr_atomic(block, KM_USER0);
-	spin_unlock(&pool->lock);
 
 	*offset += XV_ALIGN;
 
 	return 0;
 }
 
+/**
+ * xv_malloc - Allocate block of given size from pool.
+ * @pool: pool to allocate from
+ * @size: size of block to allocate
+ * @page: page no. that holds the object
+ * @offset: location of object within page
+ *
+ * On success, <page, offset> identifies block allocated
+ * and 0 is returned. On failure, <page, offset> is set to
+ * 0 and -ENOMEM is returned.
+ *
+ * Allocation requests with size > XV_MAX_ALLOC_SIZE will fail.
+ */
+int xv_malloc(struct xv_pool *pool, u32 size, struct page **page,
+		u32 *offset, gfp_t flags)
+{
+	int error;
+	u32 origsize;
+
+	*page = NULL;
+	*offset = 0;
+	origsize = size;
+
+	if (unlikely(!size || size > XV_MAX_ALLOC_SIZE))
+		return -ENOMEM;
+
+	size = ALIGN(size, XV_ALIGN);
+
+	spin_lock(&pool->lock);
+
+	error = __xv_malloc(pool, size, origsize, page, offset);
+	if (error) {
+		spin_unlock(&pool->lock);
+		if (flags & GFP_NOWAIT)
+			return -ENOMEM;
+		error = grow_pool(pool, flags);
+		if (unlikely(error))
+			return error;
+
+		spin_lock(&pool->lock);
+		error = __xv_malloc(pool, size, origsize, page, offset);
+	}
+
+	spin_unlock(&pool->lock);
+
+	return error;
+}
+
 /*
- * Free block identified with <page, offset>
+ * Free block identified with <page, offset>. Returns 1 if that left the
+ * page empty; it is then off the pool and the caller must free it.
+ * Caller must hold pool->lock.
  */
-void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+static int __xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 {
 	void *page_start;
 	struct block_header *block, *tmpblock;
 
 	offset -= XV_ALIGN;
 
-	spin_lock(&pool->lock);
-
 	page_start = get_ptr_atomic(page, 0, KM_USER0);
 	block = (struct block_header *)((char *)page_start + offset);
 
@@ -469,11 +486,9 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	/* No used objects in this page. Free it. */
 	if (block->size == PAGE_SIZE - XV_ALIGN) {
 		put_ptr_atomic(page_start, KM_USER0);
-		spin_unlock(&pool->lock);
-
-		__free_page(page);
+		list_del(&page->lru);
 		stat_dec(&pool->total_pages);
-		return;
+		return 1;
 	}
 
 	set_flag(block, BLOCK_FREE);
@@ -487,7 +502,19 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
 	}
 
 	put_ptr_atomic(page_start, KM_USER0);
+	return 0;
+}
+
+void xv_free(struct xv_pool *pool, struct page *page, u32 offset)
+{
+	int empty;
+
+	spin_lock(&pool->lock);
+	empty = __xv_free(pool, page, offset);
 	spin_unlock(&pool->lock);
+
+	if (empty)
+		__free_page(page);
 }
 
 u32 xv_get_object_size(void *obj)
@@ -505,3 +532,241 @@ u64 xv_get_total_size_bytes(struct xv_pool *pool)
 {
 	return pool->total_pages << PAGE_SHIFT;
 }
+
+/*
+ * Size of the block at block, as laid out in the page: free blocks keep
+ * an aligned size, used ones the size that was asked for.
+ */
+static u32 block_span(struct block_header *block)
+{
+	return ALIGN(block->size, XV_ALIGN) + XV_ALIGN;
+}
+
+#define for_each_block(block, offset, page_start)			\
+	for (offset = 0;						\
+	     offset < PAGE_SIZE &&					\
+	     (block = (struct block_header *)((char *)(page_start) +	\
+					      offset));		\
+	     offset += block_span(block))
+
+/* A live object that compact_page() is about to move */
+struct xv_move {
+	struct page *new_page;
+	u32 new_offset;
+	u16 offset;
+	u16 size;
+};
+
+#define XV_MAX_PAGE_OBJS	(PAGE_SIZE / (2 * XV_ALIGN))
+
+/*
+ * Take the free blocks of page off (isolate = 1) or back on the free
+ * lists, so objects being moved out can't be placed in the same page.
+ */
+static void page_free_blocks(struct xv_pool *pool, struct page *page,
+			int isolate)
+{
+	u32 offset;
+	void *page_start;
+	struct block_header *block;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for_each_block(block, offset, page_start) {
+		if (!test_flag(block, BLOCK_FREE) ||
+		    block->size < XV_MIN_ALLOC_SIZE)
+			continue;
+		if (isolate)
+			remove_block(pool, page, offset, block,
+				     get_index_for_insert(block->size));
+		else
+			insert_block(pool, page, offset, block);
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+}
+
+/*
+ * Move every object out of page if it is at most cc->max_fill % used
+ * and the rest of the pool has room for them. Returns 1 if the page was
+ * emptied and taken off the pool; the caller frees it. Called with
+ * pool->lock held.
+ */
+static int compact_page(struct xv_pool *pool, struct page *page,
+			struct xv_compact_control *cc, struct xv_move *moves)
+{
+	u32 offset, used = 0;
+	int i, nr = 0;
+	void *page_start, *src, *dst;
+	struct block_header *block;
+
+	page_start = get_ptr_atomic(page, 0, KM_USER0);
+	for_each_block(block, offset, page_start) {
+		if (test_flag(block, BLOCK_FREE))
+			continue;
+		moves[nr].offset = offset + XV_ALIGN;
+		moves[nr].size = block->size;
+		used += block_span(block);
+		nr++;
+	}
+	put_ptr_atomic(page_start, KM_USER0);
+
+	if (!nr || used * 100 > cc->max_fill * PAGE_SIZE)
+		return 0;
+
+	/*
+	 * Reserve a destination for every object first, so that the page
+	 * is either emptied or left exactly as it was.
+	 */
+	page_free_blocks(pool, page, 1);
+	for (i = 0; i < nr; i++) {
+		if (__xv_malloc(pool, ALIGN(moves[i].size, XV_ALIGN),
+				moves[i].size, &moves[i].new_page,
+				&moves[i].new_offset))
+			break;
+	}
+	if (i < nr) {
+		while (i--) {
+			if (__xv_free(pool, moves[i].new_page,
+				      moves[i].new_offset))
+				__free_page(moves[i].new_page);
+		}
+		page_free_blocks(pool, page, 0);
+		return 0;
+	}
+
+	if (cc->seq)
+		write_seqcount_begin(cc->seq);
+	for (i = 0; i < nr; i++) {
+		src = get_ptr_atomic(page, moves[i].offset, KM_USER0);
+		dst = get_ptr_atomic(moves[i].new_page, moves[i].new_offset,
+				     KM_USER1);
+		memcpy(dst, src, moves[i].size);
+		cc->relocate(cc->priv, dst, page, moves[i].offset,
+			     moves[i].new_page, moves[i].new_offset);
+		put_ptr_atomic(dst, KM_USER1);
+		put_ptr_atomic(src, KM_USER0);
+	}
+	if (cc->seq)
+		write_seqcount_end(cc->seq);
+
+	cc->objs_moved += nr;
+	list_del(&page->lru);
+	stat_dec(&pool->total_pages);
+	return 1;
+}
+
+/**
+ * xv_compact - empty sparsely used pages and give them back
+ * @pool: pool to compact
+ * @cc: which pages to empty, and how to tell the owner of an object
+ *      that it moved
+ *
+ * Pages at most cc->max_fill % used have their objects moved into free
+ * blocks elsewhere in the pool, after which they are taken off the pool
+ * and queued on cc->freed. No pages are allocated to do this. The pool
+ * lock is dropped between pages. At most cc->max_pages pages are looked
+ * at; they go to the back of the pool, so the next call carries on with
+ * the ones not looked at yet.
+ *
+ * Callers must not run this concurrently with xv_get_frag_stats().
+ */
+int xv_compact(struct xv_pool *pool, struct xv_compact_control *cc)
+{
+	u32 scanned = 0;
+	struct page *page;
+	struct xv_move *moves;
+	LIST_HEAD(done);
+
+	moves = kmalloc(XV_MAX_PAGE_OBJS * sizeof(*moves), GFP_NOIO);
+	if (!moves)
+		return -ENOMEM;
+
+	while (!cc->max_pages || scanned < cc->max_pages) {
+		spin_lock(cc->lock);
+		spin_lock(&pool->lock);
+		if (list_empty(&pool->pages)) {
+			spin_unlock(&pool->lock);
+			spin_unlock(cc->lock);
+			break;
+		}
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move_tail(&page->lru, &done);
+		if (compact_page(pool, page, cc, moves)) {
+			list_add_tail(&page->lru, &cc->freed);
+			cc->pages_freed++;
+		}
+		spin_unlock(&pool->lock);
+		spin_unlock(cc->lock);
+
+		scanned++;
+		cond_resched();
+	}
+	cc->pages_scanned += scanned;
+
+	spin_lock(&pool->lock);
+	list_splice_tail(&done, &pool->pages);
+	spin_unlock(&pool->lock);
+
+	kfree(moves);
+	return 0;
+}
+
+static u32 frag_class(u32 size)
+{
+	return min_t(u32, size / (PAGE_SIZE / XV_FRAG_CLASSES),
+		     XV_FRAG_CLASSES - 1);
+}
+
+/**
+ * xv_get_frag_stats - describe how the pool's pages are used
+ * @pool: pool to look at
+ * @s: filled with page fill levels and, per size class, the number and
+ *     bytes of live objects and of free blocks
+ *
+ * Walks every page, dropping the pool lock between pages.
+ */
+void xv_get_frag_stats(struct xv_pool *pool, struct xv_frag_stats *s)
+{
+	u32 offset, used;
+	void *page_start;
+	struct page *page;
+	struct block_header *block;
+	LIST_HEAD(done);
+
+	memset(s, 0, sizeof(*s));
+
+	for (;;) {
+		spin_lock(&pool->lock);
+		if (list_empty(&pool->pages)) {
+			spin_unlock(&pool->lock);
+			break;
+		}
+		page = list_first_entry(&pool->pages, struct page, lru);
+		list_move_tail(&page->lru, &done);
+
+		used = 0;
+		page_start = get_ptr_atomic(page, 0, KM_USER0);
+		for_each_block(block, offset, page_start) {
+			u32 class = frag_class(block->size);
+
+			if (test_flag(block, BLOCK_FREE)) {
+				s->free_blocks[class]++;
+				s->free_bytes[class] += block->size;
+			} else {
+				s->objs[class]++;
+				s->obj_bytes[class] += block->size;
+				used += block_span(block);
+			}
+		}
+		put_ptr_atomic(page_start, KM_USER0);
+		spin_unlock(&pool->lock);
+
+		s->pages++;
+		s->pages_by_fill[min_t(u32, used * XV_FILL_BUCKETS / PAGE_SIZE,
+				       XV_FILL_BUCKETS - 1)]++;
+		cond_resched();
+	}
+
+	spin_lock(&pool->lock);
+	list_splice(&done, &pool->pages);
+	spin_unlock(&pool->lock);
+}
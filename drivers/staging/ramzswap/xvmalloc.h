@@ -14,9 +14,51 @@
 #define _XV_MALLOC_H_
 
 #include <linux/types.h>
+#include <linux/spinlock.h>
+#include <linux/seqlock.h>
 
 struct xv_pool;
 
+/* Object sizes are reported in this many classes of PAGE_SIZE / n bytes */
+#define XV_FRAG_CLASSES		16
+/* Pages are reported by how full they are, in steps of 10% */
+#define XV_FILL_BUCKETS		10
+
+struct xv_frag_stats {
+	u32 pages;
+	u32 pages_by_fill[XV_FILL_BUCKETS];
+	u32 objs[XV_FRAG_CLASSES];
+	u32 obj_bytes[XV_FRAG_CLASSES];
+	u32 free_blocks[XV_FRAG_CLASSES];
+	u32 free_bytes[XV_FRAG_CLASSES];
+};
+
+/*
+ * Tells xv_compact which pages to empty and how to tell the owner that
+ * an object moved. relocate() is called with the pool lock and ->lock
+ * held and the new copy of the object mapped at obj.
+ *
+ * Emptied pages are not freed but queued on ->freed through page->lru,
+ * since lockless readers may still be using the old copies. The caller
+ * frees them once those readers are done.
+ */
+struct xv_compact_control {
+	u32 max_fill;		/* empty pages at most this % used */
+	u32 max_pages;		/* look at this many pages per call, 0: all */
+	spinlock_t *lock;	/* taken around each page, before pool lock */
+	seqcount_t *seq;	/* bumped while objects are moved, optional */
+	void (*relocate)(void *priv, void *obj,
+			struct page *old_page, u32 old_offset,
+			struct page *new_page, u32 new_offset);
+	void *priv;
+
+	/* results */
+	struct list_head freed;	/* emptied pages, to be freed by caller */
+	u32 pages_scanned;
+	u32 pages_freed;
+	u32 objs_moved;
+};
+
 struct xv_pool *xv_create_pool(void);
 void xv_destroy_pool(struct xv_pool *pool);
 
@@ -27,4 +69,7 @@ void xv_free(struct xv_pool *pool, struct page *page, u32 offset);
 u32 xv_get_object_size(void *obj);
 u64 xv_get_total_size_bytes(struct xv_pool *pool);
 
+int xv_compact(struct xv_pool *pool, struct xv_compact_control *cc);
+void xv_get_frag_stats(struct xv_pool *pool, struct xv_frag_stats *s);
+
 #endif
@@ -79,6 +79,9 @@ struct xv_pool {
 
 	struct freelist_entry freelist[NUM_FREE_LISTS];
 
+	/* all pages of the pool, linked through page->lru */
+	struct list_head pages;
+
 	/* stats */
 	u64 total_pages;
 };
@@ -144,16 +144,50 @@ static void kgsl_check_idle(struct kgsl_device *device)
 static void kgsl_clean_cache_all(struct kgsl_process_private *private)
 {
 	struct kgsl_mem_entry *entry = NULL;
+	struct kgsl_cache_range ranges[KGSL_CACHE_BATCH_MAX];
+	unsigned long bytes = 0;
+	int count = 0, inner_done;
 
+	/* size the batch first, a whole L1 flush can't be sent to the other
+	 * CPUs under mem_lock; it writes back, so plain invalidates rule it
+	 * out */
 	spin_lock(&private->mem_lock);
 	list_for_each_entry(entry, &private->mem_list, list) {
-		if (KGSL_MEMFLAGS_CACHE_MASK & entry->memdesc.priv) {
-			    kgsl_cache_range_op((unsigned long)entry->
-						   memdesc.hostptr,
-						   entry->memdesc.size,
-						   entry->memdesc.priv);
+		if (!(KGSL_MEMFLAGS_CACHE_MASK & entry->memdesc.priv))
+			continue;
+		if (!(entry->memdesc.priv & (KGSL_MEMFLAGS_CACHE_FLUSH |
+					     KGSL_MEMFLAGS_CACHE_CLEAN))) {
+			bytes = 0;
+			break;
+		}
+		bytes += entry->memdesc.size;
+	}
+	spin_unlock(&private->mem_lock);
+
+	inner_done = kgsl_cache_flush_inner_all(bytes);
+
+	spin_lock(&private->mem_lock);
+	list_for_each_entry(entry, &private->mem_list, list) {
+		if (!(KGSL_MEMFLAGS_CACHE_MASK & entry->memdesc.priv))
+			continue;
+		/* an invalidate that showed up since can't lean on it */
+		if (inner_done && !(entry->memdesc.priv &
+				    (KGSL_MEMFLAGS_CACHE_FLUSH |
+				     KGSL_MEMFLAGS_CACHE_CLEAN))) {
+			kgsl_cache_range_op(
+				(unsigned long)entry->memdesc.hostptr,
+				entry->memdesc.size, entry->memdesc.priv);
+			continue;
+		}
+		ranges[count].addr = (unsigned long)entry->memdesc.hostptr;
+		ranges[count].size = entry->memdesc.size;
+		ranges[count].flags = entry->memdesc.priv;
+		if (++count == KGSL_CACHE_BATCH_MAX) {
+			kgsl_cache_range_op_list(ranges, count, inner_done);
+			count = 0;
 		}
 	}
+	kgsl_cache_range_op_list(ranges, count, inner_done);
 	spin_unlock(&private->mem_lock);
 }
 
@@ -338,6 +372,9 @@ static int kgsl_resume(struct platform_device *dev)
 			}
 			status = device->ftbl.device_resume_context(device);
 			complete_all(&device->hwaccess_gate);
+			/* nothing was armed while suspended */
+			kgsl_runpending(device);
+			wake_up_interruptible_all(&device->fence_wq);
 		}
 		device->requested_state = KGSL_STATE_NONE;
 		mutex_unlock(&device->mutex);
@@ -934,6 +971,47 @@ done:
 	return result;
 }
 
+static long kgsl_ioctl_timestamp_fence(struct kgsl_device_private *dev_priv,
+				       void __user *arg)
+{
+	int result = 0;
+	struct kgsl_timestamp_fence param;
+	struct file *file;
+	int fd;
+
+	if (copy_from_user(&param, arg, sizeof(param))) {
+		result = -EFAULT;
+		goto done;
+	}
+
+	fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		result = fd;
+		goto done;
+	}
+
+	file = kgsl_cmdstream_fence_create(dev_priv->device, param.timestamp);
+	if (IS_ERR(file)) {
+		result = PTR_ERR(file);
+		goto put_fd;
+	}
+
+	param.fd = fd;
+	if (copy_to_user(arg, &param, sizeof(param))) {
+		result = -EFAULT;
+		fput(file);
+		goto put_fd;
+	}
+
+	fd_install(fd, file);
+	return 0;
+
+put_fd:
+	put_unused_fd(fd);
+done:
+	return result;
+}
+
 static long kgsl_ioctl_drawctxt_create(struct kgsl_device_private *dev_priv,
 				      void __user *arg)
 {
@@ -1581,6 +1659,7 @@ static long kgsl_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 		if (kgsl_cache_enable)
 			kgsl_clean_cache_all(dev_priv->process_priv);
 #endif
+		kgsl_cache_end_frame();
 #ifdef CONFIG_MSM_KGSL_DRM
 		kgsl_gpu_mem_flush(DRM_KGSL_GEM_CACHE_OP_TO_DEV);
 #endif
@@ -1604,6 +1683,11 @@ static long kgsl_ioctl(struct file *filep, unsigned int cmd, unsigned long arg)
 						    (void __user *)arg);
 		break;
 
+	case IOCTL_KGSL_TIMESTAMP_FENCE:
+		result = kgsl_ioctl_timestamp_fence(dev_priv,
+						    (void __user *)arg);
+		break;
+
 	case IOCTL_KGSL_DRAWCTXT_CREATE:
 		result = kgsl_ioctl_drawctxt_create(dev_priv,
 							(void __user *)arg);
@@ -1864,63 +1948,46 @@ error_class_create:
 static void
 kgsl_ptpool_cleanup(void)
 {
-	int size = kgsl_driver.ptpool.entries * kgsl_driver.ptsize;
-
-	if (kgsl_driver.ptpool.hostptr)
-		dma_free_coherent(NULL, size, kgsl_driver.ptpool.hostptr,
-				  kgsl_driver.ptpool.physaddr);
+	struct kgsl_ptpool_chunk *chunk, *tmp;
 
+	cancel_work_sync(&kgsl_driver.ptpool.grow_ws);
 
-	kfree(kgsl_driver.ptpool.bitmap);
+	list_for_each_entry_safe(chunk, tmp, &kgsl_driver.ptpool.chunks,
+				 list) {
+		list_del(&chunk->list);
+		dma_free_coherent(NULL, chunk->size, chunk->hostptr,
+				  chunk->physaddr);
+		kfree(chunk->bitmap);
+		kfree(chunk);
+	}
 
-	memset(&kgsl_driver.ptpool, 0, sizeof(kgsl_driver.ptpool));
+	kgsl_driver.ptpool.entries = 0;
+	kgsl_driver.ptpool.used = 0;
+	kgsl_driver.ptpool.grows = 0;
 }
 
-/* Allocate memory and structures for the pagetable pool */
+/* Allocate the initial chunk of the pagetable pool.  It is sized by the
+   platform so that the expected number of processes never have to wait
+   for the pool to grow. */
 
 static int __devinit
-kgsl_ptpool_init(void)
+kgsl_ptpool_init(int count)
 {
-	int size = kgsl_driver.ptpool.entries * kgsl_driver.ptsize;
+	INIT_LIST_HEAD(&kgsl_driver.ptpool.chunks);
+	spin_lock_init(&kgsl_driver.ptpool.lock);
+	INIT_WORK(&kgsl_driver.ptpool.grow_ws, kgsl_ptpool_grow);
 
-	if (size > SZ_4M) {
-		size = SZ_4M;
-		kgsl_driver.ptpool.entries = SZ_4M / kgsl_driver.ptsize;
+	if (count * kgsl_driver.ptsize > SZ_4M) {
+		count = SZ_4M / kgsl_driver.ptsize;
 		KGSL_DRV_ERR("Page table pool too big.  Limiting to "
-			"%d processes\n", kgsl_driver.ptpool.entries);
+			"%d processes\n", count);
 	}
 
-	/* Allocate a large chunk of memory for the page tables */
-
-	kgsl_driver.ptpool.hostptr =
-		dma_alloc_coherent(NULL, size, &kgsl_driver.ptpool.physaddr,
-				   GFP_KERNEL);
-
-	if (kgsl_driver.ptpool.hostptr == NULL) {
+	if (kgsl_ptpool_add(count)) {
 		KGSL_DRV_ERR("pagetable init failed\n");
 		return -ENOMEM;
 	}
 
-	/* Allocate room for the bitmap */
-
-	kgsl_driver.ptpool.bitmap =
-		kzalloc((kgsl_driver.ptpool.entries / BITS_PER_BYTE) + 1,
-			GFP_KERNEL);
-
-	if (kgsl_driver.ptpool.bitmap == NULL) {
-		KGSL_DRV_ERR("pagetable init failed\n");
-		dma_free_coherent(NULL, size, kgsl_driver.ptpool.hostptr,
-				  kgsl_driver.ptpool.physaddr);
-		return -ENOMEM;
-	}
-
-	/* Clear the memory at init time - this saves us having to do
-	   it as page tables are allocated */
-
-	memset(kgsl_driver.ptpool.hostptr, 0, size);
-
-	spin_lock_init(&kgsl_driver.ptpool.lock);
-
 	return 0;
 }
 
@@ -1974,9 +2041,8 @@ static int __devinit kgsl_platform_probe(struct platform_device *pdev)
 	kgsl_driver.ptsize = ALIGN(kgsl_driver.ptsize, KGSL_PAGESIZE);
 
 	kgsl_driver.pt_va_size = pdata->pt_va_size;
-	kgsl_driver.ptpool.entries = pdata->pt_max_count;
 
-	result = kgsl_ptpool_init();
+	result = kgsl_ptpool_init(pdata->pt_max_count);
 
 	if (result != 0)
 		goto done;
@@ -70,6 +70,14 @@
 #define KGSL_PAGETABLE_ENTRIES(_sz) (((_sz) >> KGSL_PAGESIZE_SHIFT) + \
 				     KGSL_PT_EXTRA_ENTRIES)
 
+/* Limits for the pagetable pool.  The platform sized chunk is allocated
+ * at probe time; further chunks of roughly KGSL_PTPOOL_GROW_SIZE are added
+ * in the background when fewer than KGSL_PTPOOL_LOW_WATER pagetables are
+ * left, up to KGSL_PTPOOL_MAX_SIZE in total. */
+#define KGSL_PTPOOL_MAX_SIZE	SZ_8M
+#define KGSL_PTPOOL_GROW_SIZE	SZ_256K
+#define KGSL_PTPOOL_LOW_WATER	1
+
 /* Casting using container_of() for structures that kgsl owns. */
 #define KGSL_CONTAINER_OF(ptr, type, member) \
 		container_of(ptr, type, member)
@@ -78,6 +86,16 @@
 #define KGSL_G12_DEVICE(device) \
 		KGSL_CONTAINER_OF(device, struct kgsl_g12_device, dev)
 
+/* One physically contiguous block of pagetables in the pool */
+struct kgsl_ptpool_chunk {
+	struct list_head list;
+	void *hostptr;
+	unsigned int physaddr;
+	int size;
+	int count;
+	unsigned long *bitmap;
+};
+
 struct kgsl_driver {
 	struct cdev cdev;
 	dev_t dev_num;
@@ -111,11 +129,12 @@ struct kgsl_driver {
 	   pagetable memory */
 
 	struct {
-		unsigned long *bitmap;
+		struct list_head chunks;
 		int entries;
+		int used;
+		int grows;
 		spinlock_t lock;
-		void *hostptr;
-		unsigned int physaddr;
+		struct work_struct grow_ws;
 	} ptpool;
 };
 
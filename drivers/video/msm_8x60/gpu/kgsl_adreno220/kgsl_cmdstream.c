@@ -16,27 +16,88 @@
  *
  */
 
+#include <linux/anon_inodes.h>
+#include <linux/sched.h>
+#include <linux/file.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+
 #include "kgsl.h"
 #include "kgsl_log.h"
 #include "kgsl_cmdstream.h"
 #include "kgsl_sharedmem.h"
 #include "kgsl_yamato.h"
 
+/* Called from the device interrupt handler whenever timestamps may have
+ * advanced.  Fence waiters re-check themselves; anything on the memqueue
+ * is freed from the workqueue since unmapping can sleep. */
+static int kgsl_cmdstream_ts_notify(struct notifier_block *nb,
+				    unsigned long id, void *data)
+{
+	struct kgsl_device *device = container_of(nb, struct kgsl_device,
+						  ts_nb);
+
+	wake_up_interruptible_all(&device->fence_wq);
+
+	if (!list_empty_careful(&device->memqueue))
+		queue_work(device->work_queue, &device->ts_expired_ws);
+
+	return NOTIFY_OK;
+}
+
+static void kgsl_cmdstream_ts_expired(struct work_struct *work)
+{
+	struct kgsl_device *device = container_of(work, struct kgsl_device,
+						  ts_expired_ws);
+
+	mutex_lock(&device->mutex);
+	kgsl_cmdstream_memqueue_drain(device);
+	mutex_unlock(&device->mutex);
+}
+
+/* MUST be called with the device mutex held.  Ask for an interrupt when
+ * timestamp retires, unless the core is not in a state to take commands;
+ * suspend/resume drains the memqueue and wakes fence waiters itself. */
+static void kgsl_cmdstream_arm_timestamp(struct kgsl_device *device,
+					 unsigned int timestamp)
+{
+	if (device->ftbl.device_arm_timestamp == NULL)
+		return;
+
+	if (device->state & (KGSL_STATE_INIT | KGSL_STATE_SUSPEND |
+			     KGSL_STATE_HUNG))
+		return;
+
+	device->ftbl.device_arm_timestamp(device, timestamp);
+}
+
 int kgsl_cmdstream_init(struct kgsl_device *device)
 {
-	return 0;
+	init_waitqueue_head(&device->fence_wq);
+	INIT_WORK(&device->ts_expired_ws, kgsl_cmdstream_ts_expired);
+
+	device->ts_nb.notifier_call = kgsl_cmdstream_ts_notify;
+	return atomic_notifier_chain_register(&device->ts_notifier_list,
+					      &device->ts_nb);
 }
 
+/* MUST be called without the device mutex held, the memqueue work that
+ * is waited for here takes it. */
 int kgsl_cmdstream_close(struct kgsl_device *device)
 {
 	struct kgsl_mem_entry *entry, *entry_tmp;
 
-	BUG_ON(!mutex_is_locked(&device->mutex));
+	/* nothing can queue the work once the notifier is gone */
+	atomic_notifier_chain_unregister(&device->ts_notifier_list,
+					 &device->ts_nb);
+	cancel_work_sync(&device->ts_expired_ws);
 
+	mutex_lock(&device->mutex);
 	list_for_each_entry_safe(entry, entry_tmp, &device->memqueue, list) {
 		list_del(&entry->list);
 		kgsl_destroy_mem_entry(entry);
 	}
+	mutex_unlock(&device->mutex);
 	return 0;
 }
 
@@ -83,6 +144,13 @@ void kgsl_cmdstream_memqueue_drain(struct kgsl_device *device)
 		list_del(&entry->list);
 		kgsl_destroy_mem_entry(entry);
 	}
+
+	/* free the rest as soon as the oldest of them retires */
+	if (!list_empty(&device->memqueue)) {
+		entry = list_first_entry(&device->memqueue,
+					 struct kgsl_mem_entry, list);
+		kgsl_cmdstream_arm_timestamp(device, entry->free_timestamp);
+	}
 }
 
 /* to be called when a process is destroyed, this walks the memqueue and
@@ -117,3 +185,64 @@ kgsl_cmdstream_freememontimestamp(struct kgsl_device *device,
 
 	list_add_tail(&entry->list, &device->memqueue);
 }
+
+/* A fence is a file descriptor that polls readable once its timestamp
+ * has retired.  Any number of threads may wait on it. */
+struct kgsl_fence {
+	struct kgsl_device *device;
+	unsigned int timestamp;
+};
+
+static unsigned int kgsl_fence_poll(struct file *file, poll_table *wait)
+{
+	struct kgsl_fence *fence = file->private_data;
+	struct kgsl_device *device = fence->device;
+
+	poll_wait(file, &device->fence_wq, wait);
+
+	if (kgsl_check_timestamp(device, fence->timestamp))
+		return POLLIN | POLLRDNORM;
+
+	mutex_lock(&device->mutex);
+	kgsl_cmdstream_arm_timestamp(device, fence->timestamp);
+	mutex_unlock(&device->mutex);
+
+	/* it may have retired before the interrupt was armed */
+	if (kgsl_check_timestamp(device, fence->timestamp))
+		return POLLIN | POLLRDNORM;
+
+	return 0;
+}
+
+static int kgsl_fence_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static const struct file_operations kgsl_fence_fops = {
+	.owner = THIS_MODULE,
+	.poll = kgsl_fence_poll,
+	.release = kgsl_fence_release,
+};
+
+struct file *
+kgsl_cmdstream_fence_create(struct kgsl_device *device, uint32_t timestamp)
+{
+	struct kgsl_fence *fence;
+	struct file *file;
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (fence == NULL)
+		return ERR_PTR(-ENOMEM);
+
+	fence->device = device;
+	fence->timestamp = timestamp;
+
+	file = anon_inode_getfile("kgsl-fence", &kgsl_fence_fops, fence,
+				  O_RDONLY);
+	if (IS_ERR(file))
+		kfree(fence);
+
+	return file;
+}
@@ -81,6 +81,9 @@ kgsl_cmdstream_freememontimestamp(struct kgsl_device *device,
 void kgsl_cmdstream_memqueue_cleanup(struct kgsl_device *device,
 				     struct kgsl_process_private *private);
 
+struct file *
+kgsl_cmdstream_fence_create(struct kgsl_device *device, uint32_t timestamp);
+
 static inline bool timestamp_cmp(unsigned int new, unsigned int old)
 {
 	int ts_diff = new - old;
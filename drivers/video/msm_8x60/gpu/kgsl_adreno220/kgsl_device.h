@@ -37,6 +37,7 @@
 #include <linux/msm_kgsl.h>
 #include <linux/idr.h>
 #include <linux/wakelock.h>
+#include <linux/notifier.h>
 
 #include <asm/atomic.h>
 
@@ -109,6 +110,9 @@ struct kgsl_functable {
 	unsigned int (*device_cmdstream_readtimestamp) (
 					struct kgsl_device *device,
 					enum kgsl_timestamp_type type);
+	/* optional, for cores that only interrupt on request */
+	void (*device_arm_timestamp) (struct kgsl_device *device,
+					unsigned int timestamp);
 	int (*device_issueibcmds) (struct kgsl_device_private *dev_priv,
 				struct kgsl_context *context,
 				struct kgsl_ibdesc *ibdesc,
@@ -156,6 +160,10 @@ struct kgsl_device {
 	atomic_t open_count;
 
 	struct atomic_notifier_head ts_notifier_list;
+	/* timestamp interrupts wake fence waiters and free the memqueue */
+	struct notifier_block ts_nb;
+	wait_queue_head_t fence_wq;
+	struct work_struct ts_expired_ws;
 	struct mutex mutex;
 	uint32_t		state;
 	uint32_t		requested_state;
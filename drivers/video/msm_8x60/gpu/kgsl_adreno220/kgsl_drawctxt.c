@@ -18,6 +18,7 @@
 #include <linux/string.h>
 #include <linux/types.h>
 #include <linux/slab.h>
+#include <linux/sched.h>
 #include <linux/msm_kgsl.h>
 
 #include "yamato_reg.h"
@@ -115,6 +116,11 @@
 
 #define CONTEXT_SIZE		(SHADER_OFFSET + 3 * SHADER_SHADOW_SIZE)
 
+/* bytes moved by the register and shader save/restore IBs */
+#define REG_SWITCH_BYTES	(LCC_SHADOW_SIZE + REG_SHADOW_SIZE + \
+				 TEX_SHADOW_SIZE)
+#define SHADER_SWITCH_BYTES	(3 * SHADER_SHADOW_SIZE)
+
 /* temporary work structure */
 struct tmp_ctx {
 	unsigned int *start;	/* Command & Vertex buffer start */
@@ -1530,6 +1536,9 @@ kgsl_drawctxt_create(struct kgsl_device_private *dev_priv, uint32_t flags,
 
 	drawctxt->pagetable = pagetable;
 	drawctxt->bin_base_offset = 0;
+	INIT_LIST_HEAD(&drawctxt->submit_queue);
+	INIT_LIST_HEAD(&drawctxt->sched_node);
+	drawctxt->priority = task_nice(current);
 
 	ret = create_gpustate_shadow(device, drawctxt, &ctx);
 	if (ret)
@@ -1574,6 +1583,9 @@ int kgsl_drawctxt_destroy(struct kgsl_device *device,
 
 	KGSL_CTXT_INFO("drawctxt_id ptr %p\n", drawctxt);
 
+	/* fail anything still queued; the issuers are asleep on the CP */
+	kgsl_ringbuffer_cancel_drawctxt(&yamato_device->ringbuffer, drawctxt);
+
 	/* deactivate context */
 	if (yamato_device->drawctxt_active == drawctxt) {
 		/* no need to save GMEM or shader, the context is
@@ -1718,6 +1730,30 @@ int kgsl_drawctxt_set_bin_base_offset(struct kgsl_device *device,
 	return 0;
 }
 
+/* bytes a GMEM save or restore of drawctxt copies */
+static unsigned int gmem_switch_bytes(struct kgsl_yamato_context *drawctxt)
+{
+	unsigned int i, bytes = 0;
+
+	for (i = 0; i < KGSL_MAX_GMEM_SHADOW_BUFFERS; i++)
+		bytes += drawctxt->user_gmem_shadow[i].gmemshadow.size;
+
+	return bytes ? bytes : drawctxt->context_gmem_shadow.size;
+}
+
+static unsigned int save_bytes(struct kgsl_yamato_context *drawctxt)
+{
+	unsigned int bytes = REG_SWITCH_BYTES;
+
+	if (drawctxt->flags & CTXT_FLAGS_SHADER_SAVE)
+		bytes += SHADER_SWITCH_BYTES;
+	if (drawctxt->flags & CTXT_FLAGS_GMEM_SAVE
+		&& drawctxt->flags & CTXT_FLAGS_GMEM_SHADOW)
+		bytes += gmem_switch_bytes(drawctxt);
+
+	return bytes;
+}
+
 /* switch drawing contexts */
 void
 kgsl_drawctxt_switch(struct kgsl_yamato_device *yamato_device,
@@ -1727,6 +1763,7 @@ kgsl_drawctxt_switch(struct kgsl_yamato_device *yamato_device,
 	struct kgsl_yamato_context *active_ctxt =
 	  yamato_device->drawctxt_active;
 	struct kgsl_device *device = &yamato_device->dev;
+	struct kgsl_drawctxt_stats *stats = &yamato_device->ctxt_stats;
 	unsigned int cmds[2];
 
 	if (drawctxt) {
@@ -1744,9 +1781,13 @@ kgsl_drawctxt_switch(struct kgsl_yamato_device *yamato_device,
 
 	KGSL_CTXT_INFO("from %p to %p flags %d\n",
 			yamato_device->drawctxt_active, drawctxt, flags);
+	stats->switches++;
+
 	/* save old context*/
 	if (active_ctxt != NULL) {
 		KGSL_CTXT_INFO("active_ctxt flags %08x\n", active_ctxt->flags);
+		stats->bytes_saved += save_bytes(active_ctxt);
+
 		/* save registers and constants. */
 		KGSL_CTXT_DBG("save regs");
 		kgsl_ringbuffer_issuecmds(device, 0, active_ctxt->reg_save, 3);
@@ -1826,6 +1867,7 @@ kgsl_drawctxt_switch(struct kgsl_yamato_device *yamato_device,
 		if (drawctxt->flags & CTXT_FLAGS_GMEM_RESTORE) {
 			unsigned int i, numbuffers = 0;
 			KGSL_CTXT_DBG("restore gmem");
+			stats->bytes_restored += gmem_switch_bytes(drawctxt);
 
 			for (i = 0; i < KGSL_MAX_GMEM_SHADOW_BUFFERS; i++) {
 				if (drawctxt->user_gmem_shadow[i].gmemshadow.
@@ -1856,12 +1898,14 @@ kgsl_drawctxt_switch(struct kgsl_yamato_device *yamato_device,
 
 		/* restore registers and constants. */
 		KGSL_CTXT_DBG("restore regs");
+		stats->bytes_restored += REG_SWITCH_BYTES;
 		kgsl_ringbuffer_issuecmds(device, KGSL_CMD_FLAGS_CONTEXT_CHANGE,
 					  drawctxt->reg_restore, 3);
 
 		/* restore shader instructions & partitioning. */
 		if (drawctxt->flags & CTXT_FLAGS_SHADER_RESTORE) {
 			KGSL_CTXT_DBG("restore shader");
+			stats->bytes_restored += SHADER_SWITCH_BYTES;
 			kgsl_ringbuffer_issuecmds(device, 0,
 					  drawctxt->shader_restore, 3);
 		}
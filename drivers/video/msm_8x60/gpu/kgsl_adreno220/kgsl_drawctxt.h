@@ -54,6 +54,9 @@
 
 #define KGSL_MAX_GMEM_SHADOW_BUFFERS	2
 
+/* timestamps a context may have on the CP before its submissions queue */
+#define KGSL_CONTEXT_INFLIGHT_MAX	8
+
 struct kgsl_device;
 struct kgsl_yamato_device;
 struct kgsl_device_private;
@@ -61,6 +64,13 @@ struct kgsl_context;
 
 /*  types */
 
+/* context switch accounting, protected by the device mutex */
+struct kgsl_drawctxt_stats {
+	unsigned int switches;
+	uint64_t bytes_saved;
+	uint64_t bytes_restored;
+};
+
 /* draw context */
 struct gmem_shadow_t {
 	struct kgsl_memdesc gmemshadow;	/* Shadow buffer address */
@@ -103,6 +113,17 @@ struct kgsl_yamato_context {
 	struct gmem_shadow_t context_gmem_shadow;
 	/* User defined GMEM shadow buffers */
 	struct gmem_shadow_t user_gmem_shadow[KGSL_MAX_GMEM_SHADOW_BUFFERS];
+	/* kgsl_rb_submit entries not yet written to the ringbuffer */
+	struct list_head submit_queue;
+	/* link in ringbuffer->sched_list while submit_queue is non-empty */
+	struct list_head sched_node;
+	/* nice value of the last issuer; lower is dispatched first */
+	int priority;
+	/* the last KGSL_CONTEXT_INFLIGHT_MAX timestamps written for us,
+	 * inflight_next being the oldest once inflight is full */
+	uint32_t inflight_ts[KGSL_CONTEXT_INFLIGHT_MAX];
+	unsigned int inflight_next;
+	unsigned int inflight;
 };
 
 
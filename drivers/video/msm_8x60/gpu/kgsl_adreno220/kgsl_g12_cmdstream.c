@@ -41,10 +41,17 @@ static inline unsigned int rb_offset(unsigned int index)
 int kgsl_g12_cmdstream_init(struct kgsl_device *device)
 {
 	struct kgsl_g12_device *g12_device = KGSL_G12_DEVICE(device);
+	int result;
+
 	memset(&g12_device->ringbuffer, 0, sizeof(struct kgsl_g12_ringbuffer));
 	g12_device->ringbuffer.prevctx = KGSL_G12_INVALID_CONTEXT;
-	return kgsl_sharedmem_alloc_coherent(&g12_device->ringbuffer.cmdbufdesc,
-					     KGSL_G12_RB_SIZE);
+	result = kgsl_sharedmem_alloc_coherent(
+				&g12_device->ringbuffer.cmdbufdesc,
+				KGSL_G12_RB_SIZE);
+	if (result != 0)
+		return result;
+
+	return kgsl_cmdstream_init(device);
 }
 
 static void addmarker(struct kgsl_g12_ringbuffer *rb, unsigned int index)
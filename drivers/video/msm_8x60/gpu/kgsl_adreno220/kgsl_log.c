@@ -472,6 +472,102 @@ static const struct file_operations kgsl_mh_debug_fops = {
 	.read = kgsl_mh_debug_read,
 };
 
+static ssize_t kgsl_ctxt_stats_read(
+	struct file *file,
+	char __user *buff,
+	size_t buff_count,
+	loff_t *ppos)
+{
+	struct kgsl_device *device = kgsl_get_yamato_generic_device();
+	struct kgsl_drawctxt_stats stats;
+	char buf[256];
+	int len;
+
+	if (!device)
+		return 0;
+
+	mutex_lock(&device->mutex);
+	stats = KGSL_YAMATO_DEVICE(device)->ctxt_stats;
+	mutex_unlock(&device->mutex);
+
+	len = snprintf(buf, sizeof(buf),
+		"switches: %u\nbytes_saved: %llu\nbytes_restored: %llu\n",
+		stats.switches, stats.bytes_saved, stats.bytes_restored);
+
+	return simple_read_from_buffer(buff, buff_count, ppos, buf, len);
+}
+
+static const struct file_operations kgsl_ctxt_stats_fops = {
+	.open = kgsl_dbgfs_open,
+	.release = kgsl_dbgfs_release,
+	.read = kgsl_ctxt_stats_read,
+};
+
+static int kgsl_cache_stats_print(char *buf, int size, const char *name,
+				  const struct kgsl_cache_stats *stats)
+{
+	return snprintf(buf, size,
+		"%s: batches %u ranges %u merged %u flush_all %u "
+		"outer_ops %u bytes %llu\n", name, stats->batches,
+		stats->ranges, stats->merged, stats->flush_all,
+		stats->outer_ops, stats->bytes);
+}
+
+static ssize_t kgsl_cache_stats_read(
+	struct file *file,
+	char __user *buff,
+	size_t buff_count,
+	loff_t *ppos)
+{
+	struct kgsl_cache_stats total, frame;
+	char buf[256];
+	int len;
+
+	kgsl_cache_get_stats(&total, &frame);
+	len = kgsl_cache_stats_print(buf, sizeof(buf), "last_submit", &frame);
+	len += kgsl_cache_stats_print(buf + len, sizeof(buf) - len, "total",
+				      &total);
+
+	return simple_read_from_buffer(buff, buff_count, ppos, buf, len);
+}
+
+static const struct file_operations kgsl_cache_stats_fops = {
+	.open = kgsl_dbgfs_open,
+	.release = kgsl_dbgfs_release,
+	.read = kgsl_cache_stats_read,
+};
+
+static ssize_t kgsl_mmu_stats_read(
+	struct file *file,
+	char __user *buff,
+	size_t buff_count,
+	loff_t *ppos)
+{
+	struct kgsl_mmu_stats stats;
+	char buf[512];
+	int len;
+
+	kgsl_mmu_get_stats(&stats);
+
+	len = snprintf(buf, sizeof(buf),
+		"maps: %u\nlargepage_maps: %u\nflush_maps: %u\n"
+		"map_us: %llu\nmap_max_us: %u\nunmaps: %u\n"
+		"unmap_us: %llu\nunmap_max_us: %u\n"
+		"pt_entries: %d\npt_used: %d\npt_grows: %d\n",
+		stats.maps, stats.largepage_maps, stats.flush_maps,
+		stats.map_us, stats.map_max_us, stats.unmaps,
+		stats.unmap_us, stats.unmap_max_us,
+		stats.pt_entries, stats.pt_used, stats.pt_grows);
+
+	return simple_read_from_buffer(buff, buff_count, ppos, buf, len);
+}
+
+static const struct file_operations kgsl_mmu_stats_fops = {
+	.open = kgsl_dbgfs_open,
+	.release = kgsl_dbgfs_release,
+	.read = kgsl_mmu_stats_read,
+};
+
 #endif /* CONFIG_DEBUG_FS */
 
 int kgsl_debug_init(void)
@@ -496,6 +592,12 @@ int kgsl_debug_init(void)
 	debugfs_create_file("sx_debug", 0400, dent, 0, &kgsl_sx_debug_fops);
 	debugfs_create_file("cp_debug", 0400, dent, 0, &kgsl_cp_debug_fops);
 	debugfs_create_file("mh_debug", 0400, dent, 0, &kgsl_mh_debug_fops);
+	debugfs_create_file("ctxt_stats", 0400, dent, 0,
+				&kgsl_ctxt_stats_fops);
+	debugfs_create_file("cache_stats", 0400, dent, 0,
+				&kgsl_cache_stats_fops);
+	debugfs_create_file("mmu_stats", 0400, dent, 0,
+				&kgsl_mmu_stats_fops);
 
 #ifdef CONFIG_MSM_KGSL_MMU
 	debugfs_create_file("cache_enable", 0644, dent, 0,
@@ -22,6 +22,10 @@
 #include <linux/slab.h>
 #include <linux/io.h>
 #include <linux/bitmap.h>
+#include <linux/dma-mapping.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <asm/sizes.h>
 #ifdef CONFIG_MSM_KGSL_MMU
 #include <asm/pgalloc.h>
 #include <asm/pgtable.h>
@@ -93,6 +97,9 @@ static const struct kgsl_mmu_reg mmu_reg[KGSL_DEVICE_MAX] = {
 	}
 };
 
+static DEFINE_SPINLOCK(kgsl_mmu_stats_lock);
+static struct kgsl_mmu_stats kgsl_mmu_stats;
+
 static inline uint32_t
 kgsl_pt_entry_get(struct kgsl_pagetable *pt, uint32_t va)
 {
@@ -144,35 +151,119 @@ void kgsl_mh_intrcallback(struct kgsl_device *device)
 	KGSL_MEM_VDBG("return\n");
 }
 
+/* Add a chunk of count zeroed pagetables to the pool.  This may sleep. */
+int kgsl_ptpool_add(int count)
+{
+	struct kgsl_ptpool_chunk *chunk;
+	unsigned long flags;
+
+	chunk = kzalloc(sizeof(*chunk), GFP_KERNEL);
+	if (chunk == NULL)
+		return -ENOMEM;
+
+	chunk->count = count;
+	chunk->size = count * kgsl_driver.ptsize;
+
+	chunk->bitmap = kzalloc(BITS_TO_LONGS(count) * sizeof(unsigned long),
+				GFP_KERNEL);
+	if (chunk->bitmap == NULL)
+		goto err_chunk;
+
+	chunk->hostptr = dma_alloc_coherent(NULL, chunk->size,
+					    &chunk->physaddr, GFP_KERNEL);
+	if (chunk->hostptr == NULL)
+		goto err_bitmap;
+
+	/* Clear the memory now - this saves us having to do
+	   it as page tables are allocated */
+
+	memset(chunk->hostptr, 0, chunk->size);
+
+	spin_lock_irqsave(&kgsl_driver.ptpool.lock, flags);
+	list_add_tail(&chunk->list, &kgsl_driver.ptpool.chunks);
+	kgsl_driver.ptpool.entries += count;
+	spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
+
+	return 0;
+
+err_bitmap:
+	kfree(chunk->bitmap);
+err_chunk:
+	kfree(chunk);
+	return -ENOMEM;
+}
+
+/* Number of pagetables to grow the pool by, 0 once it is at its limit */
+static int kgsl_ptpool_grow_count(void)
+{
+	int count = max_t(int, KGSL_PTPOOL_GROW_SIZE / kgsl_driver.ptsize, 1);
+	int limit = KGSL_PTPOOL_MAX_SIZE / kgsl_driver.ptsize;
+
+	return min(count, limit - kgsl_driver.ptpool.entries);
+}
+
+/* Top the pool up ahead of demand so that creating a pagetable does not
+   have to wait for a large coherent allocation */
+void kgsl_ptpool_grow(struct work_struct *work)
+{
+	int count;
+
+	mutex_lock(&kgsl_driver.pt_mutex);
+
+	if (kgsl_driver.ptpool.entries - kgsl_driver.ptpool.used <
+	    KGSL_PTPOOL_LOW_WATER) {
+		count = kgsl_ptpool_grow_count();
+		if (count > 0 && kgsl_ptpool_add(count) == 0)
+			kgsl_driver.ptpool.grows++;
+	}
+
+	mutex_unlock(&kgsl_driver.pt_mutex);
+}
+
+/* Call with kgsl_driver.pt_mutex held */
 static int
 kgsl_ptpool_get(struct kgsl_memdesc *memdesc)
 {
-	int pt;
+	struct kgsl_ptpool_chunk *chunk;
+	int pt, count, avail;
 	unsigned long flags;
+	bool grown = false;
 
+again:
 	spin_lock_irqsave(&kgsl_driver.ptpool.lock, flags);
 
-	pt = find_next_zero_bit(kgsl_driver.ptpool.bitmap,
-				kgsl_driver.ptpool.entries, 0);
+	list_for_each_entry(chunk, &kgsl_driver.ptpool.chunks, list) {
+		pt = find_first_zero_bit(chunk->bitmap, chunk->count);
+		if (pt < chunk->count)
+			goto found;
+	}
 
-	if (pt >= kgsl_driver.ptpool.entries) {
-		spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
+	spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
+
+	/* The background grow did not keep up, do it here */
+	count = kgsl_ptpool_grow_count();
+	if (grown || count <= 0 || kgsl_ptpool_add(count))
 		return -ENOMEM;
-	}
 
-	set_bit(pt, kgsl_driver.ptpool.bitmap);
+	kgsl_driver.ptpool.grows++;
+	grown = true;
+	goto again;
 
-	spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
+found:
+	set_bit(pt, chunk->bitmap);
+	kgsl_driver.ptpool.used++;
+	avail = kgsl_driver.ptpool.entries - kgsl_driver.ptpool.used;
 
-	/* The memory is zeroed at init time and when page tables are
-	   freed.0 This saves us from having to do the memset here */
+	spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
 
-	memdesc->hostptr = kgsl_driver.ptpool.hostptr +
-		(pt * kgsl_driver.ptsize);
+	if (avail < KGSL_PTPOOL_LOW_WATER)
+		schedule_work(&kgsl_driver.ptpool.grow_ws);
 
-	memdesc->physaddr = kgsl_driver.ptpool.physaddr +
-		(pt * kgsl_driver.ptsize);
+	/* The memory is zeroed when chunks are added and when page tables
+	   are freed. This saves us from having to do the memset here */
 
+	memdesc->hostptr = chunk->hostptr + (pt * kgsl_driver.ptsize);
+	memdesc->physaddr = chunk->physaddr + (pt * kgsl_driver.ptsize);
 	memdesc->size = kgsl_driver.ptsize;
 
 	return 0;
@@ -181,22 +272,31 @@ kgsl_ptpool_get(struct kgsl_memdesc *memdesc)
 static void
 kgsl_ptpool_put(struct kgsl_memdesc *memdesc)
 {
-	int pt;
+	struct kgsl_ptpool_chunk *chunk;
 	unsigned long flags;
+	int pt;
 
 	if (memdesc->hostptr == NULL)
 		return;
 
-	pt = (memdesc->hostptr - kgsl_driver.ptpool.hostptr)
-		/ kgsl_driver.ptsize;
-
 	/* Clear the memory now to avoid having to do it next time
 	   these entries are allocated */
 
 	memset(memdesc->hostptr, 0, memdesc->size);
 
 	spin_lock_irqsave(&kgsl_driver.ptpool.lock, flags);
-	clear_bit(pt, kgsl_driver.ptpool.bitmap);
+
+	list_for_each_entry(chunk, &kgsl_driver.ptpool.chunks, list) {
+		if (memdesc->hostptr >= chunk->hostptr &&
+		    memdesc->hostptr < chunk->hostptr + chunk->size) {
+			pt = (memdesc->hostptr - chunk->hostptr)
+				/ kgsl_driver.ptsize;
+			clear_bit(pt, chunk->bitmap);
+			kgsl_driver.ptpool.used--;
+			break;
+		}
+	}
+
 	spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
 }
 
@@ -561,6 +661,31 @@ unsigned int kgsl_virtaddr_to_physaddr(unsigned int virtaddr)
 	return physaddr;
 }
 
+/* Reserve range bytes of gpu address space aligned to alignbytes.  The
+ * pool only hands out page aligned blocks, so over-allocate and give back
+ * the slack on either side. */
+static unsigned int
+kgsl_mmu_alloc_gpuaddr(struct kgsl_pagetable *pagetable, int range,
+		       unsigned int alignbytes)
+{
+	unsigned int addr, gpuaddr, alloc_size;
+
+	alloc_size = range + alignbytes - KGSL_PAGESIZE;
+
+	addr = gen_pool_alloc(pagetable->pool, alloc_size);
+	if (addr == 0)
+		return 0;
+
+	gpuaddr = ALIGN(addr, alignbytes);
+	if (gpuaddr != addr)
+		gen_pool_free(pagetable->pool, addr, gpuaddr - addr);
+	if (gpuaddr + range != addr + alloc_size)
+		gen_pool_free(pagetable->pool, gpuaddr + range,
+			      addr + alloc_size - (gpuaddr + range));
+
+	return gpuaddr;
+}
+
 int
 kgsl_mmu_map(struct kgsl_pagetable *pagetable,
 				unsigned int address,
@@ -571,8 +696,11 @@ kgsl_mmu_map(struct kgsl_pagetable *pagetable,
 {
 	int numpages;
 	unsigned int pte, ptefirst, ptelast, physaddr;
-	int flushtlb, alloc_size;
+	int flushtlb, largepage = 0;
 	unsigned int align = flags & KGSL_MEMFLAGS_ALIGN_MASK;
+	unsigned int alignbytes;
+	unsigned int elapsed;
+	ktime_t start = ktime_get();
 
 	KGSL_MEM_VDBG("enter (pt=%p, physaddr=%08x, range=%08d, gpuaddr=%p)\n",
 		      pagetable, address, range, gpuaddr);
@@ -581,8 +709,8 @@ kgsl_mmu_map(struct kgsl_pagetable *pagetable,
 	BUG_ON(protflags == 0);
 	BUG_ON(range <= 0);
 
-	/* Only support 4K and 8K alignment for now */
-	if (align != KGSL_MEMFLAGS_ALIGN8K && align != KGSL_MEMFLAGS_ALIGN4K) {
+	/* Only support 4K to 64K alignment for now */
+	if (align < KGSL_MEMFLAGS_ALIGN4K || align > KGSL_MEMFLAGS_ALIGN64K) {
 		KGSL_MEM_ERR("Cannot map memory according to "
 			     "requested flags: %08x\n", flags);
 		return -EINVAL;
@@ -595,28 +723,30 @@ kgsl_mmu_map(struct kgsl_pagetable *pagetable,
 			     address, range);
 		return -EINVAL;
 	}
-	alloc_size = range;
-	if (align == KGSL_MEMFLAGS_ALIGN8K)
-		alloc_size += KGSL_PAGESIZE;
+	alignbytes = 1 << (align >> KGSL_MEMFLAGS_ALIGN_SHIFT);
+
+	/* The MMU only has 4K ptes, but it fetches them a superpte at a
+	 * time.  Placing large contiguous buffers on a superpte boundary
+	 * keeps them from sharing a superpte with another mapping, so
+	 * mapping them into clean superptes needs no tlb flush. */
+	if ((flags & KGSL_MEMFLAGS_CONPHYS) &&
+	    range >= KGSL_MMU_LARGEPAGE_SIZE &&
+	    alignbytes < KGSL_MMU_LARGEPAGE_SIZE) {
+		*gpuaddr = kgsl_mmu_alloc_gpuaddr(pagetable, range,
+						  KGSL_MMU_LARGEPAGE_SIZE);
+		largepage = (*gpuaddr != 0);
+	}
 
-	*gpuaddr = gen_pool_alloc(pagetable->pool, alloc_size);
+	if (!largepage)
+		*gpuaddr = kgsl_mmu_alloc_gpuaddr(pagetable, range,
+						  alignbytes);
 	if (*gpuaddr == 0) {
 		KGSL_MEM_ERR("gen_pool_alloc pid=%d proc=%s\n",
 			current->pid, current->comm);
-		KGSL_MEM_ERR("gen_pool_alloc failed: %d\n", alloc_size);
+		KGSL_MEM_ERR("gen_pool_alloc failed: %d\n", range);
 		return -ENOMEM;
 	}
 
-	if (align == KGSL_MEMFLAGS_ALIGN8K) {
-		if (*gpuaddr & ((1 << 13) - 1)) {
-			/* Not 8k aligned, align it */
-			gen_pool_free(pagetable->pool, *gpuaddr, KGSL_PAGESIZE);
-			*gpuaddr = *gpuaddr + KGSL_PAGESIZE;
-		} else
-			gen_pool_free(pagetable->pool, *gpuaddr + range,
-				      KGSL_PAGESIZE);
-	}
-
 	numpages = (range >> KGSL_PAGESIZE_SHIFT);
 
 	ptefirst = kgsl_pt_entry_get(pagetable, *gpuaddr);
@@ -628,7 +758,7 @@ kgsl_mmu_map(struct kgsl_pagetable *pagetable,
 	/* tlb needs to be flushed when the first and last pte are not at
 	* superpte boundaries */
 	if ((ptefirst & (GSL_PT_SUPER_PTE - 1)) != 0 ||
-		((ptelast + 1) & (GSL_PT_SUPER_PTE-1)) != 0)
+		(ptelast & (GSL_PT_SUPER_PTE - 1)) != 0)
 		flushtlb = 1;
 
 	spin_lock(&pagetable->lock);
@@ -682,6 +812,15 @@ kgsl_mmu_map(struct kgsl_pagetable *pagetable,
 	}
 	spin_unlock(&pagetable->lock);
 
+	elapsed = (unsigned int) ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&kgsl_mmu_stats_lock);
+	kgsl_mmu_stats.maps++;
+	kgsl_mmu_stats.largepage_maps += largepage;
+	kgsl_mmu_stats.flush_maps += flushtlb;
+	kgsl_mmu_stats.map_us += elapsed;
+	kgsl_mmu_stats.map_max_us = max(kgsl_mmu_stats.map_max_us, elapsed);
+	spin_unlock(&kgsl_mmu_stats_lock);
 
 	KGSL_MEM_VDBG("return %d\n", 0);
 
@@ -694,6 +833,8 @@ kgsl_mmu_unmap(struct kgsl_pagetable *pagetable, unsigned int gpuaddr,
 {
 	unsigned int numpages;
 	unsigned int pte, ptefirst, ptelast, superpte;
+	unsigned int elapsed;
+	ktime_t start = ktime_get();
 
 	KGSL_MEM_VDBG("enter (pt=%p, gpuaddr=0x%08x, range=%d)\n",
 			pagetable, gpuaddr, range);
@@ -733,12 +874,36 @@ kgsl_mmu_unmap(struct kgsl_pagetable *pagetable, unsigned int gpuaddr,
 
 	gen_pool_free(pagetable->pool, gpuaddr, range);
 
+	elapsed = (unsigned int) ktime_us_delta(ktime_get(), start);
+
+	spin_lock(&kgsl_mmu_stats_lock);
+	kgsl_mmu_stats.unmaps++;
+	kgsl_mmu_stats.unmap_us += elapsed;
+	kgsl_mmu_stats.unmap_max_us = max(kgsl_mmu_stats.unmap_max_us,
+					  elapsed);
+	spin_unlock(&kgsl_mmu_stats_lock);
+
 	KGSL_MEM_VDBG("return %d\n", 0);
 
 	return 0;
 }
 #endif /*CONFIG_MSM_KGSL_MMU*/
 
+void kgsl_mmu_get_stats(struct kgsl_mmu_stats *stats)
+{
+	unsigned long flags;
+
+	spin_lock(&kgsl_mmu_stats_lock);
+	*stats = kgsl_mmu_stats;
+	spin_unlock(&kgsl_mmu_stats_lock);
+
+	spin_lock_irqsave(&kgsl_driver.ptpool.lock, flags);
+	stats->pt_entries = kgsl_driver.ptpool.entries;
+	stats->pt_used = kgsl_driver.ptpool.used;
+	stats->pt_grows = kgsl_driver.ptpool.grows;
+	spin_unlock_irqrestore(&kgsl_driver.ptpool.lock, flags);
+}
+
 int kgsl_mmu_map_global(struct kgsl_pagetable *pagetable,
 			struct kgsl_memdesc *memdesc, unsigned int protflags,
 			unsigned int flags)
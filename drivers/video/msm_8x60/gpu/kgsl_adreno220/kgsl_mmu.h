@@ -39,6 +39,9 @@
 #define KGSL_MMU_GLOBAL_PT 0
 
 #define GSL_PT_SUPER_PTE 8
+/* Physically contiguous buffers of at least this size are given gpu
+ * addresses aligned to it so that they cover whole superptes */
+#define KGSL_MMU_LARGEPAGE_SIZE	(KGSL_PAGESIZE * GSL_PT_SUPER_PTE * 2)
 #define GSL_PT_PAGE_WV		0x00000001
 #define GSL_PT_PAGE_RV		0x00000002
 #define GSL_PT_PAGE_DIRTY	0x00000004
@@ -67,6 +70,7 @@ extern unsigned int kgsl_cache_enable;
 #endif
 
 struct kgsl_device;
+struct work_struct;
 
 struct kgsl_ptstats {
 	int64_t  maps;
@@ -77,6 +81,21 @@ struct kgsl_ptstats {
 	int64_t  tlbflushes[KGSL_DEVICE_MAX];
 };
 
+struct kgsl_mmu_stats {
+	unsigned int maps;
+	unsigned int largepage_maps;	/* maps placed on superpte bounds */
+	unsigned int flush_maps;	/* maps that forced a tlb flush */
+	unsigned int unmaps;
+	unsigned long long map_us;	/* total time spent in map */
+	unsigned int map_max_us;
+	unsigned long long unmap_us;
+	unsigned int unmap_max_us;
+	/* pagetable pool */
+	int pt_entries;
+	int pt_used;
+	int pt_grows;
+};
+
 struct kgsl_tlbflushfilter {
 	unsigned int *base;
 	unsigned int size;
@@ -205,4 +224,10 @@ int kgsl_mmu_querystats(struct kgsl_pagetable *pagetable,
 
 void kgsl_mh_intrcallback(struct kgsl_device *device);
 
+int kgsl_ptpool_add(int count);
+
+void kgsl_ptpool_grow(struct work_struct *work);
+
+void kgsl_mmu_get_stats(struct kgsl_mmu_stats *stats);
+
 #endif /* __GSL_MMU_H */
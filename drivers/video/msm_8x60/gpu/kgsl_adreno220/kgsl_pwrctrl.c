@@ -18,6 +18,7 @@
 #include <linux/interrupt.h>
 #include <linux/err.h>
 #include <linux/sched.h>
+#include <linux/math64.h>
 #include <mach/clk.h>
 #include <mach/dal_axi.h>
 #include <mach/msm_bus.h>
@@ -25,6 +26,13 @@
 #include "kgsl.h"
 #include "kgsl_log.h"
 
+/* the governor looks at the load once per window */
+#define KGSL_DCVS_WINDOW_US	100000
+/* above this, jump straight to the fastest level */
+#define KGSL_DCVS_UP_LOAD	90
+/* below this, step down one level */
+#define KGSL_DCVS_DOWN_LOAD	50
+
 static int kgsl_pwrctrl_fraction_store(struct device *dev,
 				     struct device_attribute *attr,
 				     const char *buf, size_t count)
@@ -65,18 +73,212 @@ static struct device_attribute pwrio_fraction_attr = {
 	.store = kgsl_pwrctrl_fraction_store,
 };
 
+/* charge the time since the last sample to the busy total and the level */
+static void kgsl_dcvs_account(struct kgsl_pwrctrl *pwr)
+{
+	ktime_t now = ktime_get();
+	s64 delta = ktime_us_delta(now, pwr->dcvs.last_sample);
+
+	if (pwr->power_flags & KGSL_PWRFLAGS_CLK_ON)
+		pwr->dcvs.busy_us += delta;
+	pwr->dcvs.level_us[pwr->active_level] += delta;
+	pwr->dcvs.last_sample = now;
+}
+
+/* Caller must hold the device mutex. */
+static void kgsl_pwrctrl_set_level(struct kgsl_device *device,
+				   unsigned int level)
+{
+	struct kgsl_pwrctrl *pwr = &device->pwrctrl;
+
+	if (level == pwr->active_level)
+		return;
+
+	kgsl_dcvs_account(pwr);
+	pwr->active_level = level;
+	pwr->dcvs.transitions++;
+
+	/* while off, the new level is applied by the next CLK/AXI_ON */
+	if (pwr->power_flags & KGSL_PWRFLAGS_CLK_ON)
+		clk_set_rate(pwr->grp_src_clk, pwr->levels[level].gpu_freq);
+	if (pwr->power_flags & KGSL_PWRFLAGS_AXI_ON && pwr->pcl)
+		msm_bus_scale_client_update_request(pwr->pcl,
+					pwr->levels[level].bus_index);
+
+	KGSL_DRV_DBG("dcvs: level %u, %u Hz, bus %u, load %u%%\n", level,
+		     pwr->levels[level].gpu_freq, pwr->levels[level].bus_index,
+		     pwr->dcvs.last_load);
+}
+
+/*
+ * The GPU naps as soon as it goes idle, so the time its core clock is on
+ * is its busy time. Once a window has passed, jump to the fastest level
+ * if it was nearly saturated, or step down one if it was mostly idle.
+ * Caller must hold the device mutex.
+ */
+static void kgsl_pwrctrl_dcvs(struct kgsl_device *device)
+{
+	struct kgsl_pwrctrl *pwr = &device->pwrctrl;
+	struct kgsl_dcvs_stats *dcvs = &pwr->dcvs;
+	s64 window;
+
+	if (pwr->num_levels == 0)
+		return;
+
+	kgsl_dcvs_account(pwr);
+	window = ktime_us_delta(dcvs->last_sample, dcvs->window_start);
+	if (window < KGSL_DCVS_WINDOW_US)
+		return;
+
+	dcvs->last_load = div64_u64(dcvs->busy_us * 100, window);
+	dcvs->busy_us = 0;
+	dcvs->window_start = dcvs->last_sample;
+
+	if (!pwr->dcvs_enabled)
+		return;
+
+	if (dcvs->last_load >= KGSL_DCVS_UP_LOAD)
+		kgsl_pwrctrl_set_level(device, 0);
+	else if (dcvs->last_load < KGSL_DCVS_DOWN_LOAD &&
+		 pwr->active_level + 1 < pwr->num_levels)
+		kgsl_pwrctrl_set_level(device, pwr->active_level + 1);
+}
+
+static int kgsl_pwrctrl_dcvs_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	unsigned long val;
+	char temp[20];
+	struct kgsl_device *device = kgsl_device_from_dev(dev);
+	struct kgsl_pwrctrl *pwr = &device->pwrctrl;
+
+	snprintf(temp, sizeof(temp), "%.*s",
+			 (int)min(count, sizeof(temp) - 1), buf);
+	if (strict_strtoul(temp, 0, &val))
+		return -EINVAL;
+
+	mutex_lock(&device->mutex);
+	pwr->dcvs_enabled = val && pwr->num_levels > 1;
+	/* with the governor off the GPU runs flat out, as it used to */
+	if (!pwr->dcvs_enabled && pwr->num_levels)
+		kgsl_pwrctrl_set_level(device, 0);
+	mutex_unlock(&device->mutex);
+
+	return count;
+}
+
+static int kgsl_pwrctrl_dcvs_show(struct device *dev,
+				  struct device_attribute *attr,
+				  char *buf)
+{
+	struct kgsl_device *device = kgsl_device_from_dev(dev);
+	return sprintf(buf, "%d\n", device->pwrctrl.dcvs_enabled);
+}
+
+static struct device_attribute dcvs_attr = {
+	.attr = { .name = "dcvs", .mode = 0644, },
+	.show = kgsl_pwrctrl_dcvs_show,
+	.store = kgsl_pwrctrl_dcvs_store,
+};
+
+static int kgsl_pwrctrl_dcvs_stats_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	struct kgsl_device *device = kgsl_device_from_dev(dev);
+	struct kgsl_pwrctrl *pwr = &device->pwrctrl;
+	unsigned int i;
+	int len = 0;
+
+	mutex_lock(&device->mutex);
+	if (pwr->num_levels)
+		kgsl_dcvs_account(pwr);
+	for (i = 0; i < pwr->num_levels; i++)
+		len += snprintf(buf + len, PAGE_SIZE - len,
+				"%c%u: %u Hz bus %u time %llu ms\n",
+				i == pwr->active_level ? '*' : ' ', i,
+				pwr->levels[i].gpu_freq,
+				pwr->levels[i].bus_index,
+				div_u64(pwr->dcvs.level_us[i], 1000));
+	len += snprintf(buf + len, PAGE_SIZE - len,
+			"load: %u%%\ntransitions: %u\n",
+			pwr->dcvs.last_load, pwr->dcvs.transitions);
+	mutex_unlock(&device->mutex);
+
+	return len;
+}
+
+static struct device_attribute dcvs_stats_attr = {
+	.attr = { .name = "dcvs_stats", .mode = 0444, },
+	.show = kgsl_pwrctrl_dcvs_stats_show,
+};
+
 int kgsl_pwrctrl_init_sysfs(struct kgsl_device *device)
 {
 	int ret = 0;
 	ret = device_create_file(device->dev, &pwrio_fraction_attr);
+	if (ret == 0)
+		ret = device_create_file(device->dev, &dcvs_attr);
+	if (ret == 0)
+		ret = device_create_file(device->dev, &dcvs_stats_attr);
 	return ret;
 }
 
 void kgsl_pwrctrl_uninit_sysfs(struct kgsl_device *device)
 {
+	device_remove_file(device->dev, &dcvs_stats_attr);
+	device_remove_file(device->dev, &dcvs_attr);
 	device_remove_file(device->dev, &pwrio_fraction_attr);
 }
 
+/*
+ * Build the DCVS table from the platform's min and max core clock and its
+ * bus scale usecases: the core clock steps down in quarters of the max
+ * rate to the min rate, and the bus vote steps down one usecase per level
+ * to the lowest non-zero one. Both are clamped at their lowest value, so
+ * the table is as long as the longer of the two ladders.
+ */
+void kgsl_pwrctrl_init_levels(struct kgsl_device *device,
+			      struct msm_bus_scale_pdata *bus_table)
+{
+	struct kgsl_pwrctrl *pwr = &device->pwrctrl;
+	unsigned int max_freq = pwr->clk_freq[KGSL_MAX_FREQ];
+	unsigned int min_freq = pwr->clk_freq[KGSL_MIN_FREQ];
+	unsigned int freqs[KGSL_DCVS_MAX_LEVELS];
+	unsigned int nfreqs = 0, nbus, i;
+	long rate;
+
+	pwr->num_levels = 0;
+	if (max_freq == 0)
+		return;
+
+	for (i = 4; i > 1 && nfreqs < KGSL_DCVS_MAX_LEVELS - 1; i--) {
+		rate = clk_round_rate(pwr->grp_src_clk, max_freq / 4 * i);
+		if (rate <= 0 || rate < min_freq)
+			rate = min_freq;
+		if (nfreqs && rate >= freqs[nfreqs - 1])
+			continue;
+		freqs[nfreqs++] = rate;
+	}
+	if (min_freq && min_freq < freqs[nfreqs - 1])
+		freqs[nfreqs++] = min_freq;
+
+	/* usecase 0 is the "off" vote */
+	nbus = bus_table && bus_table->num_usecases > 1 ?
+		bus_table->num_usecases - 1 : 1;
+
+	for (i = 0; i < max(nfreqs, nbus) && i < KGSL_DCVS_MAX_LEVELS; i++) {
+		pwr->levels[i].gpu_freq = freqs[min(i, nfreqs - 1)];
+		pwr->levels[i].bus_index = bus_table ?
+			nbus - min(i, nbus - 1) : BW_MAX;
+	}
+	pwr->num_levels = i;
+	pwr->active_level = 0;
+	pwr->dcvs_enabled = pwr->num_levels > 1;
+	pwr->dcvs.window_start = pwr->dcvs.last_sample = ktime_get();
+}
+
 int kgsl_pwrctrl_clk(struct kgsl_device *device, unsigned int pwrflag)
 {
 	struct kgsl_pwrctrl *pwr = &device->pwrctrl;
@@ -84,6 +286,8 @@ int kgsl_pwrctrl_clk(struct kgsl_device *device, unsigned int pwrflag)
 	switch (pwrflag) {
 	case KGSL_PWRFLAGS_CLK_OFF:
 		if (pwr->power_flags & KGSL_PWRFLAGS_CLK_ON) {
+			if (pwr->num_levels)
+				kgsl_dcvs_account(pwr);
 			if (pwr->grp_pclk)
 				clk_disable(pwr->grp_pclk);
 			clk_disable(pwr->grp_clk);
@@ -101,7 +305,11 @@ int kgsl_pwrctrl_clk(struct kgsl_device *device, unsigned int pwrflag)
 		return KGSL_SUCCESS;
 	case KGSL_PWRFLAGS_CLK_ON:
 		if (pwr->power_flags & KGSL_PWRFLAGS_CLK_OFF) {
-			if (pwr->clk_freq[KGSL_MAX_FREQ])
+			if (pwr->num_levels) {
+				kgsl_dcvs_account(pwr);
+				clk_set_rate(pwr->grp_src_clk,
+				    pwr->levels[pwr->active_level].gpu_freq);
+			} else if (pwr->clk_freq[KGSL_MAX_FREQ])
 				clk_set_rate(pwr->grp_src_clk,
 					pwr->clk_freq[KGSL_MAX_FREQ]);
 			if (pwr->grp_pclk)
@@ -145,7 +353,9 @@ int kgsl_pwrctrl_axi(struct kgsl_device *device, unsigned int pwrflag)
 				clk_enable(pwr->ebi1_clk);
 			if (pwr->pcl)
 				msm_bus_scale_client_update_request(pwr->pcl,
-								BW_MAX);
+					pwr->num_levels ?
+					pwr->levels[pwr->active_level].bus_index :
+					BW_MAX);
 			pwr->power_flags &=
 				~(KGSL_PWRFLAGS_AXI_OFF);
 			pwr->power_flags |= KGSL_PWRFLAGS_AXI_ON;
@@ -321,6 +531,8 @@ int kgsl_pwrctrl_sleep(struct kgsl_device *device)
 {
 	KGSL_DRV_DBG("kgsl_pwrctrl_sleep device %d!!!\n", device->id);
 
+	kgsl_pwrctrl_dcvs(device);
+
 	/* Work through the legal state transitions */
 	if (device->requested_state == KGSL_STATE_NAP) {
 		if (device->ftbl.device_isidle(device))
@@ -363,7 +575,8 @@ int kgsl_pwrctrl_wake(struct kgsl_device *device)
 	if (device->state == KGSL_STATE_SUSPEND)
 		return status;
 
-	/* Turn on the core clocks */
+	/* Pick the level for the work that woke us, then clock up */
+	kgsl_pwrctrl_dcvs(device);
 	status = kgsl_pwrctrl_clk(device, KGSL_PWRFLAGS_CLK_ON);
 	if (device->state != KGSL_STATE_NAP) {
 		kgsl_pwrctrl_axi(device, KGSL_PWRFLAGS_AXI_ON);
@@ -33,6 +33,7 @@
 #include <linux/wait.h>
 #include <linux/clk.h>
 #include <linux/mutex.h>
+#include <linux/ktime.h>
 #include <mach/clk.h>
 #include <mach/internal_power_rail.h>
 #include <linux/pm_qos_params.h>
@@ -60,6 +61,23 @@ enum kgsl_clk_freq {
 	KGSL_NUM_FREQ = 4
 };
 
+#define KGSL_DCVS_MAX_LEVELS	4
+
+/* one step of the DCVS table, level 0 is the fastest */
+struct kgsl_dcvs_level {
+	unsigned int gpu_freq;
+	unsigned int bus_index;	/* usecase in the bus scale table */
+};
+
+struct kgsl_dcvs_stats {
+	ktime_t window_start;
+	ktime_t last_sample;
+	s64 busy_us;		/* clocks on within the current window */
+	unsigned int last_load;	/* percent busy over the last window */
+	unsigned int transitions;
+	u64 level_us[KGSL_DCVS_MAX_LEVELS];
+};
+
 struct kgsl_pwrctrl {
 	int interrupt_num;
 	int have_irq;
@@ -79,12 +97,21 @@ struct kgsl_pwrctrl {
 	unsigned int io_fraction;
 	unsigned int io_count;
 	struct kgsl_yamato_context *suspended_ctxt;
+	struct kgsl_dcvs_level levels[KGSL_DCVS_MAX_LEVELS];
+	unsigned int num_levels;
+	unsigned int active_level;
+	unsigned int dcvs_enabled;
+	struct kgsl_dcvs_stats dcvs;
 };
 
+struct msm_bus_scale_pdata;
+
 int kgsl_pwrctrl_clk(struct kgsl_device *device, unsigned int pwrflag);
 int kgsl_pwrctrl_axi(struct kgsl_device *device, unsigned int pwrflag);
 int kgsl_pwrctrl_pwrrail(struct kgsl_device *device, unsigned int pwrflag);
 int kgsl_pwrctrl_irq(struct kgsl_device *device, unsigned int pwrflag);
+void kgsl_pwrctrl_init_levels(struct kgsl_device *device,
+			      struct msm_bus_scale_pdata *bus_table);
 void kgsl_pwrctrl_close(struct kgsl_device *device);
 void kgsl_timer(unsigned long data);
 void kgsl_idle_check(struct work_struct *work);
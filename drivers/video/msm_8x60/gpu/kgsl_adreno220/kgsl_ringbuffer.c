@@ -580,6 +580,7 @@ int kgsl_ringbuffer_init(struct kgsl_device *device)
 	KGSL_CMD_VDBG("enter (device=%p)\n", device);
 
 	rb->device = device;
+	INIT_LIST_HEAD(&rb->sched_list);
 	rb->sizedwords = (2 << kgsl_cfg_rb_sizelog2quadwords);
 	rb->blksizequadwords = kgsl_cfg_rb_blksizequadwords;
 
@@ -743,6 +744,98 @@ kgsl_ringbuffer_issuecmds(struct kgsl_device *device,
 	kgsl_ringbuffer_addcmds(rb, flags, cmds, sizedwords);
 }
 
+static int kgsl_ringbuffer_has_budget(struct kgsl_ringbuffer *rb,
+				      struct kgsl_yamato_context *drawctxt,
+				      uint32_t retired)
+{
+	uint32_t oldest = drawctxt->inflight_ts[drawctxt->inflight_next];
+
+	if (drawctxt->inflight < KGSL_CONTEXT_INFLIGHT_MAX)
+		return 1;
+	/* one from before the timestamps were last reset won't retire */
+	return timestamp_cmp(retired, oldest) ||
+		!timestamp_cmp(rb->timestamp, oldest);
+}
+
+/*
+ * Write queued submissions to the ringbuffer for every context that has
+ * fewer than KGSL_CONTEXT_INFLIGHT_MAX timestamps on the CP. The ready
+ * context with the lowest nice value goes first; equal priorities take
+ * turns, one submission at a time, in the order they became ready.
+ * Timestamps are only handed out here, so they still retire in
+ * ringbuffer order. Called with the device mutex held.
+ */
+static void kgsl_ringbuffer_dispatch(struct kgsl_ringbuffer *rb)
+{
+	struct kgsl_device *device = rb->device;
+	struct kgsl_yamato_device *yamato_device = KGSL_YAMATO_DEVICE(device);
+	struct kgsl_yamato_context *drawctxt, *next;
+	struct kgsl_rb_submit *submit;
+	uint32_t retired;
+
+	while (!list_empty(&rb->sched_list)) {
+		if (!(rb->flags & KGSL_FLAGS_STARTED) ||
+		    (device->state & KGSL_STATE_HUNG))
+			break;
+
+		retired = device->ftbl.device_cmdstream_readtimestamp(device,
+						KGSL_TIMESTAMP_RETIRED);
+		next = NULL;
+		list_for_each_entry(drawctxt, &rb->sched_list, sched_node)
+			if (kgsl_ringbuffer_has_budget(rb, drawctxt, retired) &&
+			    (!next || drawctxt->priority < next->priority))
+				next = drawctxt;
+		if (!next)
+			break;
+
+		if (next != list_first_entry(&rb->sched_list,
+					struct kgsl_yamato_context, sched_node))
+			GSL_RB_STATS(rb->stats.overtaken++);
+
+		submit = list_first_entry(&next->submit_queue,
+					struct kgsl_rb_submit, list);
+		list_del(&submit->list);
+		list_del_init(&next->sched_node);
+		if (!list_empty(&next->submit_queue))
+			list_add_tail(&next->sched_node, &rb->sched_list);
+
+		kgsl_setstate(device,
+			      kgsl_pt_get_flags(device->mmu.hwpagetable,
+						device->id));
+
+		kgsl_drawctxt_switch(yamato_device, next, submit->flags);
+
+		submit->timestamp = kgsl_ringbuffer_addcmds(rb, 0,
+					submit->link, submit->sizedwords);
+		submit->status = 0;
+
+		next->inflight_ts[next->inflight_next] = submit->timestamp;
+		next->inflight_next = (next->inflight_next + 1) %
+					KGSL_CONTEXT_INFLIGHT_MAX;
+		if (next->inflight < KGSL_CONTEXT_INFLIGHT_MAX)
+			next->inflight++;
+	}
+}
+
+static void kgsl_ringbuffer_dequeue(struct kgsl_rb_submit *submit, int status)
+{
+	struct kgsl_yamato_context *drawctxt = submit->drawctxt;
+
+	list_del(&submit->list);
+	if (list_empty(&drawctxt->submit_queue))
+		list_del_init(&drawctxt->sched_node);
+	submit->status = status;
+}
+
+void kgsl_ringbuffer_cancel_drawctxt(struct kgsl_ringbuffer *rb,
+				struct kgsl_yamato_context *drawctxt)
+{
+	struct kgsl_rb_submit *submit, *tmp;
+
+	list_for_each_entry_safe(submit, tmp, &drawctxt->submit_queue, list)
+		kgsl_ringbuffer_dequeue(submit, -EINVAL);
+}
+
 int
 kgsl_ringbuffer_issueibcmds(struct kgsl_device_private *dev_priv,
 				struct kgsl_context *context,
@@ -753,10 +846,14 @@ kgsl_ringbuffer_issueibcmds(struct kgsl_device_private *dev_priv,
 {
 	struct kgsl_device *device = dev_priv->device;
 	struct kgsl_yamato_device *yamato_device = KGSL_YAMATO_DEVICE(device);
+	struct kgsl_ringbuffer *rb = &yamato_device->ringbuffer;
 	unsigned int *link;
 	unsigned int *cmds;
 	unsigned int i;
-	struct kgsl_yamato_context *drawctxt = context->devctxt;
+	unsigned int id;
+	struct kgsl_yamato_context *drawctxt;
+	struct kgsl_rb_submit submit;
+	int status;
 
 	KGSL_CMD_VDBG("enter (device_id=%d, ibdesc=0x%08x,"
 			" numibs=%d, timestamp=%p)\n",
@@ -765,7 +862,7 @@ kgsl_ringbuffer_issueibcmds(struct kgsl_device_private *dev_priv,
 
 	if (device->state & KGSL_STATE_HUNG)
 		return -EINVAL;
-	if (!(yamato_device->ringbuffer.flags & KGSL_FLAGS_STARTED) ||
+	if (!(rb->flags & KGSL_FLAGS_STARTED) ||
 	      context == NULL) {
 		KGSL_CMD_VDBG("return %d\n", -EINVAL);
 		return -EINVAL;
@@ -774,6 +871,10 @@ kgsl_ringbuffer_issueibcmds(struct kgsl_device_private *dev_priv,
 	BUG_ON(ibdesc == 0);
 	BUG_ON(numibs == 0);
 
+	/* the context may be destroyed while we sleep below */
+	id = context->id;
+	drawctxt = context->devctxt;
+
 	link = kzalloc(sizeof(unsigned int) * numibs * 3, GFP_KERNEL);
 	cmds = link;
 	if (!link) {
@@ -790,22 +891,65 @@ kgsl_ringbuffer_issueibcmds(struct kgsl_device_private *dev_priv,
 		*cmds++ = ibdesc[i].sizedwords;
 	}
 
-	kgsl_setstate(device,
-		      kgsl_pt_get_flags(device->mmu.hwpagetable,
-					device->id));
+	submit.drawctxt = drawctxt;
+	submit.link = link;
+	submit.sizedwords = cmds - link;
+	submit.flags = flags;
+	submit.status = -EINPROGRESS;
+
+	drawctxt->priority = task_nice(current);
+	list_add_tail(&submit.list, &drawctxt->submit_queue);
+	if (list_empty(&drawctxt->sched_node))
+		list_add_tail(&drawctxt->sched_node, &rb->sched_list);
+	GSL_RB_STATS(rb->stats.submits++);
+
+	kgsl_ringbuffer_dispatch(rb);
+	if (submit.status == -EINPROGRESS)
+		GSL_RB_STATS(rb->stats.deferred++);
+
+	/*
+	 * Our context has too much in flight already. Sleep until the CP
+	 * retires the oldest of it, then run the dispatcher again; whoever
+	 * wakes first writes the highest priority work, which need not be
+	 * ours. That timestamp is already on the ringbuffer, so running out
+	 * of KGSL_RB_DISPATCH_TIMEOUT on it means the CP is stuck, not that
+	 * other contexts kept us waiting.
+	 */
+	while (submit.status == -EINPROGRESS) {
+		if (!(rb->flags & KGSL_FLAGS_STARTED) ||
+		    (device->state & KGSL_STATE_HUNG)) {
+			kgsl_ringbuffer_dequeue(&submit, -EINVAL);
+			break;
+		}
+
+		status = device->ftbl.device_waittimestamp(device,
+				drawctxt->inflight_ts[drawctxt->inflight_next],
+				KGSL_RB_DISPATCH_TIMEOUT);
+		kgsl_check_suspended(device);
+
+		if (submit.status != -EINPROGRESS)
+			break;
+		if (status) {
+			kgsl_ringbuffer_dequeue(&submit, status);
+			break;
+		}
+		kgsl_ringbuffer_dispatch(rb);
+	}
+
+	kfree(link);
 
-	kgsl_drawctxt_switch(yamato_device, drawctxt, flags);
+	if (submit.status) {
+		KGSL_CMD_VDBG("return %d\n", submit.status);
+		return submit.status;
+	}
 
-	*timestamp = kgsl_ringbuffer_addcmds(&yamato_device->ringbuffer,
-					0, &link[0], (cmds - link));
+	*timestamp = submit.timestamp;
 
 	KGSL_CMD_INFO("ctxt %d g %08x numibs %d ts %d\n",
-		context->id, (unsigned int)ibdesc, numibs, *timestamp);
+		id, (unsigned int)ibdesc, numibs, *timestamp);
 
 	KGSL_CMD_VDBG("return %d\n", 0);
 
-	kfree(link);
-
 	return 0;
 }
 
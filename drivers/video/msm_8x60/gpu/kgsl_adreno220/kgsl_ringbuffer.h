@@ -30,6 +30,7 @@
 #define __GSL_RINGBUFFER_H
 #include <linux/msm_kgsl.h>
 #include <linux/mutex.h>
+#include <linux/list.h>
 #include "yamato_reg.h"
 
 #define GSL_STATS_RINGBUFFER
@@ -68,8 +69,27 @@ static const unsigned int kgsl_cfg_rb_blksizequadwords  = GSL_RB_SIZE_16;
 #define	REG_CP_TIMESTAMP		 REG_SCRATCH_REG0
 
 
+/* longest an issuer sleeps on its context's oldest in-flight timestamp */
+#define KGSL_RB_DISPATCH_TIMEOUT	(10 * MSEC_PER_SEC)
+
 struct kgsl_device;
 struct kgsl_device_private;
+struct kgsl_yamato_context;
+
+/*
+ * One issueibcmds call waiting on its context's submit_queue. It lives on
+ * the issuer's stack; status stays -EINPROGRESS until the dispatcher has
+ * written it to the ringbuffer (0, timestamp valid) or it was cancelled.
+ */
+struct kgsl_rb_submit {
+	struct list_head list;
+	struct kgsl_yamato_context *drawctxt;
+	unsigned int *link;
+	unsigned int sizedwords;
+	unsigned int flags;
+	uint32_t timestamp;
+	int status;
+};
 
 #define GSL_RB_MEMPTRS_SCRATCH_COUNT	 8
 struct kgsl_rbmemptrs {
@@ -87,6 +107,9 @@ struct kgsl_rbmemptrs {
 struct kgsl_rbstats {
 	int64_t issues;
 	int64_t words_total;
+	int64_t submits;
+	int64_t deferred;
+	int64_t overtaken;
 };
 #endif /* GSL_STATS_RINGBUFFER */
 
@@ -108,6 +131,9 @@ struct kgsl_ringbuffer {
 	unsigned int rptr; /* read pointer offset in dwords from baseaddr */
 	uint32_t timestamp;
 
+	/* contexts with queued submissions, in the order they became ready */
+	struct list_head sched_list;
+
 #ifdef GSL_STATS_RINGBUFFER
 	struct kgsl_rbstats stats;
 #endif /* GSL_STATS_RINGBUFFER */
@@ -182,6 +208,9 @@ int kgsl_ringbuffer_issueibcmds(struct kgsl_device_private *dev_priv,
 				uint32_t *timestamp,
 				unsigned int flags);
 
+void kgsl_ringbuffer_cancel_drawctxt(struct kgsl_ringbuffer *rb,
+				struct kgsl_yamato_context *drawctxt);
+
 int kgsl_ringbuffer_init(struct kgsl_device *device);
 
 int kgsl_ringbuffer_start(struct kgsl_ringbuffer *rb, unsigned int init_ram);
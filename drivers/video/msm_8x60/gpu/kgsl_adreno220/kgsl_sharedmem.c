@@ -21,6 +21,8 @@
 #include <linux/dma-mapping.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/smp.h>
 #include <asm/cacheflush.h>
 
 #include "kgsl_sharedmem.h"
@@ -29,11 +31,40 @@
 #include "kgsl_log.h"
 #include "kgsl_cffdump.h"
 
+/*
+ * Above this many bytes of L1 clean or flush in one batch it is cheaper to
+ * flush the whole L1 than to walk the ranges line by line.
+ */
+#define KGSL_CACHE_FLUSH_ALL_SIZE	(64 * 1024)
+
+static DEFINE_SPINLOCK(kgsl_cache_stats_lock);
+static struct kgsl_cache_stats kgsl_cache_total;
+/* since the last command submission, and the one before that */
+static struct kgsl_cache_stats kgsl_cache_frame;
+static struct kgsl_cache_stats kgsl_cache_last_frame;
+
 #ifdef CONFIG_OUTER_CACHE
-static void _outer_cache_range_op(unsigned long addr, int size,
-				  unsigned int flags)
+static void _outer_cache_op(unsigned long start, unsigned long end,
+			    unsigned int flags)
+{
+	if (flags & KGSL_MEMFLAGS_CACHE_FLUSH)
+		outer_flush_range(start, end);
+	else if (flags & KGSL_MEMFLAGS_CACHE_CLEAN)
+		outer_clean_range(start, end);
+	else if (flags & KGSL_MEMFLAGS_CACHE_INV)
+		outer_inv_range(start, end);
+}
+
+/*
+ * The L2 is physically tagged, so walk the range page by page but hand it
+ * one operation per physically contiguous run. Returns the number of
+ * operations issued.
+ */
+static int _outer_cache_range_op(unsigned long addr, int size,
+				 unsigned int flags)
 {
-	unsigned long end;
+	unsigned long end, start = 0, next = 0;
+	int ops = 0;
 
 	for (end = addr; end < (addr + size); end += KGSL_PAGESIZE) {
 		unsigned long physaddr = 0;
@@ -48,31 +79,37 @@ static void _outer_cache_range_op(unsigned long addr, int size,
 		if (physaddr == 0) {
 			KGSL_MEM_ERR("Unable to find physaddr for "
 				     "address: %x\n", (unsigned int)end);
-			return;
+			break;
 		}
 
-		if (flags & KGSL_MEMFLAGS_CACHE_FLUSH)
-			outer_flush_range(physaddr, physaddr + KGSL_PAGESIZE);
-		else if (flags & KGSL_MEMFLAGS_CACHE_CLEAN)
-			outer_clean_range(physaddr, physaddr + KGSL_PAGESIZE);
-		else if (flags & KGSL_MEMFLAGS_CACHE_INV)
-			outer_inv_range(physaddr, physaddr + KGSL_PAGESIZE);
+		if (physaddr != next) {
+			if (next) {
+				_outer_cache_op(start, next, flags);
+				ops++;
+			}
+			start = physaddr;
+		}
+		next = physaddr + KGSL_PAGESIZE;
+	}
+	if (next) {
+		_outer_cache_op(start, next, flags);
+		ops++;
 	}
 	mb();
+
+	return ops;
 }
 #else
-static void _outer_cache_range_op(unsigned long addr, int size,
-				  unsigned int flags)
+static int _outer_cache_range_op(unsigned long addr, int size,
+				 unsigned int flags)
 {
+	return 0;
 }
 #endif
 
-void kgsl_cache_range_op(unsigned long addr, int size,
-			 unsigned int flags)
+static void _inner_cache_range_op(unsigned long addr, int size,
+				  unsigned int flags)
 {
-	BUG_ON(addr & (KGSL_PAGESIZE - 1));
-	BUG_ON(size & (KGSL_PAGESIZE - 1));
-
 	if (flags & KGSL_MEMFLAGS_CACHE_FLUSH)
 		dmac_flush_range((const void *)addr,
 				 (const void *)(addr + size));
@@ -82,9 +119,140 @@ void kgsl_cache_range_op(unsigned long addr, int size,
 	else if (flags & KGSL_MEMFLAGS_CACHE_INV)
 		dmac_inv_range((const void *)addr,
 			       (const void *)(addr + size));
+}
+
+static void _inner_cache_flush_all(void *unused)
+{
+	flush_cache_all();
+}
 
-	_outer_cache_range_op(addr, size, flags);
+static void kgsl_cache_stats_add(struct kgsl_cache_stats *sum,
+				 const struct kgsl_cache_stats *batch)
+{
+	sum->batches += batch->batches;
+	sum->ranges += batch->ranges;
+	sum->merged += batch->merged;
+	sum->flush_all += batch->flush_all;
+	sum->outer_ops += batch->outer_ops;
+	sum->bytes += batch->bytes;
+}
+
+static int kgsl_cache_range_cmp(const void *a, const void *b)
+{
+	const struct kgsl_cache_range *ra = a, *rb = b;
+
+	if (ra->addr != rb->addr)
+		return ra->addr < rb->addr ? -1 : 1;
+	return 0;
+}
 
+void kgsl_cache_range_op(unsigned long addr, int size,
+			 unsigned int flags)
+{
+	struct kgsl_cache_range range = {
+		.addr = addr,
+		.size = size,
+		.flags = flags,
+	};
+
+	kgsl_cache_range_op_list(&range, 1, 0);
+}
+
+/*
+ * Flush the whole L1 on every CPU ahead of a batch of bytes worth of clean
+ * or flush ranges, when that is cheaper than walking them. This sends IPIs
+ * and so must be called without spinlocks held. Returns nonzero if the L1
+ * was flushed, in which case the batch only has the L2 left to do.
+ */
+int kgsl_cache_flush_inner_all(unsigned long bytes)
+{
+	if (bytes < KGSL_CACHE_FLUSH_ALL_SIZE)
+		return 0;
+
+	on_each_cpu(_inner_cache_flush_all, NULL, 1);
+	return 1;
+}
+
+/*
+ * Run the cache operation each range's flags ask for over a list of page
+ * aligned ranges. The list is sorted in place, and overlapping or abutting
+ * ranges with the same flags are merged so every page is walked once. If
+ * inner_done is set the caller has already flushed the L1 whole with
+ * kgsl_cache_flush_inner_all and only the L2 is walked. Safe to call with
+ * spinlocks held.
+ */
+void kgsl_cache_range_op_list(struct kgsl_cache_range *ranges, int count,
+			      int inner_done)
+{
+	struct kgsl_cache_stats batch;
+	unsigned long bytes = 0;
+	int i, n;
+
+	if (count <= 0)
+		return;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.batches = 1;
+	batch.ranges = count;
+
+	if (count > 1)
+		sort(ranges, count, sizeof(*ranges), kgsl_cache_range_cmp,
+		     NULL);
+
+	for (i = 0, n = 0; i < count; i++) {
+		struct kgsl_cache_range *r = &ranges[i];
+
+		BUG_ON(r->addr & (KGSL_PAGESIZE - 1));
+		BUG_ON(r->size & (KGSL_PAGESIZE - 1));
+
+		if (n && ranges[n - 1].flags == r->flags &&
+		    r->addr <= ranges[n - 1].addr + ranges[n - 1].size) {
+			struct kgsl_cache_range *prev = &ranges[n - 1];
+			unsigned long end = max(prev->addr + prev->size,
+						r->addr + r->size);
+			bytes += end - (prev->addr + prev->size);
+			prev->size = end - prev->addr;
+			continue;
+		}
+		bytes += r->size;
+		ranges[n++] = *r;
+	}
+	batch.merged = n;
+	batch.bytes = bytes;
+
+	if (inner_done)
+		batch.flush_all = 1;
+	else
+		for (i = 0; i < n; i++)
+			_inner_cache_range_op(ranges[i].addr, ranges[i].size,
+					      ranges[i].flags);
+
+	for (i = 0; i < n; i++)
+		batch.outer_ops += _outer_cache_range_op(ranges[i].addr,
+						ranges[i].size, ranges[i].flags);
+
+	spin_lock(&kgsl_cache_stats_lock);
+	kgsl_cache_stats_add(&kgsl_cache_frame, &batch);
+	kgsl_cache_stats_add(&kgsl_cache_total, &batch);
+	spin_unlock(&kgsl_cache_stats_lock);
+}
+
+/* close the per-submission counters, called once per issueibcmds */
+void kgsl_cache_end_frame(void)
+{
+	spin_lock(&kgsl_cache_stats_lock);
+	kgsl_cache_last_frame = kgsl_cache_frame;
+	memset(&kgsl_cache_frame, 0, sizeof(kgsl_cache_frame));
+	spin_unlock(&kgsl_cache_stats_lock);
+}
+
+void kgsl_cache_get_stats(struct kgsl_cache_stats *total,
+			  struct kgsl_cache_stats *frame)
+{
+	spin_lock(&kgsl_cache_stats_lock);
+	*total = kgsl_cache_total;
+	*frame = kgsl_cache_last_frame;
+	spin_unlock(&kgsl_cache_stats_lock);
 }
 
 int
@@ -119,4 +119,33 @@ int kgsl_sharedmem_set(const struct kgsl_memdesc *memdesc,
 void kgsl_cache_range_op(unsigned long addr, int size,
 			 unsigned int flags);
 
+/* one buffer of a batched cache operation, see kgsl_cache_range_op_list */
+struct kgsl_cache_range {
+	unsigned long addr;
+	int size;
+	unsigned int flags;
+};
+
+/* ranges collected on the stack before a batch is issued */
+#define KGSL_CACHE_BATCH_MAX	32
+
+struct kgsl_cache_stats {
+	unsigned int batches;
+	unsigned int ranges;		/* as passed in */
+	unsigned int merged;		/* after merging neighbours */
+	unsigned int flush_all;		/* batches done with a whole L1 flush */
+	unsigned int outer_ops;		/* L2 range operations issued */
+	unsigned long long bytes;
+};
+
+int kgsl_cache_flush_inner_all(unsigned long bytes);
+
+void kgsl_cache_range_op_list(struct kgsl_cache_range *ranges, int count,
+			      int inner_done);
+
+void kgsl_cache_end_frame(void);
+
+void kgsl_cache_get_stats(struct kgsl_cache_stats *total,
+			  struct kgsl_cache_stats *frame);
+
 #endif /* __GSL_SHAREDMEM_H */
@@ -574,6 +574,7 @@ kgsl_yamato_init_pwrctrl(struct kgsl_device *device)
 
 	device->pwrctrl.pwr_rail = PWR_RAIL_GRP_CLK;
 	device->pwrctrl.interval_timeout = pdata->idle_timeout_3d;
+	kgsl_pwrctrl_init_levels(device, pdata->grp3d_bus_scale_table);
 
 	if (internal_pwr_rail_mode(device->pwrctrl.pwr_rail,
 						PWR_RAIL_CTL_MANUAL)) {
@@ -1201,46 +1202,55 @@ void kgsl_yamato_regwrite_isr(struct kgsl_device *device,
 	_yamato_regwrite(device, offsetwords, value);
 }
 
-static int kgsl_check_interrupt_timestamp(struct kgsl_device *device,
+/* MUST be called with the device mutex held.  Make sure the CP raises
+ * an interrupt once timestamp has retired. */
+static void kgsl_yamato_arm_timestamp(struct kgsl_device *device,
 					unsigned int timestamp)
 {
-	int status;
 	unsigned int ref_ts, enableflag;
 
-	status = kgsl_check_timestamp(device, timestamp);
-	if (!status) {
-		mutex_lock(&device->mutex);
-		kgsl_sharedmem_readl(&device->memstore, &enableflag,
-			KGSL_DEVICE_MEMSTORE_OFFSET(ts_cmp_enable));
-		rmb();
+	kgsl_sharedmem_readl(&device->memstore, &enableflag,
+		KGSL_DEVICE_MEMSTORE_OFFSET(ts_cmp_enable));
+	rmb();
 
-		if (enableflag) {
-			kgsl_sharedmem_readl(&device->memstore, &ref_ts,
-				KGSL_DEVICE_MEMSTORE_OFFSET(ref_wait_ts));
-			rmb();
-			if (timestamp_cmp(ref_ts, timestamp)) {
-				kgsl_sharedmem_writel(&device->memstore,
-				KGSL_DEVICE_MEMSTORE_OFFSET(ref_wait_ts),
-				timestamp);
-				wmb();
-			}
-		} else {
-			unsigned int cmds[2];
-			kgsl_sharedmem_writel(&device->memstore,
-				KGSL_DEVICE_MEMSTORE_OFFSET(ref_wait_ts),
-				timestamp);
-			enableflag = 1;
+	if (enableflag) {
+		kgsl_sharedmem_readl(&device->memstore, &ref_ts,
+			KGSL_DEVICE_MEMSTORE_OFFSET(ref_wait_ts));
+		rmb();
+		if (timestamp_cmp(ref_ts, timestamp)) {
 			kgsl_sharedmem_writel(&device->memstore,
-				KGSL_DEVICE_MEMSTORE_OFFSET(ts_cmp_enable),
-				enableflag);
+			KGSL_DEVICE_MEMSTORE_OFFSET(ref_wait_ts),
+			timestamp);
 			wmb();
-			/* submit a dummy packet so that even if all
-			* commands upto timestamp get executed we will still
-			* get an interrupt */
-			cmds[0] = pm4_type3_packet(PM4_NOP, 1);
-			cmds[1] = 0;
-			kgsl_ringbuffer_issuecmds(device, 0, &cmds[0], 2);
 		}
+	} else {
+		unsigned int cmds[2];
+		kgsl_sharedmem_writel(&device->memstore,
+			KGSL_DEVICE_MEMSTORE_OFFSET(ref_wait_ts),
+			timestamp);
+		enableflag = 1;
+		kgsl_sharedmem_writel(&device->memstore,
+			KGSL_DEVICE_MEMSTORE_OFFSET(ts_cmp_enable),
+			enableflag);
+		wmb();
+		/* submit a dummy packet so that even if all
+		* commands upto timestamp get executed we will still
+		* get an interrupt */
+		cmds[0] = pm4_type3_packet(PM4_NOP, 1);
+		cmds[1] = 0;
+		kgsl_ringbuffer_issuecmds(device, 0, &cmds[0], 2);
+	}
+}
+
+static int kgsl_check_interrupt_timestamp(struct kgsl_device *device,
+					unsigned int timestamp)
+{
+	int status;
+
+	status = kgsl_check_timestamp(device, timestamp);
+	if (!status) {
+		mutex_lock(&device->mutex);
+		kgsl_yamato_arm_timestamp(device, timestamp);
 		mutex_unlock(&device->mutex);
 	}
 
@@ -1364,6 +1374,7 @@ int kgsl_yamato_getfunctable(struct kgsl_functable *ftbl)
 	ftbl->device_getproperty = kgsl_yamato_getproperty;
 	ftbl->device_waittimestamp = kgsl_yamato_waittimestamp;
 	ftbl->device_cmdstream_readtimestamp = kgsl_cmdstream_readtimestamp;
+	ftbl->device_arm_timestamp = kgsl_yamato_arm_timestamp;
 	ftbl->device_issueibcmds = kgsl_ringbuffer_issueibcmds;
 	ftbl->device_drawctxt_create = kgsl_drawctxt_create;
 	ftbl->device_drawctxt_destroy = kgsl_drawctxt_destroy;
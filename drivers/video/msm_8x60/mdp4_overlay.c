@@ -1273,7 +1273,7 @@ void mdp4_mixer_blend_setup(struct mdp4_overlay_pipe *pipe)
 	mdp_pipe_ctrl(MDP_CMD_BLOCK, MDP_BLOCK_POWER_OFF, FALSE);
 }
 
-void mdp4_overlay_reg_flush(struct mdp4_overlay_pipe *pipe, int all)
+static uint32 mdp4_overlay_flush_bits(struct mdp4_overlay_pipe *pipe, int all)
 {
 	uint32 bits = 0;
 
@@ -1296,11 +1296,21 @@ void mdp4_overlay_reg_flush(struct mdp4_overlay_pipe *pipe, int all)
 		}
 	}
 
+	return bits;
+}
+
+static void mdp4_overlay_flush(uint32 bits)
+{
 	mdp_pipe_ctrl(MDP_CMD_BLOCK, MDP_BLOCK_POWER_ON, FALSE);
 	outpdw(MDP_BASE + 0x18000, bits);	/* MDP_OVERLAY_REG_FLUSH */
 	mdp_pipe_ctrl(MDP_CMD_BLOCK, MDP_BLOCK_POWER_OFF, FALSE);
 }
 
+void mdp4_overlay_reg_flush(struct mdp4_overlay_pipe *pipe, int all)
+{
+	mdp4_overlay_flush(mdp4_overlay_flush_bits(pipe, all));
+}
+
 struct mdp4_overlay_pipe *mdp4_overlay_stage_pipe(int mixer, int stage)
 {
 	return ctrl->stage[mixer][stage];
@@ -2151,6 +2161,54 @@ int mdp4_overlay_snapshot(struct msmfb_overlay_data *req, uint32_t phy_addr,
 }
 #endif
 
+/*
+ * point the pipe's source planes at the buffer at addr and load its
+ * fetch, blend and stage registers. Nothing is latched until the next
+ * overlay register flush.
+ */
+static void mdp4_overlay_pipe_program(struct mdp4_overlay_pipe *pipe,
+				ulong addr)
+{
+	pipe->srcp0_addr = addr;
+	pipe->srcp0_ystride = pipe->src_width * pipe->bpp;
+
+	if (pipe->fetch_plane == OVERLAY_PLANE_PSEUDO_PLANAR) {
+		if (pipe->frame_format == MDP4_FRAME_FORMAT_VIDEO_SUPERTILE) {
+			struct tile_desc tile;
+
+			tile_samsung(&tile);
+			pipe->srcp1_addr = addr + tile_mem_size(pipe, &tile);
+		} else
+			pipe->srcp1_addr = addr +
+					pipe->src_width * pipe->src_height;
+
+		pipe->srcp0_ystride = pipe->src_width;
+		pipe->srcp1_ystride = pipe->src_width;
+	} else if (pipe->fetch_plane == OVERLAY_PLANE_PLANAR) {
+		addr += pipe->src_width * pipe->src_height;
+		pipe->srcp1_addr = addr;
+		addr += ((pipe->src_width / 2) * (pipe->src_height / 2));
+		pipe->srcp2_addr = addr;
+		pipe->srcp0_ystride = pipe->src_width;
+		pipe->srcp1_ystride = pipe->src_width / 2;
+		pipe->srcp2_ystride = pipe->src_width / 2;
+	}
+
+#ifdef OVDEBUG
+	printk("%s: sw=%d sh=%d ystride=%d dw=%d dh=%d mixer=%d\n", __func__,
+		pipe->src_w, pipe->src_h, pipe->srcp0_ystride,
+		pipe->dst_w, pipe->dst_h, pipe->mixer_num);
+#endif
+
+	if (pipe->pipe_num >= OVERLAY_PIPE_VG1)
+		mdp4_overlay_vg_setup(pipe);	/* video/graphic pipe */
+	else
+		mdp4_overlay_rgb_setup(pipe);	/* rgb pipe */
+
+	mdp4_mixer_blend_setup(pipe);
+	mdp4_mixer_stage_up(pipe);
+}
+
 int mdp4_overlay_play(struct fb_info *info, struct msmfb_overlay_data *req,
 		struct file **pp_src_file)
 {
@@ -2211,8 +2269,6 @@ int mdp4_overlay_play(struct fb_info *info, struct msmfb_overlay_data *req,
 	*pp_src_file = p_src_file;
 
 	addr = start + img->offset;
-	pipe->srcp0_addr = addr;
-	pipe->srcp0_ystride = pipe->src_width * pipe->bpp;
 
 #ifdef DEBUG_OVERLAY
 	mutex_lock(&snapshot_lock);
@@ -2223,42 +2279,7 @@ int mdp4_overlay_play(struct fb_info *info, struct msmfb_overlay_data *req,
 	mutex_unlock(&snapshot_lock);
 #endif
 
-	if (pipe->fetch_plane == OVERLAY_PLANE_PSEUDO_PLANAR) {
-		if (pipe->frame_format == MDP4_FRAME_FORMAT_VIDEO_SUPERTILE) {
-			struct tile_desc tile;
-
-			tile_samsung(&tile);
-			pipe->srcp1_addr = addr + tile_mem_size(pipe, &tile);
-		} else
-			pipe->srcp1_addr = addr +
-					pipe->src_width * pipe->src_height;
-
-		pipe->srcp0_ystride = pipe->src_width;
-		pipe->srcp1_ystride = pipe->src_width;
-	} else if (pipe->fetch_plane == OVERLAY_PLANE_PLANAR) {
-		addr += pipe->src_width * pipe->src_height;
-		pipe->srcp1_addr = addr;
-		addr += ((pipe->src_width / 2) * (pipe->src_height / 2));
-		pipe->srcp2_addr = addr;
-		pipe->srcp0_ystride = pipe->src_width;
-		pipe->srcp1_ystride = pipe->src_width / 2;
-		pipe->srcp2_ystride = pipe->src_width / 2;
-	}
-
-#ifdef OVDEBUG
-	printk("%s: sw=%d sh=%d ystride=%d dw=%d dh=%d mixer=%d\n", __func__,
-		pipe->src_w, pipe->src_h, pipe->srcp0_ystride,
-		pipe->dst_w, pipe->dst_h, pipe->mixer_num);
-#endif
-
-
-	if (pipe->pipe_num >= OVERLAY_PIPE_VG1)
-		mdp4_overlay_vg_setup(pipe);	/* video/graphic pipe */
-	else
-		mdp4_overlay_rgb_setup(pipe);	/* rgb pipe */
-
-	mdp4_mixer_blend_setup(pipe);
-	mdp4_mixer_stage_up(pipe);
+	mdp4_overlay_pipe_program(pipe, addr);
 
 	if (pipe->mixer_num == MDP4_MIXER1) {
 		ctrl->mixer1_played++;
@@ -2323,6 +2344,230 @@ int mdp4_overlay_play(struct fb_info *info, struct msmfb_overlay_data *req,
 	return 0;
 }
 
+/*
+ * apply a commit entry's mdp_overlay to its pipe, as mdp4_overlay_set
+ * does, with ov_mutex held; nothing reaches the registers until the
+ * commit programs the pipe
+ */
+static int mdp4_overlay_commit_set(struct msm_fb_data_type *mfd,
+		struct mdp4_overlay_pipe *pipe, struct mdp_overlay *req)
+{
+	struct mdp4_overlay_pipe *p;
+	int ret;
+
+	if (req->src.format == MDP_FB_FORMAT)
+		req->src.format = mfd->fb_imgType;
+
+	req->id = pipe->pipe_ndx;	/* never allocates a new pipe */
+	ret = mdp4_overlay_req2pipe(req, pipe->mixer_num, &p, mfd);
+	if (ret < 0) {
+		pr_err("%s: mdp4_overlay_req2pipe, ret=%d\n", __func__, ret);
+		return ret;
+	}
+
+#ifdef CONFIG_FB_MSM_MIPI_DSI
+	if (pipe->mixer_num == MDP4_MIXER0) {
+		if (mfd->blt_mode || req->dst_rect.x || atomic_read(&atv_on)
+			|| req->src_rect.h >= 1080) {
+			mdp4_dsi_blt_dmap_busy_wait(mfd);
+			mdp4_dsi_overlay_blt_start(mfd);
+		}
+	}
+#endif
+
+	pipe->req_data = *req;
+	pipe->flags = req->flags;
+
+	mdp4_stat.overlay_set[pipe->mixer_num]++;
+	perf_level = mdp4_overlay_get_perf_level(req->src.width,
+						req->src.height,
+						req->src.format,
+						req->is_fg);
+	return 0;
+}
+
+/*
+ * mdp4_overlay_commit: play a whole frame of overlay buffers at once.
+ * All pipes and buffers are resolved and any new pipe setup from the
+ * request is applied before a register is touched, so a bad entry
+ * fails the commit without a partial update on screen; the staged
+ * pipes are then programmed and latched with one MDP_OVERLAY_REG_FLUSH
+ * and one vsync wait (or one kickoff for cmd mode panels).
+ */
+int mdp4_overlay_commit(struct fb_info *info, struct msmfb_overlay_commit *req,
+		struct file **pp_src_files)
+{
+	struct msm_fb_data_type *mfd = (struct msm_fb_data_type *)info->par;
+	struct mdp4_overlay_pipe *pipes[MSMFB_OVERLAY_COMMIT_MAX];
+	struct mdp4_overlay_pipe *pipe, *last = NULL;
+	struct mdp4_pipe_desc *pd;
+	ulong start[MSMFB_OVERLAY_COMMIT_MAX];
+	ulong len;
+	uint32 bits = 0;
+	int i, j, mixer = -1, video = 0, played = 0, set = 0, ret = 0;
+
+	if (mfd == NULL)
+		return -ENODEV;
+
+	if (req->count == 0 || req->count > MSMFB_OVERLAY_COMMIT_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < req->count; i++) {
+		pipe = mdp4_overlay_ndx2pipe(req->data[i].id);
+		if (pipe == NULL) {
+			pr_err("%s: req_id=%d Error\n", __func__,
+						req->data[i].id);
+			return -ENODEV;
+		}
+		if (mixer >= 0 && pipe->mixer_num != mixer) {
+			pr_err("%s: pipes on different mixers\n", __func__);
+			return -EINVAL;
+		}
+		for (j = 0; j < i; j++) {
+			if (pipes[j] == pipe)
+				return -EINVAL;
+		}
+		mixer = pipe->mixer_num;
+		pipes[i] = pipe;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		if (pipes[i]->pipe_type != OVERLAY_TYPE_VIDEO)
+			continue;
+		if (atomic_read(&ov_unset))
+			pipes[i] = NULL;	/* skip, as overlay_play does */
+		else
+			video++;
+	}
+
+	if (mfd->esd_fixup)
+		mfd->esd_fixup((uint32_t)mfd);
+
+	if (mutex_lock_interruptible(&mfd->dma->ov_mutex))
+		return -EINTR;
+
+	if (virtualfb3d.is_3d && video)
+		atomic_set(&ov_play, 1);
+
+	for (i = 0; i < req->count; i++) {
+		pipe = pipes[i];
+		if (pipe == NULL)
+			continue;
+
+		pd = &ctrl->ov_pipe[pipe->pipe_num];
+		if (pd->player && pipe != pd->player &&
+				pipe->pipe_type == OVERLAY_TYPE_RGB) {
+			pipes[i] = NULL;	/* kicked out already */
+			continue;
+		}
+
+		len = 0;
+		get_img(&req->data[i].data, info, &start[i], &len,
+						&pp_src_files[i]);
+		if (len == 0) {
+			pr_err("%s: pmem Error\n", __func__);
+			ret = -EINVAL;
+			goto out;
+		}
+		start[i] += req->data[i].data.offset;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		pipe = pipes[i];
+		if (pipe == NULL || !(req->set & (1 << i)))
+			continue;
+
+		ret = mdp4_overlay_commit_set(mfd, pipe, &req->overlay[i]);
+		if (ret < 0)
+			goto out;
+		set++;
+	}
+
+	for (i = 0; i < req->count; i++) {
+		pipe = pipes[i];
+		if (pipe == NULL)
+			continue;
+
+		ctrl->ov_pipe[pipe->pipe_num].player = pipe;
+		mdp4_overlay_pipe_program(pipe, start[i]);
+		bits |= mdp4_overlay_flush_bits(pipe, 1);
+		last = pipe;
+		played++;
+	}
+
+	if (last == NULL)
+		goto out;
+
+	if (mixer == MDP4_MIXER1) {
+		ctrl->mixer1_played++;
+		/* enternal interface */
+		if (ctrl->panel_mode & MDP4_PANEL_DTV) {
+#ifdef CONFIG_FB_MSM_DTV
+			/*
+			 * ov_done_push flushes the pipe it is given, mixer
+			 * bit included, so only the other pipes' bits are
+			 * left to write here
+			 */
+			bits &= ~mdp4_overlay_flush_bits(last, 1);
+			if (bits)
+				mdp4_overlay_flush(bits);
+			mdp4_overlay_dtv_ov_done_push(mfd, last);
+#else
+			mdp4_overlay_flush(bits);
+#endif
+		} else if (ctrl->panel_mode & MDP4_PANEL_ATV)
+			mdp4_overlay_flush(bits);
+	} else {
+		/* primary interface */
+		ctrl->mixer0_played++;
+		if (ctrl->panel_mode & MDP4_PANEL_LCDC) {
+			mdp4_overlay_flush(bits);
+			if (!(req->flags & MDP_OV_PLAY_NOWAIT))
+				mdp4_overlay_lcdc_wait4vsync(mfd);
+		} else if (ctrl->panel_mode & MDP4_PANEL_DSI_VIDEO) {
+			mdp4_overlay_flush(bits);
+		} else if (!(req->flags & MDP_OV_PLAY_NOWAIT)) {
+			/* mddi & mipi dsi cmd mode, one kickoff per frame */
+#ifdef CONFIG_FB_MSM_MIPI_DSI
+			if (ctrl->panel_mode & MDP4_PANEL_DSI_CMD) {
+				if (mfd->panel_power_on) {
+					mdp4_dsi_cmd_dma_busy_wait(mfd, last);
+					mdp4_dsi_cmd_kickoff_video(mfd, last);
+				}
+			}
+#else
+			if (ctrl->panel_mode & MDP4_PANEL_MDDI) {
+				if (mfd->panel_power_on) {
+					mdp4_mddi_dma_busy_wait(mfd, last);
+					mdp4_mddi_kickoff_video(mfd, last);
+				}
+			}
+#endif
+		}
+	}
+
+	mdp4_stat.overlay_play[mixer] += played;
+
+out:
+	if (virtualfb3d.is_3d && video)
+		atomic_set(&ov_play, 0);
+	mutex_unlock(&mfd->dma->ov_mutex);
+
+	if (atomic_read(&ov_unset))
+		complete(&ov_comp);
+
+	if (set) {
+		mdp_set_core_clk(perf_level);
+#ifdef CONFIG_MSM_BUS_SCALING
+		if (mixer == MDP4_MIXER0)
+			mdp_bus_scale_update_request(
+				OVERLAY_BUS_SCALE_TABLE_BASE - perf_level);
+#endif
+	}
+
+	return ret;
+}
+
 /*---------------------------------------------------------------------------*/
 #ifdef DEBUG_OVERLAY
 static char     debug_buf[2048];
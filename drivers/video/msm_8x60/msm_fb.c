@@ -2566,6 +2566,38 @@ static int msmfb_overlay_play(struct fb_info *info, unsigned long *argp)
 	return ret;
 }
 
+static int msmfb_overlay_commit(struct fb_info *info, unsigned long *argp)
+{
+	int	ret;
+#ifdef CONFIG_ANDROID_PMEM
+	int	i;
+#endif
+	struct msmfb_overlay_commit req;
+	struct msm_fb_data_type *mfd = (struct msm_fb_data_type *)info->par;
+	struct file *p_src_files[MSMFB_OVERLAY_COMMIT_MAX] = { 0 };
+
+	if (mfd->overlay_play_enable == 0)	/* nothing to do */
+		return 0;
+
+	ret = copy_from_user(&req, argp, sizeof(req));
+	if (ret) {
+		printk(KERN_ERR "%s:msmfb_overlay_commit ioctl failed\n",
+			__func__);
+		return -EFAULT;
+	}
+
+	ret = mdp4_overlay_commit(info, &req, p_src_files);
+
+#ifdef CONFIG_ANDROID_PMEM
+	for (i = 0; i < MSMFB_OVERLAY_COMMIT_MAX; i++) {
+		if (p_src_files[i])
+			put_pmem_file(p_src_files[i]);
+	}
+#endif
+
+	return ret;
+}
+
 static int msmfb_overlay_play_enable(struct fb_info *info, unsigned long *argp)
 {
 	int	ret, enable;
@@ -2719,6 +2751,11 @@ static int msm_fb_ioctl(struct fb_info *info, unsigned int cmd,
 		ret = msmfb_overlay_play(info, argp);
 		up(&msm_fb_ioctl_ppp_sem);
 		break;
+	case MSMFB_OVERLAY_COMMIT:
+		down(&msm_fb_ioctl_ppp_sem);
+		ret = msmfb_overlay_commit(info, argp);
+		up(&msm_fb_ioctl_ppp_sem);
+		break;
 	case MSMFB_OVERLAY_PLAY_ENABLE:
 		down(&msm_fb_ioctl_ppp_sem);
 		ret = msmfb_overlay_play_enable(info, argp);
@@ -96,6 +96,9 @@ enum pmem_allocator_type {
 
 	PMEM_ALLOCATORTYPE_ALLORNOTHING,
 	PMEM_ALLOCATORTYPE_BUDDYBESTFIT,
+	/* bitmap allocator whose user allocations may be migrated to
+	 * coalesce free space */
+	PMEM_ALLOCATORTYPE_MOVABLE,
 
 	PMEM_ALLOCATORTYPE_MAX,
 };
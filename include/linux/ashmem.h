@@ -32,6 +32,17 @@ struct ashmem_pin {
 	__u32 len;	/* length forward from offset, in bytes, page-aligned */
 };
 
+/* For ASHMEM_PIN_RANGES and ASHMEM_UNPIN_RANGES */
+#define ASHMEM_MAX_PIN_RANGES	1024
+
+struct ashmem_pin_ranges {
+	__u64 ranges;	/* user pointer to an array of struct ashmem_pin */
+	__u64 purged;	/* optional user pointer to __u32[count], filled in with
+			 * each range's ASHMEM_PIN result by ASHMEM_PIN_RANGES */
+	__u32 count;	/* number of ranges, at most ASHMEM_MAX_PIN_RANGES */
+	__u32 reserved;
+};
+
 #define __ASHMEMIOC		0x77
 
 #define ASHMEM_SET_NAME		_IOW(__ASHMEMIOC, 1, char[ASHMEM_NAME_LEN])
@@ -46,6 +57,8 @@ struct ashmem_pin {
 #define ASHMEM_PURGE_ALL_CACHES	_IO(__ASHMEMIOC, 10)
 #define ASHMEM_CACHE_FLUSH_RANGE	_IO(__ASHMEMIOC, 11)
 #define ASHMEM_CACHE_CLEAN_RANGE	_IO(__ASHMEMIOC, 12)
+#define ASHMEM_PIN_RANGES	_IOW(__ASHMEMIOC, 13, struct ashmem_pin_ranges)
+#define ASHMEM_UNPIN_RANGES	_IOW(__ASHMEMIOC, 14, struct ashmem_pin_ranges)
 
 int get_ashmem_file(int fd, struct file **filp, struct file **vm_file,
 			unsigned long *len);
@@ -463,6 +463,18 @@ struct kgsl_drawctxt_set_bin_base_offset {
 #define IOCTL_KGSL_DRAWCTXT_SET_BIN_BASE_OFFSET \
 	_IOW(KGSL_IOC_TYPE, 0x25, struct kgsl_drawctxt_set_bin_base_offset)
 
+/* create a fence for a timestamp on this device.  The returned fd
+ * polls readable (POLLIN) once the timestamp has retired, and may be
+ * waited on from any number of threads.  Close it when done.
+ */
+struct kgsl_timestamp_fence {
+	unsigned int timestamp;
+	int fd; /* output param */
+};
+
+#define IOCTL_KGSL_TIMESTAMP_FENCE \
+	_IOWR(KGSL_IOC_TYPE, 0x26, struct kgsl_timestamp_fence)
+
 enum kgsl_cmdwindow_type {
 	KGSL_CMDWINDOW_MIN     = 0x00000000,
 	KGSL_CMDWINDOW_2D      = 0x00000000,
@@ -48,6 +48,8 @@
 #define MSMFB_OVERLAY_CHANGE_ZORDER_VG_PIPES	_IOW(MSMFB_IOCTL_MAGIC, 146, unsigned int)
 #define MSMFB_OVERLAY_3D       _IOWR(MSMFB_IOCTL_MAGIC, 147, \
 						struct msmfb_overlay_3d)
+#define MSMFB_OVERLAY_COMMIT   _IOW(MSMFB_IOCTL_MAGIC, 148, \
+						struct msmfb_overlay_commit)
 
 #endif
 
@@ -221,6 +223,23 @@ struct mdp_overlay {
 	uint32_t user_data[8];
 };
 
+/*
+ * one frame worth of overlay buffers, all on the same mixer. The pipes
+ * must already exist (MSMFB_OVERLAY_SET); entry i whose bit is set in
+ * 'set' also takes new geometry, format and blend from overlay[i] as
+ * MSMFB_OVERLAY_SET would. Everything is applied, programmed and latched
+ * by a single flush under one lock.
+ */
+#define MSMFB_OVERLAY_COMMIT_MAX	4
+
+struct msmfb_overlay_commit {
+	uint32_t flags;		/* MDP_OV_PLAY_NOWAIT */
+	uint32_t count;
+	struct msmfb_overlay_data data[MSMFB_OVERLAY_COMMIT_MAX];
+	uint32_t set;		/* bit i: apply overlay[i] to data[i].id */
+	struct mdp_overlay overlay[MSMFB_OVERLAY_COMMIT_MAX];
+};
+
 struct msmfb_overlay_3d {
 	uint32_t is_3d;
 	uint32_t width;
@@ -27,6 +27,12 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/rbtree.h>
+#include <linux/spinlock.h>
+#include <linux/percpu.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/shmem_fs.h>
 #include <linux/ashmem.h>
 
@@ -37,12 +43,13 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct mutex mutex;		/* protects this area */
+	struct rb_root unpinned;	/* unpinned ranges, by page */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long vm_start;		/* Start address of vm_area
@@ -53,29 +60,57 @@ struct ashmem_area {
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' also by that LRU's lock
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node node;		/* node in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
+	int lru_cpu;			/* whose LRU list we are on */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
-static LIST_HEAD(ashmem_lru_list);
+/*
+ * ashmem_lru - LRU list of unpinned pages
+ *
+ * There is one per CPU, and ranges go on the list of the CPU that unpinned
+ * them, so unpins on different CPUs don't share a lock. The shrinker takes
+ * the oldest range of each list in turn.
+ *
+ * Lock Ordering: asma->mutex -> i_mutex -> i_alloc_sem
+ *                asma->mutex -> lru->lock
+ * The shrinker finds areas through the LRU, so it only trylocks them.
+ */
+struct ashmem_lru {
+	spinlock_t lock;
+	struct list_head list;
+	unsigned long count;		/* pages on the list */
+};
+
+static DEFINE_PER_CPU(struct ashmem_lru, ashmem_lru);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
-static unsigned long lru_count;
+/* Where the next shrink starts, so no CPU's list is favoured */
+static int ashmem_shrink_cpu;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
- *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * ashmem_stats - purge throughput and pin/unpin contention, shown in
+ * debugfs as ashmem/stats. Protected by ashmem_stats_lock.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static struct ashmem_stats {
+	u64 shrinks;			/* shrinker calls that purged */
+	u64 pages_purged;
+	u64 ranges_purged;
+	u64 truncates;			/* vmtruncate_range calls for those */
+	u64 purge_ns;			/* time spent purging */
+	u64 purge_busy;			/* areas skipped, their lock was busy */
+	u64 lock_waits;			/* pins/unpins that found the area busy */
+	u64 lock_wait_ns;
+	u64 lock_wait_max_ns;
+} ashmem_stats;
+
+static DEFINE_SPINLOCK(ashmem_stats_lock);
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -106,29 +141,122 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
 
 static inline void lru_add(struct ashmem_range *range)
 {
-	list_add_tail(&range->lru, &ashmem_lru_list);
-	lru_count += range_size(range);
+	struct ashmem_lru *lru;
+
+	range->lru_cpu = raw_smp_processor_id();
+	lru = &per_cpu(ashmem_lru, range->lru_cpu);
+
+	spin_lock(&lru->lock);
+	list_add_tail(&range->lru, &lru->list);
+	lru->count += range_size(range);
+	spin_unlock(&lru->lock);
 }
 
 static inline void lru_del(struct ashmem_range *range)
 {
+	struct ashmem_lru *lru = &per_cpu(ashmem_lru, range->lru_cpu);
+
+	spin_lock(&lru->lock);
 	list_del(&range->lru);
-	lru_count -= range_size(range);
+	lru->count -= range_size(range);
+	spin_unlock(&lru->lock);
+}
+
+static unsigned long lru_count(void)
+{
+	unsigned long count = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		count += per_cpu(ashmem_lru, cpu).count;
+
+	return count;
+}
+
+/*
+ * range_first - find the lowest unpinned range that ends at or after 'page'.
+ *
+ * Unpinned ranges never overlap, so ordered by start they are also ordered
+ * by end, and the tree can be searched on either.
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_first(struct ashmem_area *asma, size_t page)
+{
+	struct rb_node *node = asma->unpinned.rb_node;
+	struct ashmem_range *range, *found = NULL;
+
+	while (node) {
+		range = rb_entry(node, struct ashmem_range, node);
+		if (range_before_page(range, page)) {
+			node = node->rb_right;
+		} else {
+			found = range;
+			node = node->rb_left;
+		}
+	}
+
+	return found;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *node = rb_next(&range->node);
+
+	return node ? rb_entry(node, struct ashmem_range, node) : NULL;
+}
+
+static void range_insert(struct ashmem_area *asma, struct ashmem_range *range)
+{
+	struct rb_node **p = &asma->unpinned.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, node);
+		if (range->pgstart < entry->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&range->node, parent, p);
+	rb_insert_color(&range->node, &asma->unpinned);
+}
+
+/*
+ * range_add - initialize a zeroed ashmem_range structure and insert it
+ *
+ * Same arguments as range_alloc, for a range the caller allocated.
+ *
+ * Caller must hold asma->mutex.
+ */
+static void range_add(struct ashmem_area *asma, struct ashmem_range *range,
+		      unsigned int purged, size_t start, size_t end)
+{
+	range->asma = asma;
+	range->pgstart = start;
+	range->pgend = end;
+	range->purged = purged;
+
+	range_insert(asma, range);
+
+	if (range_on_lru(range))
+		lru_add(range);
 }
 
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -137,22 +265,13 @@ static int range_alloc(struct ashmem_area *asma,
 	if (unlikely(!range))
 		return -ENOMEM;
 
-	range->asma = asma;
-	range->pgstart = start;
-	range->pgend = end;
-	range->purged = purged;
-
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
-
-	if (range_on_lru(range))
-		lru_add(range);
-
+	range_add(asma, range, purged, start, end);
 	return 0;
 }
 
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
+	rb_erase(&range->node, &range->asma->unpinned);
 	if (range_on_lru(range))
 		lru_del(range);
 	kmem_cache_free(ashmem_range_cachep, range);
@@ -161,18 +280,24 @@ static void range_del(struct ashmem_range *range)
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold range->asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
 {
+	struct ashmem_lru *lru = &per_cpu(ashmem_lru, range->lru_cpu);
 	size_t pre = range_size(range);
 
+	if (range_on_lru(range))
+		spin_lock(&lru->lock);
+
 	range->pgstart = start;
 	range->pgend = end;
 
-	if (range_on_lru(range))
-		lru_count -= pre - range_size(range);
+	if (range_on_lru(range)) {
+		lru->count -= pre - range_size(range);
+		spin_unlock(&lru->lock);
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -188,7 +313,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	mutex_init(&asma->mutex);
+	asma->unpinned = RB_ROOT;
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -199,12 +325,12 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *node;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((node = rb_first(&asma->unpinned)))
+		range_del(rb_entry(node, struct ashmem_range, node));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -219,7 +345,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -240,7 +366,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -249,7 +375,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -270,7 +396,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -287,7 +413,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -331,10 +457,100 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	asma->vm_start = vma->vm_start;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_purge_area - purge the unpinned ranges of an area, up to about
+ * 'nr_to_scan' pages, and return how many pages went.
+ *
+ * Ranges that touch are truncated with a single call. The unpinned tree is
+ * walked in page order, so a run grows at its end.
+ *
+ * Caller must hold asma->mutex.
+ */
+static int ashmem_purge_area(struct ashmem_area *asma, int nr_to_scan,
+			     unsigned int *nr_ranges, unsigned int *nr_truncates)
+{
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_range *range;
+	struct rb_node *node;
+	size_t start = 0, end = 0;
+	int freed = 0, run = 0;
+
+	for (node = rb_first(&asma->unpinned); node; node = rb_next(node)) {
+		range = rb_entry(node, struct ashmem_range, node);
+		if (!range_on_lru(range))
+			continue;
+
+		if (freed >= nr_to_scan)
+			break;
+		if (run && range->pgstart != end + 1) {
+			vmtruncate_range(inode, start * PAGE_SIZE,
+					 (end + 1) * PAGE_SIZE - 1);
+			(*nr_truncates)++;
+			run = 0;
+		}
+
+		lru_del(range);
+		range->purged = ASHMEM_WAS_PURGED;
+		(*nr_ranges)++;
+		freed += range_size(range);
+
+		if (!run)
+			start = range->pgstart;
+		end = range->pgend;
+		run = 1;
+	}
+
+	if (run) {
+		vmtruncate_range(inode, start * PAGE_SIZE,
+				 (end + 1) * PAGE_SIZE - 1);
+		(*nr_truncates)++;
+	}
+
+	return freed;
+}
+
+/*
+ * ashmem_shrink_lru - purge the area owning the oldest range on 'lru'.
+ *
+ * Returns the pages freed, 0 if the list is empty and -EBUSY if the area
+ * is locked; its range then goes to the back of the list.
+ */
+static int ashmem_shrink_lru(struct ashmem_lru *lru, int nr_to_scan,
+			     unsigned int *nr_ranges, unsigned int *nr_truncates)
+{
+	struct ashmem_range *range;
+	struct ashmem_area *asma;
+	int freed;
+
+	spin_lock(&lru->lock);
+	if (list_empty(&lru->list)) {
+		spin_unlock(&lru->lock);
+		return 0;
+	}
+
+	/*
+	 * The range being on the list keeps its area alive: release() must
+	 * take the area's mutex and this lock to take it off.
+	 */
+	range = list_first_entry(&lru->list, struct ashmem_range, lru);
+	asma = range->asma;
+	if (!mutex_trylock(&asma->mutex)) {
+		list_move_tail(&range->lru, &lru->list);
+		spin_unlock(&lru->lock);
+		return -EBUSY;
+	}
+	spin_unlock(&lru->lock);
+
+	freed = ashmem_purge_area(asma, nr_to_scan, nr_ranges, nr_truncates);
+	mutex_unlock(&asma->mutex);
+
+	return freed;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -346,37 +562,60 @@ out:
  * Return value is the number of objects (pages) remaining, or -1 if we cannot
  * proceed without risk of deadlock (due to gfp_mask).
  *
- * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * We approximate LRU via least-recently-unpinned: going round the per-CPU
+ * lists, we take the oldest range and purge its area's unpinned chunks in
+ * one go, until we hit 'nr_to_scan' pages freed. Areas that are busy being
+ * pinned or unpinned are skipped rather than waited for.
  */
 static int ashmem_shrink(struct shrinker *s, int nr_to_scan, gfp_t gfp_mask)
 {
-	struct ashmem_range *range, *next;
+	unsigned int nr_ranges = 0, nr_truncates = 0, busy = 0, misses = 0;
+	int cpu, freed, total = 0;
+	ktime_t start;
+	u64 delta;
 
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (nr_to_scan && !(gfp_mask & __GFP_FS))
 		return -1;
 	if (!nr_to_scan)
-		return lru_count;
+		return lru_count();
+
+	start = ktime_get();
+	cpu = ashmem_shrink_cpu;
+
+	/* Give up once every list came up empty or busy twice running */
+	while (total < nr_to_scan && misses < 2 * num_possible_cpus()) {
+		cpu = cpumask_next(cpu, cpu_possible_mask);
+		if (cpu >= nr_cpu_ids)
+			cpu = cpumask_first(cpu_possible_mask);
+
+		freed = ashmem_shrink_lru(&per_cpu(ashmem_lru, cpu),
+					  nr_to_scan - total, &nr_ranges,
+					  &nr_truncates);
+		if (freed == -EBUSY)
+			busy++;
+		if (freed <= 0) {
+			misses++;
+			continue;
+		}
+		misses = 0;
+		total += freed;
+	}
+	ashmem_shrink_cpu = cpu;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
 
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
-
-		nr_to_scan -= range_size(range);
-		if (nr_to_scan <= 0)
-			break;
-	}
-	mutex_unlock(&ashmem_mutex);
+	spin_lock(&ashmem_stats_lock);
+	if (total)
+		ashmem_stats.shrinks++;
+	ashmem_stats.pages_purged += total;
+	ashmem_stats.ranges_purged += nr_ranges;
+	ashmem_stats.truncates += nr_truncates;
+	ashmem_stats.purge_ns += delta;
+	ashmem_stats.purge_busy += busy;
+	spin_unlock(&ashmem_stats_lock);
 
-	return lru_count;
+	return lru_count();
 }
 
 static struct shrinker ashmem_shrinker = {
@@ -388,7 +627,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -403,7 +642,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -411,7 +650,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -425,7 +664,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -434,7 +673,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -451,7 +690,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -460,17 +699,17 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
-			break;
+	/* only the ranges that overlap [pgstart, pgend] are visited */
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to pin pages that span multiple ranges,
@@ -487,37 +726,34 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 		 *    so we have to update one side of the range and then
 		 *    create a new range for the other side.
 		 */
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret |= range->purged;
-
-			/* Case #1: Easy. Just nuke the whole thing. */
-			if (page_range_subsumes_range(range, pgstart, pgend)) {
-				range_del(range);
-				continue;
-			}
+		ret |= range->purged;
 
-			/* Case #2: We overlap from the start, so adjust it */
-			if (range->pgstart >= pgstart) {
-				range_shrink(range, pgend + 1, range->pgend);
-				continue;
-			}
+		/* Case #1: Easy. Just nuke the whole thing. */
+		if (page_range_subsumes_range(range, pgstart, pgend)) {
+			range_del(range);
+			continue;
+		}
 
-			/* Case #3: We overlap from the rear, so adjust it */
-			if (range->pgend <= pgend) {
-				range_shrink(range, range->pgstart, pgstart-1);
-				continue;
-			}
+		/* Case #2: We overlap from the start, so adjust it */
+		if (range->pgstart >= pgstart) {
+			range_shrink(range, pgend + 1, range->pgend);
+			continue;
+		}
 
-			/*
-			 * Case #4: We eat a chunk out of the middle. A bit
-			 * more complicated, we allocate a new range for the
-			 * second half and adjust the first chunk's endpoint.
-			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
-			range_shrink(range, range->pgstart, pgstart - 1);
-			break;
+		/* Case #3: We overlap from the rear, so adjust it */
+		if (range->pgend <= pgend) {
+			range_shrink(range, range->pgstart, pgstart-1);
+			continue;
 		}
+
+		/*
+		 * Case #4: We eat a chunk out of the middle. A bit
+		 * more complicated, we allocate a new range for the
+		 * second half and adjust the first chunk's endpoint.
+		 */
+		range_alloc(asma, range->purged, pgend + 1, range->pgend);
+		range_shrink(range, range->pgstart, pgstart - 1);
+		break;
 	}
 
 	return ret;
@@ -526,59 +762,110 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * If 'spare' points at a range, it is used instead of allocating one and
+ * cleared once it is, so the call can not fail.
+ *
+ * Caller must hold asma->mutex.
  */
-static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
+static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend,
+			struct ashmem_range **spare)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
-			break;
+	/*
+	 * The user can ask us to unpin pages that are already entirely
+	 * or partially pinned. We handle those two cases here. Growing
+	 * [pgstart, pgend] to cover a range can't make it reach one we
+	 * already passed, since ranges don't overlap.
+	 */
+	for (range = range_first(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
-		/*
-		 * The user can ask us to unpin pages that are already entirely
-		 * or partially pinned. We handle those two cases here.
-		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+
+		pgstart = min_t(size_t, range->pgstart, pgstart);
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	if (spare && *spare) {
+		range_add(asma, *spare, purged, pgstart, pgend);
+		*spare = NULL;
+		return 0;
+	}
+
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
-	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
+	struct ashmem_range *range = range_first(asma, pgstart);
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
+}
+
+/*
+ * pin_to_pages - check a user's ashmem_pin against the area and turn it into
+ * a page interval. Returns zero on success.
+ */
+static int pin_to_pages(struct ashmem_area *asma, struct ashmem_pin *pin,
+			size_t *pgstart, size_t *pgend)
+{
+	/* per custom, you can pass zero for len to mean "everything onward" */
+	if (!pin->len)
+		pin->len = PAGE_ALIGN(asma->size) - pin->offset;
+
+	if (unlikely((pin->offset | pin->len) & ~PAGE_MASK))
+		return -EINVAL;
+
+	if (unlikely(((__u32) -1) - pin->offset < pin->len))
+		return -EINVAL;
+
+	if (unlikely(PAGE_ALIGN(asma->size) < pin->offset + pin->len))
+		return -EINVAL;
+
+	*pgstart = pin->offset / PAGE_SIZE;
+	*pgend = *pgstart + (pin->len / PAGE_SIZE) - 1;
+
+	return 0;
+}
+
+/*
+ * ashmem_lock_area - take asma->mutex for a pin or unpin, counting the
+ * time spent waiting if someone else (usually the shrinker) has it.
+ */
+static void ashmem_lock_area(struct ashmem_area *asma)
+{
+	ktime_t start;
+	u64 delta;
+
+	if (mutex_trylock(&asma->mutex))
+		return;
+
+	start = ktime_get();
+	mutex_lock(&asma->mutex);
+	delta = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&ashmem_stats_lock);
+	ashmem_stats.lock_waits++;
+	ashmem_stats.lock_wait_ns += delta;
+	if (delta > ashmem_stats.lock_wait_max_ns)
+		ashmem_stats.lock_wait_max_ns = delta;
+	spin_unlock(&ashmem_stats_lock);
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -594,38 +881,131 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	if (unlikely(copy_from_user(&pin, p, sizeof(pin))))
 		return -EFAULT;
 
-	/* per custom, you can pass zero for len to mean "everything onward" */
-	if (!pin.len)
-		pin.len = PAGE_ALIGN(asma->size) - pin.offset;
-
-	if (unlikely((pin.offset | pin.len) & ~PAGE_MASK))
-		return -EINVAL;
-
-	if (unlikely(((__u32) -1) - pin.offset < pin.len))
-		return -EINVAL;
-
-	if (unlikely(PAGE_ALIGN(asma->size) < pin.offset + pin.len))
+	if (unlikely(pin_to_pages(asma, &pin, &pgstart, &pgend)))
 		return -EINVAL;
 
-	pgstart = pin.offset / PAGE_SIZE;
-	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
-
-	mutex_lock(&ashmem_mutex);
+	ashmem_lock_area(asma);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
 		ret = ashmem_pin(asma, pgstart, pgend);
 		break;
 	case ASHMEM_UNPIN:
-		ret = ashmem_unpin(asma, pgstart, pgend);
+		ret = ashmem_unpin(asma, pgstart, pgend, NULL);
 		break;
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_get_pin_status(asma, pgstart, pgend);
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
+
+	return ret;
+}
+
+/*
+ * ashmem_pin_unpin_ranges - ASHMEM_PIN_RANGES and ASHMEM_UNPIN_RANGES
+ *
+ * Applies an array of ashmem_pin under a single lock of the area. All of
+ * the ranges are checked, and for unpinning the range structures they may
+ * need are allocated, before any is applied, so a bad range or a lack of
+ * memory fails the call without side effects. Pinning returns
+ * ASHMEM_WAS_PURGED if any of the ranges was purged and, if asked, each
+ * range's result.
+ */
+static int ashmem_pin_unpin_ranges(struct ashmem_area *asma, unsigned long cmd,
+				   void __user *p)
+{
+	struct ashmem_pin_ranges req;
+	struct ashmem_pin *pins;
+	struct ashmem_range **spare = NULL;
+	__u32 *purged = NULL;
+	size_t pgstart, pgend;
+	int i, ret = 0;
+
+	if (unlikely(!asma->file))
+		return -EINVAL;
+
+	if (unlikely(copy_from_user(&req, p, sizeof(req))))
+		return -EFAULT;
+
+	if (!req.count)
+		return 0;
+	if (unlikely(req.count > ASHMEM_MAX_PIN_RANGES))
+		return -EINVAL;
+
+	pins = kmalloc(req.count * sizeof(*pins), GFP_KERNEL);
+	if (unlikely(!pins))
+		return -ENOMEM;
+
+	if (unlikely(copy_from_user(pins,
+			(void __user *)(unsigned long)req.ranges,
+			req.count * sizeof(*pins)))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < req.count; i++) {
+		if (unlikely(pin_to_pages(asma, &pins[i], &pgstart, &pgend))) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (cmd == ASHMEM_PIN_RANGES && req.purged) {
+		purged = kmalloc(req.count * sizeof(*purged), GFP_KERNEL);
+		if (unlikely(!purged)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
 
+	/* each unpinned range adds at most one range structure */
+	if (cmd == ASHMEM_UNPIN_RANGES) {
+		spare = kzalloc(req.count * sizeof(*spare), GFP_KERNEL);
+		if (unlikely(!spare)) {
+			ret = -ENOMEM;
+			goto out;
+		}
+		for (i = 0; i < req.count; i++) {
+			spare[i] = kmem_cache_zalloc(ashmem_range_cachep,
+						     GFP_KERNEL);
+			if (unlikely(!spare[i])) {
+				ret = -ENOMEM;
+				goto out;
+			}
+		}
+	}
+
+	ashmem_lock_area(asma);
+	for (i = 0; i < req.count; i++) {
+		pgstart = pins[i].offset / PAGE_SIZE;
+		pgend = pgstart + (pins[i].len / PAGE_SIZE) - 1;
+
+		if (cmd == ASHMEM_PIN_RANGES) {
+			int was_purged = ashmem_pin(asma, pgstart, pgend);
+
+			if (purged)
+				purged[i] = was_purged;
+			ret |= was_purged;
+		} else
+			ashmem_unpin(asma, pgstart, pgend, &spare[i]);
+	}
+	mutex_unlock(&asma->mutex);
+
+	if (purged && copy_to_user((void __user *)(unsigned long)req.purged,
+				   purged, req.count * sizeof(*purged)))
+		ret = -EFAULT;
+
+out:
+	if (spare) {
+		for (i = 0; i < req.count; i++)
+			if (spare[i])
+				kmem_cache_free(ashmem_range_cachep, spare[i]);
+		kfree(spare);
+	}
+	kfree(purged);
+	kfree(pins);
 	return ret;
 }
 
@@ -676,7 +1056,7 @@ static int ashmem_flush_cache_range(struct ashmem_area *asma)
 	unsigned long addr;
 	unsigned int size, result = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	size = asma->size;
 	addr = asma->vm_start;
@@ -707,7 +1087,7 @@ static int ashmem_flush_cache_range(struct ashmem_area *asma)
 	mb();
 #endif
 done:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return 0;
 }
 
@@ -744,6 +1124,10 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_pin_unpin(asma, cmd, (void __user *) arg);
 		break;
+	case ASHMEM_PIN_RANGES:
+	case ASHMEM_UNPIN_RANGES:
+		ret = ashmem_pin_unpin_ranges(asma, cmd, (void __user *) arg);
+		break;
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
@@ -813,6 +1197,43 @@ void put_ashmem_file(struct file *file)
 }
 EXPORT_SYMBOL(put_ashmem_file);
 
+static int ashmem_stats_show(struct seq_file *m, void *unused)
+{
+	struct ashmem_stats st;
+
+	spin_lock(&ashmem_stats_lock);
+	st = ashmem_stats;
+	spin_unlock(&ashmem_stats_lock);
+
+	seq_printf(m, "lru_pages: %lu\n", lru_count());
+	seq_printf(m, "shrinks: %llu\n", st.shrinks);
+	seq_printf(m, "pages_purged: %llu\n", st.pages_purged);
+	seq_printf(m, "ranges_purged: %llu\n", st.ranges_purged);
+	seq_printf(m, "truncates: %llu\n", st.truncates);
+	seq_printf(m, "purge_ns: %llu\n", st.purge_ns);
+	seq_printf(m, "purge_busy: %llu\n", st.purge_busy);
+	seq_printf(m, "lock_waits: %llu\n", st.lock_waits);
+	seq_printf(m, "lock_wait_ns: %llu\n", st.lock_wait_ns);
+	seq_printf(m, "lock_wait_max_ns: %llu\n", st.lock_wait_max_ns);
+
+	return 0;
+}
+
+static int ashmem_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ashmem_stats_show, NULL);
+}
+
+static const struct file_operations ashmem_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ashmem_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static struct dentry *ashmem_debugfs_dir;
+
 static struct file_operations ashmem_fops = {
 	.owner = THIS_MODULE,
 	.open = ashmem_open,
@@ -832,7 +1253,14 @@ static struct miscdevice ashmem_misc = {
 
 static int __init ashmem_init(void)
 {
-	int ret;
+	int ret, cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct ashmem_lru *lru = &per_cpu(ashmem_lru, cpu);
+
+		spin_lock_init(&lru->lock);
+		INIT_LIST_HEAD(&lru->list);
+	}
 
 	ashmem_area_cachep = kmem_cache_create("ashmem_area_cache",
 					  sizeof(struct ashmem_area),
@@ -858,6 +1286,11 @@ static int __init ashmem_init(void)
 
 	register_shrinker(&ashmem_shrinker);
 
+	ashmem_debugfs_dir = debugfs_create_dir("ashmem", NULL);
+	if (ashmem_debugfs_dir)
+		debugfs_create_file("stats", S_IRUGO, ashmem_debugfs_dir, NULL,
+				    &ashmem_stats_fops);
+
 	printk(KERN_INFO "ashmem: initialized\n");
 
 	return 0;
@@ -867,6 +1300,7 @@ static void __exit ashmem_exit(void)
 {
 	int ret;
 
+	debugfs_remove_recursive(ashmem_debugfs_dir);
 	unregister_shrinker(&ashmem_shrinker);
 
 	ret = misc_deregister(&ashmem_misc);